@@ -18,167 +18,74 @@ bool Lexer::isSpecial(char c)
 		c == ':';
 }
 
-bool Lexer::isGroup(char c)
+bool Lexer::isComment(std::string_view s, size_t i)
 {
-	beg_char = c;
-	switch (c)
-	{
-	case '"':
-		end_char = '"';
-		return true;
-	case '(':
-		end_char = ')';
-		return true;
-	case ')':
-		return true;
-	default:
-		return false;
-	}
+	return s[i] == '/' && i + 1 < s.length() && s[i + 1] == '/';
 }
 
-std::vector<std::string> Lexer::lex(const std::string& s)
+/* one past the "..." or (...) that starts at i, or the end of s if it is not closed */
+size_t Lexer::groupEnd(std::string_view s, size_t i)
 {
-	std::vector<std::string> out;
-	char lexeme[256];
-	size_t i = 0, j = 0;
-	State state = State::START;
-	int done = 0;
-	size_t len = s.length();
+	const size_t len = s.length();
+	if (s[i] == '"')
+	{
+		for (++i; i < len; ++i)
+		{
+			if (s[i] == '\\')
+				++i;
+			else if (s[i] == '"')
+				return i + 1;
+		}
+		return len;
+	}
 	int balance = 0;
+	for (; i < len; ++i)
+	{
+		if (s[i] == '(')
+			balance++;
+		else if (s[i] == ')' && --balance <= 0)
+			return i + 1;
+	}
+	return len;
+}
 
-#define addchar() { lexeme[j] = s[i]; i++; j++; }
-#define addlex() { lexeme[j] = 0; out.push_back(lexeme); j = 0; }
-
+void Lexer::lex(std::string_view s, std::vector<std::string_view>* out) const
+{
+	out->clear();
+	const size_t len = s.length();
+	size_t i = 0;
 	while (i < len)
 	{
-		switch (state)
-		{
-		case State::START:
+		if (isSpace(s[i]))
 		{
-			if (isSpace(s[i]))
-			{
-				state = State::SKIP;
-			}
-			else if (isGroup(s[i]))
-			{
-				if (s[i] == '"')
-				{
-					addchar();
-				}
-				state = State::READBLOCK;
-			}
-			else if (s[i] == '/' && s[i + 1] == '/')
-			{
-				state = State::COMMENT;
-				i += 2;
-			}
-			else
-			{
-				state = State::READCHAR;
-			}
-			break;
+			i++;
 		}
-		case State::READCHAR:
+		else if (isComment(s, i))
 		{
-			if (isSpace(s[i]))
-			{
-				state = State::DUMP;
-			}
-			else if (s[i] == '\\')
-			{
-				i += 2;
-			}
-			else if (isGroup(s[i]))
-			{
-				if (s[i] == '"')
-				{
-					addchar();
-				}
-				state = State::READBLOCK;
-			}
-			else if (isSpecial(s[i]))
-			{
-				if (j == 0)
-				{
-					addchar();
-				}
-				state = State::DUMP;
-			}
-			else if (s[i] == '/' && s[i + 1] == '/')
-			{
-				state = State::COMMENT;
-				i += 2;
-			}
-			else
-			{
-				addchar();
-			}
-			break;
-		}
-		case State::READBLOCK:
-		{
-			if (s[i] == beg_char && s[i] != '"')
-			{
-				balance++;
-				addchar();
-			}
-			else if (s[i] == end_char)
-			{
-				balance--;
-				addchar();
-				if (balance <= 0)
-				{
-					state = State::DUMP;
-				}
-			}
-			else if (end_char == '"' && s[i] == '\\')
-			{
-				// TODO: actually record chars
-				i += 2;
-			}
-			else
-			{
-				addchar();
-			}
-			break;
-		}
-		case State::SKIP:
-		{
-			if (isSpace(s[i]))
-			{
+			// up to the newline, which lexing a whole file carries on from
+			while (i < len && s[i] != '\n')
 				i++;
-			}
-			else
-			{
-				state = State::READCHAR;
-			}
-			break;
 		}
-		case State::DUMP:
+		else if (isSpecial(s[i]))
 		{
-			if (j > 0) addlex();
-			state = State::START;
-			break;
+			out->push_back(s.substr(i, 1));
+			i++;
 		}
-		case State::COMMENT:
+		else
 		{
-			if (s[i] != '\n')
+			const size_t start = i;
+			while (i < len && !isSpace(s[i]) && !isSpecial(s[i]) && !isComment(s, i))
 			{
-				i++;
-			}
-			else
-			{
-				state = State::READCHAR;
+				if (s[i] == '"' || s[i] == '(')
+				{
+					// a group ends the token
+					i = groupEnd(s, i);
+					break;
+				}
+				// skip whatever is escaped
+				i += s[i] == '\\' && i + 1 < len ? 2 : 1;
 			}
-			break;
-		}
-		case State::END:
-			i = len;
-			break;
+			out->push_back(s.substr(start, i - start));
 		}
 	}
-	
-	if (j > 0) addlex();
-
-	return out;
 }
@@ -1,28 +1,31 @@
 #pragma once
 
 #include <iostream>
+#include <string_view>
 #include <vector>
 
 typedef uint8_t byte;
 
-enum class State : byte
-{
-	START,
-	READCHAR,
-	READBLOCK,
-	SKIP,
-	DUMP,
-	COMMENT,
-	END
-};
-
+/* LEXER
+	tokens are views into the source, which is usually the mapped input
+	file, so lexing copies nothing and allocates nothing per token.
+		whitespace separates tokens
+		// comments out the rest of the line
+		[ ] , : are tokens on their own
+		"..." and (...) (which nests) are one token, brackets included.
+		they also end the token they are part of
+		\ makes the next character ordinary. tokens are not unescaped, the
+		backslash stays in the view
+*/
 class Lexer
 {
 private:
-	bool isSpace(char);
-	bool isSpecial(char);
-	bool isGroup(char);
-	char end_char, beg_char;
+	static bool isSpace(char);
+	static bool isSpecial(char);
+	static bool isComment(std::string_view, size_t);
+	static size_t groupEnd(std::string_view, size_t);
 public:
-	std::vector<std::string> lex(const std::string&);
-};
\ No newline at end of file
+	/* tokens of s into out, which is cleared first so one vector can be
+	   reused from line to line. the views live as long as s does */
+	void lex(std::string_view s, std::vector<std::string_view>* out) const;
+};
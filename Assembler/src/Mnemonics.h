@@ -0,0 +1,146 @@
+#pragma once
+
+#include <string_view>
+
+#include "Definitions.h"
+
+/* REGVM MNEMONICS
+	every mnemonic compileForRegVM understands, with how its operands are
+	assembled (Form) and the opcodes it turns into. lookup is a perfect hash
+	built from this table at compile time: the seed is searched for until
+	every name lands in its own slot, so finding a mnemonic is one hash and
+	one compare.
+*/
+namespace Mnemonics
+{
+	using op = VMs::Reg::Opcode;
+
+	enum class Form : byte
+	{
+		PROC,		// proc name
+		ENDP,
+		CALL,		// call proc | address | reg
+		PLAIN,		// no operands
+		JUMP,		// jcc label | address, fused with a cmp right before it
+		REG,		// op reg
+		REG_REG,	// op reg reg
+		REG_IMM,	// op reg reg, or iopcode reg imm if the second operand is an integer
+		COMPARE,	// REG_IMM that a following jump can fuse with
+		SHIFT,		// op reg imm. there is no register form, a register count is an error
+		MOV,
+		PUSH,
+		POP
+	};
+
+	struct Mnemonic
+	{
+		std::string_view name;
+		Form form;
+		byte opcode;
+		byte iopcode;	// REG_IMM and COMPARE: register-immediate form
+	};
+
+	constexpr Mnemonic TABLE[] =
+	{
+		{ "proc",	Form::PROC,		0,			0 },
+		{ "endp",	Form::ENDP,		0,			0 },
+		/* calling */
+		{ "call",	Form::CALL,		op::CALLI,	0 },
+		{ "ret",	Form::PLAIN,	op::RET,	0 },
+		/* jumping */
+		{ "jmp",	Form::JUMP,		op::JMP,	0 },
+		{ "je",		Form::JUMP,		op::JE,		0 },
+		{ "jz",		Form::JUMP,		op::JZ,		0 },
+		{ "jne",	Form::JUMP,		op::JNE,	0 },
+		{ "jnz",	Form::JUMP,		op::JNZ,	0 },
+		{ "jgt",	Form::JUMP,		op::JGT,	0 },
+		{ "jlt",	Form::JUMP,		op::JLT,	0 },
+		{ "jge",	Form::JUMP,		op::JGE,	0 },
+		{ "jle",	Form::JUMP,		op::JLE,	0 },
+		/* arithmetic */
+		{ "add",	Form::REG_IMM,	op::ADD,	op::ADDI },
+		{ "sub",	Form::REG_IMM,	op::SUB,	op::SUBI },
+		{ "mul",	Form::REG_REG,	op::MUL,	0 },
+		{ "div",	Form::REG_REG,	op::DIV,	0 },
+		{ "mod",	Form::REG_REG,	op::MOD,	0 },
+		{ "cmp",	Form::COMPARE,	op::CMP,	op::CMPI },
+		{ "and",	Form::REG_IMM,	op::AND,	op::ANDI },
+		{ "or",		Form::REG_REG,	op::OR,		0 },
+		{ "xor",	Form::REG_REG,	op::XOR,	0 },
+		{ "not",	Form::REG,		op::NOT,	0 },
+		{ "shr",	Form::SHIFT,	op::SHR,	0 },
+		{ "shl",	Form::SHIFT,	op::SHL,	0 },
+		{ "inc",	Form::REG,		op::INC,	0 },
+		{ "dec",	Form::REG,		op::DEC,	0 },
+		/* registers */
+		{ "clf",	Form::PLAIN,	op::CLF,	0 },
+		{ "mov",	Form::MOV,		op::MOV,	0 },
+		{ "push",	Form::PUSH,		op::PUSH,	0 },
+		{ "pushf",	Form::PLAIN,	op::PUSHF,	0 },
+		{ "pop",	Form::POP,		op::POP,	0 },
+		{ "popf",	Form::PLAIN,	op::POPF,	0 },
+		/* misc */
+		{ "nop",	Form::PLAIN,	op::NOP,	0 },
+		{ "int",	Form::PLAIN,	op::INT,	0 },
+		{ "halt",	Form::PLAIN,	op::HALT,	0 },
+	};
+	constexpr size_t COUNT = sizeof(TABLE) / sizeof(TABLE[0]);
+	// a power of two, big enough that a seed turns up within a few tries
+	constexpr size_t SLOTS = 256;
+
+	/* FNV-1a from seed */
+	constexpr u32 Hash(std::string_view name, u32 seed)
+	{
+		u32 hash = seed;
+		for (char c : name)
+			hash = (hash ^ static_cast<byte>(c)) * 16777619u;
+		return hash;
+	}
+
+	constexpr bool Separates(u32 seed)
+	{
+		bool used[SLOTS] = {};
+		for (const Mnemonic& m : TABLE)
+		{
+			const size_t slot = Hash(m.name, seed) % SLOTS;
+			if (used[slot])
+				return false;
+			used[slot] = true;
+		}
+		return true;
+	}
+
+	constexpr u32 FindSeed()
+	{
+		u32 seed = 2166136261u;
+		while (!Separates(seed))
+			++seed;
+		return seed;
+	}
+
+	constexpr u32 SEED = FindSeed();
+
+	/* TABLE index + 1 per slot, 0 if the slot is empty */
+	struct Slots
+	{
+		byte entry[SLOTS] = {};
+	};
+
+	constexpr Slots MakeSlots()
+	{
+		Slots slots;
+		for (size_t i = 0; i < COUNT; ++i)
+			slots.entry[Hash(TABLE[i].name, SEED) % SLOTS] = static_cast<byte>(i + 1);
+		return slots;
+	}
+
+	constexpr Slots SLOT_TABLE = MakeSlots();
+	static_assert(COUNT < 256, "slots hold a byte");
+
+	/* the mnemonic called name, or nullptr */
+	inline const Mnemonic* Find(std::string_view name)
+	{
+		const byte entry = SLOT_TABLE.entry[Hash(name, SEED) % SLOTS];
+		return entry && TABLE[entry - 1].name == name ? &TABLE[entry - 1] : nullptr;
+	}
+}
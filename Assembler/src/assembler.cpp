@@ -6,14 +6,20 @@
 #include <cassert>
 #include <functional>
 #include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <algorithm>
 #include "Lexer.h"
 #include "Definitions.h"
 #include "Instruction.h"
+#include "Bytecode.h"
+#include "MappedFile.h"
+#include "Mnemonics.h"
 
 void PrintUsage(const char*);
-std::vector<i32> compileForStackVM(const std::string& filecontents);
-i32 mapToStackVmInstruction(const std::string& s);
-std::vector<byte> compileForRegVM(const std::vector<std::string>& lines);
+std::vector<i32> compileForStackVM(std::string_view filecontents);
+i32 mapToStackVmInstruction(std::string_view s);
+std::vector<byte> compileForRegVM(const std::vector<std::string_view>& lines, size_t threads);
 template<typename T>
 void AppendToCode(std::vector<byte>* out, const T& op)
 {
@@ -34,13 +40,17 @@ void AppendToCode(std::vector<byte>* out, const T& op)
 }
 
 template<typename T> void InsertInCode(std::vector<byte>* out, size_t offset, const T& op);
-bool isInteger(const std::string& s);
+bool isInteger(std::string_view s);
+u64 integerValue(std::string_view s);
+u64 regcodeOf(std::string_view s);
+bool fuseCompareBranch(std::vector<byte>* code, size_t cmpOffset, byte jump);
 
 int main(int argc, char** argv)
 {
 	const char* inputfile = nullptr; // <path>
 	const char* outputfile = nullptr; // -o <path>
-	const char* mode = nullptr; // -m <s/r>
+	const char* mode = nullptr; // -m <s/sr/r/r2>
+	const char* jobs = nullptr; // -j <threads>
 
 #pragma warning(push)
 #pragma warning(disable: 28182)
@@ -79,6 +89,19 @@ int main(int argc, char** argv)
 				break;
 			}
 		}
+		else if (strcmp(argv[i], "-j") == 0)
+		{
+			if (jobs == nullptr && i + 1 < argc && argv[i - 1][0] != '-')
+			{
+				jobs = argv[i + 1];
+				i++;
+			}
+			else
+			{
+				validArgs = false;
+				break;
+			}
+		}
 		else if (inputfile == nullptr && argv[i - 1][0] != '-')
 		{
 			inputfile = argv[i];
@@ -99,22 +122,45 @@ int main(int argc, char** argv)
 		PrintUsage(argv[0]);
 		return -1;
 	}
-	// read input file
-	std::ifstream infile(inputfile);
-	if (!infile.is_open())
+	// map input file, tokens and lines are views into it
+	MappedFile infile(inputfile);
+	if (!infile.Valid())
 	{
 		std::cout << "error: unable to open file [" << inputfile << "]" << std::endl;
 		return -1;
 	}
-	std::string line;
-	std::string contents;
-	std::vector<std::string> lines;
-	while (std::getline(infile, line)) { contents += line + '\n'; lines.push_back(line); }
-	infile.close();
+	const std::string_view contents(reinterpret_cast<const char*>(infile.Data()), infile.Size());
+	std::vector<std::string_view> lines;
+	for (size_t start = 0; start < contents.size();)
+	{
+		size_t end = contents.find('\n', start);
+		if (end == std::string_view::npos)
+			end = contents.size();
+		lines.push_back(contents.substr(start, end - start));
+		start = end + 1;
+	}
 	// compile
-	if (*mode == 's')
+	if (strcmp(mode, "s") == 0 || strcmp(mode, "sr") == 0)
 	{
 		std::vector<i32> instructions = compileForStackVM(contents);
+		if (strcmp(mode, "sr") == 0)
+		{
+			// stack source, register vm program
+			std::vector<byte> translated;
+			if (!Bytecode::TranslateStack(reinterpret_cast<const byte*>(instructions.data()), instructions.size() * sizeof(i32), &translated))
+			{
+				std::cout << "error: program cannot be translated for the register vm (pops an empty stack)" << std::endl;
+				return -1;
+			}
+			std::ofstream ofile(outputfile, std::ios::binary);
+			if (!ofile.is_open())
+			{
+				std::cout << "error: unable to create output file [" << outputfile << "]" << std::endl;
+				return -1;
+			}
+			ofile.write(reinterpret_cast<char*>(translated.data()), translated.size());
+			return 0;
+		}
 		// write to file
 		std::ofstream ofile(outputfile, std::ios::binary);
 		if (!ofile.is_open())
@@ -126,9 +172,20 @@ int main(int argc, char** argv)
 			ofile.write(reinterpret_cast<char*>(&instructions[i]), sizeof(i32));
 		ofile.close();
 	}
-	else if (*mode == 'r')
+	else if (strcmp(mode, "r") == 0 || strcmp(mode, "r2") == 0)
 	{
-		std::vector<byte> instructions = compileForRegVM(lines);
+		std::vector<byte> instructions = compileForRegVM(lines, jobs ? std::strtoul(jobs, nullptr, 10) : 0);
+		if (strcmp(mode, "r2") == 0)
+		{
+			// compact v2 encoding
+			std::vector<byte> compact;
+			if (!Bytecode::Compact(instructions.data(), instructions.size(), &compact))
+			{
+				std::cout << "error: program cannot be encoded as v2 (jump/call target or register out of range)" << std::endl;
+				return -1;
+			}
+			instructions.swap(compact);
+		}
 		// write to file
 		std::ofstream ofile(outputfile, std::ios::binary);
 		if (!ofile.is_open())
@@ -151,13 +208,14 @@ int main(int argc, char** argv)
 
 void PrintUsage(const char* argv0)
 {
-	std::cout << "usage: " << argv0 << " <input file> -m <s/r> [-o <output file>]" << std::endl;
+	std::cout << "usage: " << argv0 << " <input file> -m <s/sr/r/r2> [-o <output file>] [-j <threads>]\n\tsr: stack source translated to a register vm program\n\t-j: threads assembling register vm procs (default: all cores)" << std::endl;
 }
 
-std::vector<i32> compileForStackVM(const std::string& filecontents)
+std::vector<i32> compileForStackVM(std::string_view filecontents)
 {
 	Lexer lexer;
-	std::vector<std::string> s = lexer.lex(filecontents);
+	std::vector<std::string_view> s;
+	lexer.lex(filecontents, &s);
 	std::vector<i32> instructions;
 	for (size_t i = 0; i < s.size(); i++)
 	{
@@ -175,12 +233,16 @@ std::vector<i32> compileForStackVM(const std::string& filecontents)
 	return instructions;
 }
 
-i32 mapToStackVmInstruction(const std::string& s)
+i32 mapToStackVmInstruction(std::string_view s)
 {
 	using op = VMs::Stack::Opcode;
 	if (isInteger(s))
 	{
-		return Instruction::Create(op::PUSH, std::stoi(s));
+		return Instruction::Create(op::PUSH, static_cast<i32>(integerValue(s)));
+	}
+	else if (s.size() > 1 && s[0] == '$' && isInteger(s.substr(1)) && std::isdigit(s[1]))
+	{
+		return Instruction::Create(op::COLUMN, static_cast<i32>(integerValue(s.substr(1))));
 	}
 	else if (s == "+")
 	{
@@ -225,34 +287,44 @@ void InsertInCode(std::vector<byte>* out, size_t offset, const T& op)
 #define APP(x) AppendToCode(&code, (x))
 #define INS(x, offset) InsertInCode(&code, (offset), (x))
 
-#define IS_REG(string) ( string == "a" || string == "b" || string == "c" || string == "ip" || string == "sp" || string == "f" )
-#define APP_REG(string) { \
-	if (string == "a") {APP(VMs::Reg::Regcode::A);		}	\
-	else if (string == "b") {APP(VMs::Reg::Regcode::B);	}	\
-	else if (string == "c")	{APP(VMs::Reg::Regcode::C);	}	\
-	else if (string == "ip") {APP(VMs::Reg::Regcode::IP);}	\
-	else if (string == "sp") {APP(VMs::Reg::Regcode::SP);}	\
-	else if (string == "f")	{APP(VMs::Reg::Regcode::F);	 } }
+// a, b, c, r0-r15, ip, sp, f
+#define IS_REG(string) ( regcodeOf(string) != (u64)-1 )
+#define APP_REG(string) { APP(regcodeOf(string)); }
 #define APP_REG_CHECK(string) {if (IS_REG(string)) {APP_REG(string);} else { ss.str(""); ss.clear(); ss << "invalid register identifier [" << string << "]"; errors.push_back({ss.str(), i}); } }
 
 #define CHECK_N_TOK(n) {if (tokens.size() != n) { ss.str(""); ss.clear(); ss << "instruction requires " << n << " tokens"; errors.push_back({ss.str(), i}); continue; }}
 
-#define APP_JMP_TARGET(token) {if (isInteger(token)) {APP(std::stoull(token));} else { bool found = false; for (const auto& l : labels)	{ if (l.name == token) { found = true; APP(l.addr); break;}} if (!found) { undefinedLabels[token].push_back(code.size()); APP((u64)-1); } }}
-#define APP_JMP(opcode) {CHECK_N_TOK(2); APP(opcode); APP_JMP_TARGET(tokens[1]);}
+#define APP_JMP_TARGET(token) {if (isInteger(token)) {APP(integerValue(token));} else { auto l = labels.find(token); if (l != labels.end()) { relocations.push_back(code.size()); APP(l->second); } else { undefinedLabels[token].push_back(code.size()); APP((u64)-1); } }}
+#define APP_JMP(opcode) {CHECK_N_TOK(2); if (!fuseCompareBranch(&code, lastCmp, (opcode))) APP(opcode); APP_JMP_TARGET(tokens[1]);}
 
 #define APP_ARITH_2(opcode) {CHECK_N_TOK(3); APP(opcode); APP_REG_CHECK(tokens[1]); APP_REG_CHECK(tokens[2]);}
+// register-immediate form when the second operand is an integer literal
+#define APP_ARITH_2I(opcode, iopcode) {CHECK_N_TOK(3); if (isInteger(tokens[2])) { APP(iopcode); APP_REG_CHECK(tokens[1]); APP(integerValue(tokens[2])); } else { APP(opcode); APP_REG_CHECK(tokens[1]); APP_REG_CHECK(tokens[2]); }}
 #define APP_ARITH_1(opcode) {CHECK_N_TOK(2); APP(opcode); APP_REG_CHECK(tokens[1]);}
+// the second operand has to be an integer literal
+#define APP_ARITH_I(opcode) {CHECK_N_TOK(3); if (isInteger(tokens[2])) { APP(opcode); APP_REG_CHECK(tokens[1]); APP(integerValue(tokens[2])); } else { ss.str(""); ss.clear(); ss << "expected an integer, not [" << tokens[2] << "]"; errors.push_back({ss.str(), i}); }}
 
 #define PUSH_INVALID_TOKEN_ERR(token) {ss.str(""); ss.clear(); ss << "invalid token [" << token << "]"; errors.push_back({ ss.str(), i });}
 
 #pragma endregion
 
-struct symbol
+// names are views into the source, which outlives assembly
+typedef std::unordered_map<std::string_view, u64> symbolTable;
+// code offsets of the placeholders waiting for each name
+typedef std::unordered_map<std::string_view, std::vector<size_t>> fixupTable;
+
+/* name has just been defined at the fragment relative addr: patch the
+   references already made to it, which then need relocating */
+void resolveFixups(std::vector<byte>* code, fixupTable* fixups, std::string_view name, u64 addr, std::vector<size_t>* relocations)
 {
-	std::string name;
-	u64 addr;
-	symbol(const std::string& nam, u64 address) : name(nam), addr(address) {}
-};
+	auto pending = fixups->find(name);
+	if (pending == fixups->end())
+		return;
+	for (size_t offset : pending->second)
+		InsertInCode(code, offset, addr);
+	relocations->insert(relocations->end(), pending->second.begin(), pending->second.end());
+	fixups->erase(pending);
+}
 
 struct error
 {
@@ -260,85 +332,90 @@ struct error
 	size_t lineIndex;
 };
 
-std::vector<byte> compileForRegVM(const std::vector<std::string>& lines)
+/* PARALLEL ASSEMBLY
+	labels only live until endp, so the source is cut after every endp and
+	the pieces are assembled on worker threads, each into a fragment whose
+	addresses start at 0. the link step lays the fragments out in source
+	order, adds each one's base to the label addresses it wrote
+	(relocations) and its procs, and only then patches calls, which are
+	all left to it. a jcc never fuses with a cmp across an endp.
+*/
+struct fragment
 {
-	Lexer lexer;
 	std::vector<byte> code;
 	std::vector<error> errors;
-	std::vector<symbol> procs;
-	size_t endpCount = 0;
-	std::vector<symbol> labels;
-	std::unordered_map<std::string, std::vector<size_t>> undefinedProcs;
-	std::unordered_map<std::string, std::vector<size_t>> undefinedLabels;
+	symbolTable procs;					// fragment relative
+	std::vector<std::pair<std::string_view, size_t>> calls;	// proc references: name, code offset
+	std::vector<size_t> relocations;	// code offsets of fragment relative addresses
+};
+
+/* lines [begin, end) into out, which starts empty */
+void assembleFragment(const std::vector<std::string_view>& lines, size_t begin, size_t end, fragment* out)
+{
+	Lexer lexer;
+	std::vector<std::string_view> tokens;	// reused for every line
+	std::vector<byte>& code = out->code;
+	std::vector<error>& errors = out->errors;
+	symbolTable& procs = out->procs;
+	std::vector<size_t>& relocations = out->relocations;
+	symbolTable labels;
+	fixupTable undefinedLabels;
 
 	std::stringstream ss;
 
-	// call the main function
-	APP(VMs::Reg::Opcode::CALLI);		// call immediate
-	APP((u64)-1);						// placeholder address
-	APP(VMs::Reg::Opcode::HALT);		// halt after main returns
-	undefinedProcs["main"] = { 0x01 };	// so that linker will replace the placeholder address
+	// start of the last cmp/cmpi, a jcc right after it becomes a compare and branch
+	const size_t NO_CMP = (size_t)-1;
+	size_t lastCmp = NO_CMP;
 
-	std::string currentProc = "";
-	for (size_t i = 0; i < lines.size(); ++i)
+	using Mnemonics::Form;
+	std::string_view currentProc = "";
+	for (size_t i = begin; i < end; ++i)
 	{
-		auto tokens = lexer.lex(lines[i]);
+		lexer.lex(lines[i], &tokens);
 		if (tokens.size() == 0) continue;
+		const Mnemonics::Mnemonic* mnemonic = Mnemonics::Find(tokens[0]);
 		/* symbols */
-		if (tokens[0] == "proc")
+		if (mnemonic && mnemonic->form == Form::PROC)
 		{
 			CHECK_N_TOK(2);
-			const std::string& name = tokens[1];
-			currentProc = name;
-			procs.push_back(symbol(name, code.size()));
+			currentProc = tokens[1];
+			// the first definition of a name is the one used. calls wait for the link
+			procs.emplace(currentProc, code.size());
+			lastCmp = NO_CMP;
 		}
-		else if (tokens[0] == "endp")
+		else if (mnemonic && mnemonic->form == Form::ENDP)
 		{
 			CHECK_N_TOK(1);
-			// replace undefined labels with the correct addresses
+			// labels are local to the proc, anything still undefined stays that way
 			for (const auto& entry : undefinedLabels)
 			{
-				bool found = false;
-				for (const auto& p : labels)
-				{
-					if (entry.first == p.name)
-					{
-						found = true;
-						for (const auto& offset : entry.second)
-						{
-							INS(p.addr, offset);
-						}
-						break;
-					}
-				}
-				if (!found)
-				{
-					ss.str(""); ss.clear();
-					ss << "unresolved symbol [" << entry.first << "] in proc [" << currentProc << "]";
-					errors.push_back({ ss.str(), i });
-				}
+				ss.str(""); ss.clear();
+				ss << "unresolved symbol [" << entry.first << "] in proc [" << currentProc << "]";
+				errors.push_back({ ss.str(), i });
 			}
-			std::vector<symbol>().swap(labels);
+			labels.clear();
 			undefinedLabels.clear();
-			++endpCount;
+			lastCmp = NO_CMP;
 		}
 		else if (tokens.size() == 2 && tokens[1] == ":") {
-			labels.push_back(
-				symbol(
-					tokens[0],
-					code.size()
-				)
-			);
+			// a jump target between cmp and jcc, keep them apart
+			lastCmp = NO_CMP;
+			if (labels.emplace(tokens[0], code.size()).second)
+				resolveFixups(&code, &undefinedLabels, tokens[0], code.size(), &relocations);
 		}
+		/* invalid */
+		else if (!mnemonic) { PUSH_INVALID_TOKEN_ERR(tokens[0]); }
+		else switch (mnemonic->form)
+		{
 		/* calling */
-		else if (tokens[0] == "call")
+		case Form::CALL:
 		{
 			CHECK_N_TOK(2);
 			if (isInteger(tokens[1]))
 			{
 				// calli
 				APP(VMs::Reg::Opcode::CALLI);
-				APP(std::stoull(tokens[1]));
+				APP(integerValue(tokens[1]));
 			}
 			else if (IS_REG(tokens[1]))
 			{
@@ -348,54 +425,23 @@ std::vector<byte> compileForRegVM(const std::vector<std::string>& lines)
 			}
 			else
 			{
-				// calli a proc
+				// calli a proc, linked later
 				APP(VMs::Reg::Opcode::CALLI);
-				bool found = false;
-				for (const auto& p : procs)
-				{
-					if (p.name == tokens[1])
-					{
-						found = true;
-						APP(p.addr);
-						break;
-					}
-				}
-				if (!found)
-				{
-					undefinedProcs[tokens[1]].push_back(code.size());
-					APP((u64)-1);
-				}
+				out->calls.push_back({ tokens[1], code.size() });
+				APP((u64)-1);
 			}
+			break;
 		}
-		else if (tokens[0] == "ret") { CHECK_N_TOK(1); APP(VMs::Reg::Opcode::RET); }
 		/* jumping */
-		else if (tokens[0] == "jmp") { APP_JMP(VMs::Reg::Opcode::JMP); }
-		else if (tokens[0] == "je") { APP_JMP(VMs::Reg::Opcode::JE); }
-		else if (tokens[0] == "jz") { APP_JMP(VMs::Reg::Opcode::JZ); }
-		else if (tokens[0] == "jne") { APP_JMP(VMs::Reg::Opcode::JNE); }
-		else if (tokens[0] == "jnz") { APP_JMP(VMs::Reg::Opcode::JNZ); }
-		else if (tokens[0] == "jgt") { APP_JMP(VMs::Reg::Opcode::JGT); }
-		else if (tokens[0] == "jlt") { APP_JMP(VMs::Reg::Opcode::JLT); }
-		else if (tokens[0] == "jge") { APP_JMP(VMs::Reg::Opcode::JGE); }
-		else if (tokens[0] == "jle") { APP_JMP(VMs::Reg::Opcode::JLE); }
+		case Form::JUMP: { APP_JMP(mnemonic->opcode); break; }
 		/* arithmetic */
-		else if (tokens[0] == "add") { APP_ARITH_2(VMs::Reg::Opcode::ADD); } // double arg
-		else if (tokens[0] == "sub") { APP_ARITH_2(VMs::Reg::Opcode::SUB); }
-		else if (tokens[0] == "mul") { APP_ARITH_2(VMs::Reg::Opcode::MUL); }
-		else if (tokens[0] == "div") { APP_ARITH_2(VMs::Reg::Opcode::DIV); }
-		else if (tokens[0] == "mod") { APP_ARITH_2(VMs::Reg::Opcode::MOD); }
-		else if (tokens[0] == "cmp") { APP_ARITH_2(VMs::Reg::Opcode::CMP); }
-		else if (tokens[0] == "and") { APP_ARITH_2(VMs::Reg::Opcode::AND); }
-		else if (tokens[0] == "xor") { APP_ARITH_2(VMs::Reg::Opcode::XOR); }
-		else if (tokens[0] == "not") { APP_ARITH_2(VMs::Reg::Opcode::NOT); }
-		else if (tokens[0] == "shr") { APP_ARITH_2(VMs::Reg::Opcode::SHR); }
-		else if (tokens[0] == "shl") { APP_ARITH_2(VMs::Reg::Opcode::SHL); }
-		else if (tokens[0] == "inc") { APP_ARITH_1(VMs::Reg::Opcode::INC); } // single arg
-		else if (tokens[0] == "dec") { APP_ARITH_1(VMs::Reg::Opcode::DEC); }
-		else if (tokens[0] == "or ") { APP_ARITH_1(VMs::Reg::Opcode::OR); }
+		case Form::COMPARE: lastCmp = code.size(); // fall through
+		case Form::REG_IMM: { APP_ARITH_2I(mnemonic->opcode, mnemonic->iopcode); break; }
+		case Form::REG_REG: { APP_ARITH_2(mnemonic->opcode); break; }
+		case Form::SHIFT: { APP_ARITH_I(mnemonic->opcode); break; }
+		case Form::REG: { APP_ARITH_1(mnemonic->opcode); break; }
 		/* registers */
-		else if (tokens[0] == "clf") { CHECK_N_TOK(1); APP(VMs::Reg::Opcode::CLF); }
-		else if (tokens[0] == "mov")
+		case Form::MOV:
 		{
 			// MOV	REG,	REG
 			// MOVI	REG,	IMM
@@ -414,25 +460,26 @@ std::vector<byte> compileForRegVM(const std::vector<std::string>& lines)
 				{
 					APP(VMs::Reg::Opcode::MOVI);
 					APP_REG(tokens[1]);
-					APP(std::stoll(tokens[2]));
+					APP(integerValue(tokens[2]));
 				}
 				else if (0)
 				{
 					// TODO: square brackets == address
 					APP(VMs::Reg::Opcode::MOVF);
 					APP_REG(tokens[1]);
-					APP(std::stoll(tokens[2]));
+					APP(integerValue(tokens[2]));
 				}
 				else { PUSH_INVALID_TOKEN_ERR(tokens[2]); }
 			}
 			// todo: square bracket == addr
 			else if (isInteger(tokens[1]) && IS_REG(tokens[2]))
 			{
-				APP(std::stoull(tokens[1]));
+				APP(integerValue(tokens[1]));
 			}
 			else { PUSH_INVALID_TOKEN_ERR(tokens[1]); }
+			break;
 		}
-		else if (tokens[0] == "push")
+		case Form::PUSH:
 		{
 			// PUSH REG
 			// PUSH IMM
@@ -440,7 +487,7 @@ std::vector<byte> compileForRegVM(const std::vector<std::string>& lines)
 			if (isInteger(tokens[1]))
 			{
 				APP(VMs::Reg::Opcode::PUSHI);
-				APP(std::stoull(tokens[1]));
+				APP(integerValue(tokens[1]));
 			}
 			else if (IS_REG(tokens[1]))
 			{
@@ -451,9 +498,9 @@ std::vector<byte> compileForRegVM(const std::vector<std::string>& lines)
 			{
 				PUSH_INVALID_TOKEN_ERR(tokens[1]);
 			}
+			break;
 		}
-		else if (tokens[0] == "pushf") { CHECK_N_TOK(1); APP(VMs::Reg::Opcode::PUSHF); }
-		else if (tokens[0] == "pop")
+		case Form::POP:
 		{
 			// POP REG
 			// POP ADDR
@@ -461,7 +508,7 @@ std::vector<byte> compileForRegVM(const std::vector<std::string>& lines)
 			if (isInteger(tokens[1]))
 			{
 				APP(VMs::Reg::Opcode::POPTO);
-				APP(std::stoull(tokens[1]));
+				APP(integerValue(tokens[1]));
 			}
 			else if (IS_REG(tokens[1]))
 			{
@@ -472,38 +519,102 @@ std::vector<byte> compileForRegVM(const std::vector<std::string>& lines)
 			{
 				PUSH_INVALID_TOKEN_ERR(tokens[1]);
 			}
+			break;
+		}
+		/* ret, pushf, popf, misc */
+		case Form::PLAIN: { CHECK_N_TOK(1); APP(mnemonic->opcode); break; }
+		default: break;
 		}
-		else if (tokens[0] == "popf") { CHECK_N_TOK(1); APP(VMs::Reg::Opcode::POPF); }
-		/* misc */
-		else if (tokens[0] == "nop") { CHECK_N_TOK(1); APP(VMs::Reg::Opcode::NOP); }
-		else if (tokens[0] == "int") { CHECK_N_TOK(1); APP(VMs::Reg::Opcode::INT); }
-		else if (tokens[0] == "halt") { CHECK_N_TOK(1); APP(VMs::Reg::Opcode::HALT); }
-		/* invalid */
-		else { PUSH_INVALID_TOKEN_ERR(tokens[0]); }
 	}
-	// go through undefinedprocs and replace code at given locations with addr of proc
-	for (const auto& entry : undefinedProcs)
+}
+
+/* where lines get cut: after every endp that closes a label scope */
+std::vector<size_t> fragmentEnds(const std::vector<std::string_view>& lines)
+{
+	Lexer lexer;
+	std::vector<std::string_view> tokens;
+	std::vector<size_t> ends;
+	for (size_t i = 0; i < lines.size(); ++i)
 	{
-		bool found = false;
-		for (const auto& p : procs)
-		{
-			if (entry.first == p.name)
-			{
-				found = true;
-				for (const auto& offset : entry.second)
-				{
-					INS(p.addr, offset);
-				}
-				break;
-			}
-		}
-		if (!found)
+		// only lines starting with endp are worth lexing
+		const size_t first = lines[i].find_first_not_of(" \t\r\v\f");
+		if (first == std::string_view::npos || lines[i].compare(first, 4, "endp") != 0)
+			continue;
+		lexer.lex(lines[i], &tokens);
+		if (tokens.size() == 1 && tokens[0] == "endp")
+			ends.push_back(i + 1);
+	}
+	if (ends.empty() || ends.back() != lines.size())
+		ends.push_back(lines.size());
+	return ends;
+}
+
+std::vector<byte> compileForRegVM(const std::vector<std::string_view>& lines, size_t threads)
+{
+	const std::vector<size_t> ends = fragmentEnds(lines);
+	std::vector<fragment> fragments(ends.size());
+	std::atomic<size_t> next(0);
+	auto work = [&]()
+	{
+		for (size_t f = next++; f < fragments.size(); f = next++)
+			assembleFragment(lines, f ? ends[f - 1] : 0, ends[f], &fragments[f]);
+	};
+	if (threads == 0)
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+	std::vector<std::thread> workers;
+	for (size_t t = 1; t < std::min(threads, fragments.size()); ++t)
+		workers.emplace_back(work);
+	work();
+	for (auto& t : workers)
+		t.join();
+
+	/* link */
+	std::vector<byte> code;
+	std::vector<error> errors;
+	symbolTable procs;
+	std::stringstream ss;
+
+	// call the main function
+	APP(VMs::Reg::Opcode::CALLI);		// call immediate
+	APP((u64)-1);						// placeholder address
+	APP(VMs::Reg::Opcode::HALT);		// halt after main returns
+	const size_t mainCall = 0x01;		// so that linker will replace the placeholder address
+
+	std::vector<u64> bases(fragments.size());
+	size_t size = code.size();
+	for (const fragment& f : fragments)
+		size += f.code.size();
+	code.reserve(size);
+	for (size_t k = 0; k < fragments.size(); ++k)
+	{
+		const fragment& f = fragments[k];
+		const u64 base = bases[k] = code.size();
+		code.insert(code.end(), f.code.begin(), f.code.end());
+		for (size_t offset : f.relocations)
+			INS(AsType<u64>(code[base + offset]) + base, base + offset);
+		// the first definition of a name is the one used
+		for (const auto& p : f.procs)
+			procs.emplace(p.first, p.second + base);
+		errors.insert(errors.end(), f.errors.begin(), f.errors.end());
+	}
+	// replace the placeholder of every call with the address of its proc
+	symbolTable unresolved;
+	auto link = [&](std::string_view name, size_t offset)
+	{
+		auto p = procs.find(name);
+		if (p != procs.end())
+			INS(p->second, offset);
+		else if (unresolved.emplace(name, 0).second)
 		{
 			ss.str(""); ss.clear();
-			ss << "unresolved symbol [" << entry.first << "]";
+			ss << "unresolved symbol [" << name << "]";
 			errors.push_back({ ss.str(), (size_t)-1 });
 		}
-	}
+	};
+	link("main", mainCall);
+	for (size_t k = 0; k < fragments.size(); ++k)
+		for (const auto& call : fragments[k].calls)
+			link(call.first, call.second + bases[k]);
 
 	// print any errors
 	if (errors.size() > 0)
@@ -519,12 +630,69 @@ std::vector<byte> compileForRegVM(const std::vector<std::string>& lines)
 		return code;
 }
 
-bool isInteger(const std::string& s)
+/* turn the cmp/cmpi at cmpOffset into a compare and branch using jump's
+   condition, if it is the last thing in code. the caller appends the target */
+bool fuseCompareBranch(std::vector<byte>* code, size_t cmpOffset, byte jump)
+{
+	using op = VMs::Reg::Opcode;
+	if (cmpOffset >= code->size() || cmpOffset + 1 + 8 + 8 != code->size())
+		return false;
+	const bool immediate = (*code)[cmpOffset] == op::CMPI;
+	if (!immediate && (*code)[cmpOffset] != op::CMP)
+		return false;
+	byte fused;
+	switch (jump)
+	{
+	case op::JE: case op::JZ:	fused = immediate ? op::CJEI : op::CJE; break;
+	case op::JNE: case op::JNZ:	fused = immediate ? op::CJNEI : op::CJNE; break;
+	case op::JGT:				fused = immediate ? op::CJGTI : op::CJGT; break;
+	case op::JLT:				fused = immediate ? op::CJLTI : op::CJLT; break;
+	case op::JGE:				fused = immediate ? op::CJGEI : op::CJGE; break;
+	case op::JLE:				fused = immediate ? op::CJLEI : op::CJLE; break;
+	default:					return false;
+	}
+	(*code)[cmpOffset] = fused;
+	return true;
+}
+
+/* regcode of a register name, or (u64)-1 if it is not one */
+u64 regcodeOf(std::string_view s)
+{
+	using reg = VMs::Reg::Regcode;
+	if (s == "a") return reg::A;
+	if (s == "b") return reg::B;
+	if (s == "c") return reg::C;
+	if (s == "ip") return reg::IP;
+	if (s == "sp") return reg::SP;
+	if (s == "f") return reg::F;
+	// r0-r15, no leading zeros
+	if (s.size() < 2 || s.size() > 3 || s[0] != 'r' || !std::isdigit(s[1]) || (s.size() == 3 && (s[1] == '0' || !std::isdigit(s[2]))))
+		return (u64)-1;
+	u64 n = integerValue(s.substr(1));
+	return n < VMs::Reg::GPR_COUNT ? VMs::Reg::GetGPR(n) : (u64)-1;
+}
+
+bool isInteger(std::string_view s)
 {
 	size_t i = 0;
-	if (s[0] == '-' || s[0] == '+') i = 1; // skip
-	for (i; i < s.size(); ++i)
+	if (!s.empty() && (s[0] == '-' || s[0] == '+')) i = 1; // skip
+	// a sign on its own is an operator
+	if (i == s.size())
+		return false;
+	for (; i < s.size(); ++i)
 		if (!std::isdigit(s[i]))
 			return false;
 	return true;
-}
\ No newline at end of file
+}
+
+/* value of a token isInteger accepts, as the 64 bits an immediate holds.
+   negative values are two's complement, too many digits wrap */
+u64 integerValue(std::string_view s)
+{
+	size_t i = 0;
+	if (s[0] == '-' || s[0] == '+') i = 1;
+	u64 value = 0;
+	for (; i < s.size(); ++i)
+		value = value * 10 + (s[i] - '0');
+	return s[0] == '-' ? 0 - value : value;
+}
@@ -0,0 +1,244 @@
+#include "Bytecode.h"
+
+namespace
+{
+	using op = VMs::Reg::Opcode;
+	typedef Bytecode::Operand Operand;
+
+	const u64 NO_OFFSET = ~(u64)0;
+
+	struct OperandTable
+	{
+		Operand operands[256][Bytecode::MAX_OPERANDS];
+		OperandTable()
+		{
+			for (int i = 0; i < 256; i++)
+				for (int n = 0; n < Bytecode::MAX_OPERANDS; n++)
+					operands[i][n] = VMs::Reg::GetOperands(static_cast<u8>(i)).kind[n];
+		}
+	};
+	const OperandTable s_table;
+
+	size_t SizeV2(Operand kind, u64 value)
+	{
+		switch (kind)
+		{
+		case Operand::REG:		return 1;
+		case Operand::TARGET:	return 4;
+		case Operand::ADDR:
+		{
+			size_t n = 1;
+			while (value >>= 7) n++;
+			return n;
+		}
+		case Operand::IMM:
+		{
+			i64 v = static_cast<i64>(value);
+			size_t n = 1;
+			while (!((v >> 6) == 0 || (v >> 6) == -1)) { v >>= 7; n++; }
+			return n;
+		}
+		default:				return 0;
+		}
+	}
+
+	void WriteV2(std::vector<byte>* out, Operand kind, u64 value)
+	{
+		switch (kind)
+		{
+		case Operand::REG:
+			out->push_back(static_cast<byte>(value));
+			break;
+		case Operand::TARGET:
+			for (int i = 0; i < 4; ++i)
+				out->push_back(static_cast<byte>(value >> (8 * i)));
+			break;
+		case Operand::ADDR:
+			do
+			{
+				byte b = value & 0x7f;
+				value >>= 7;
+				out->push_back(value ? b | 0x80 : b);
+			} while (value);
+			break;
+		case Operand::IMM:
+		{
+			i64 v = static_cast<i64>(value);
+			for (;;)
+			{
+				byte b = v & 0x7f;
+				bool last = (v >> 6) == 0 || (v >> 6) == -1;
+				v >>= 7;
+				out->push_back(last ? b : b | 0x80);
+				if (last) break;
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	/* reads one v2 operand at *pos. returns false if it runs off the end */
+	bool ReadV2(const byte* in, size_t size, size_t* pos, Operand kind, u64* value)
+	{
+		size_t i = *pos;
+		u64 v = 0;
+		switch (kind)
+		{
+		case Operand::REG:
+			if (i + 1 > size) return false;
+			v = in[i++];
+			break;
+		case Operand::TARGET:
+			if (i + 4 > size) return false;
+			for (int b = 0; b < 4; ++b)
+				v |= (u64)in[i++] << (8 * b);
+			break;
+		case Operand::ADDR:
+		case Operand::IMM:
+		{
+			int shift = 0;
+			byte b;
+			do
+			{
+				if (i >= size || shift >= 64) return false;
+				b = in[i++];
+				v |= (u64)(b & 0x7f) << shift;
+				shift += 7;
+			} while (b & 0x80);
+			if (kind == Operand::IMM && shift < 64 && (b & 0x40))
+				v |= ~(u64)0 << shift;
+			break;
+		}
+		default:
+			break;
+		}
+		*pos = i;
+		*value = v;
+		return true;
+	}
+}
+
+const Bytecode::Operand* Bytecode::GetOperands(u8 opcode)
+{
+	return s_table.operands[opcode];
+}
+
+size_t Bytecode::GetSizeV1(u8 opcode)
+{
+	return VMs::Reg::GetSize(opcode);
+}
+
+bool Bytecode::IsV2(const void* program, size_t size)
+{
+	const byte* p = reinterpret_cast<const byte*>(program);
+	return size >= HEADER_SIZE && p[0] == 'R' && p[1] == 'V' && p[2] == 'M' && p[3] == VERSION_2;
+}
+
+bool Bytecode::Compact(const byte* program, size_t size, std::vector<byte>* out)
+{
+	// first pass: v2 offset of every v1 instruction
+	std::vector<u64> offsets(size + 1, NO_OFFSET);
+	u64 offset = HEADER_SIZE;
+	size_t pos = 0;
+	while (pos < size)
+	{
+		const byte opcode = program[pos];
+		const Operand* operands = GetOperands(opcode);
+		if (pos + GetSizeV1(opcode) > size) return false;
+		offsets[pos] = offset;
+		offset += 1;
+		for (int i = 0; i < MAX_OPERANDS; ++i)
+			if (operands[i] != Operand::NONE)
+				offset += SizeV2(operands[i], AsType<u64>(program[pos + 1 + 8 * i]));
+		pos += GetSizeV1(opcode);
+	}
+	offsets[size] = offset;
+
+	// second pass: encode
+	out->clear();
+	out->reserve(offset);
+	out->insert(out->end(), { 'R', 'V', 'M', VERSION_2 });
+	pos = 0;
+	while (pos < size)
+	{
+		const byte opcode = program[pos];
+		const Operand* operands = GetOperands(opcode);
+		out->push_back(opcode);
+		for (int i = 0; i < MAX_OPERANDS; ++i)
+		{
+			if (operands[i] == Operand::NONE) continue;
+			u64 value = AsType<u64>(program[pos + 1 + 8 * i]);
+			if (operands[i] == Operand::REG && value > 0xff)
+				return false;
+			if (operands[i] == Operand::TARGET)
+			{
+				if (value > size || offsets[value] == NO_OFFSET || offsets[value] > 0xffffffff)
+					return false;
+				value = offsets[value];
+			}
+			WriteV2(out, operands[i], value);
+		}
+		pos += GetSizeV1(opcode);
+	}
+	return true;
+}
+
+bool Bytecode::Expand(const byte* program, size_t size, std::vector<byte>* out)
+{
+	if (!IsV2(program, size)) return false;
+
+	// first pass: v1 offset of every v2 instruction
+	std::vector<u64> offsets(size + 1, NO_OFFSET);
+	u64 offset = 0;
+	size_t pos = HEADER_SIZE;
+	while (pos < size)
+	{
+		const byte opcode = program[pos];
+		const Operand* operands = GetOperands(opcode);
+		offsets[pos++] = offset;
+		for (int i = 0; i < MAX_OPERANDS; ++i)
+		{
+			u64 value;
+			if (operands[i] != Operand::NONE && !ReadV2(program, size, &pos, operands[i], &value))
+				return false;
+		}
+		offset += GetSizeV1(opcode);
+	}
+	offsets[size] = offset;
+
+	// second pass: decode
+	out->clear();
+	out->reserve(offset);
+	pos = HEADER_SIZE;
+	while (pos < size)
+	{
+		const byte opcode = program[pos++];
+		const Operand* operands = GetOperands(opcode);
+		out->push_back(opcode);
+		for (int i = 0; i < MAX_OPERANDS; ++i)
+		{
+			if (operands[i] == Operand::NONE) continue;
+			u64 value;
+			ReadV2(program, size, &pos, operands[i], &value);
+			if (operands[i] == Operand::TARGET)
+			{
+				if (value > size || offsets[value] == NO_OFFSET)
+					return false;
+				value = offsets[value];
+			}
+			const byte* bytes = reinterpret_cast<const byte*>(&value);
+			out->insert(out->end(), bytes, bytes + 8);
+		}
+	}
+	return true;
+}
+
+u64 Bytecode::Hash(const byte* program, size_t size)
+{
+	u64 hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ program[i]) * 0x100000001b3ULL;
+	return hash;
+}
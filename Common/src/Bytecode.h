@@ -0,0 +1,49 @@
+#pragma once
+#include <vector>
+#include "Definitions.h"
+#include "Instruction.h"
+
+/* REGVM BYTECODE ENCODINGS
+	v1 (what RegVM executes):
+		8-bit opcode, every operand a 64-bit value. no header
+	v2 (compact, for storing/shipping programs):
+		header: 'R' 'V' 'M' <version = 2>
+		8-bit opcode, then per operand
+			register:	1 byte regcode
+			immediate:	signed LEB128
+			address:	unsigned LEB128
+			target:		32-bit v2 offset of an instruction
+	RegVM::LoadProgram expands v2 images back to v1 on load.
+	StackVM programs can be translated to v1 (StackTranslate.cpp).
+*/
+struct Bytecode
+{
+public:
+	/* operand kinds, from VMs::Reg::GetOperands */
+	typedef VMs::Reg::Operand Operand;
+	static const Operand NONE = VMs::Reg::NONE;
+	static const Operand REG = VMs::Reg::REG;
+	static const Operand IMM = VMs::Reg::IMM;
+	static const Operand ADDR = VMs::Reg::ADDR;
+	static const Operand TARGET = VMs::Reg::TARGET;
+	static const byte VERSION_2 = 2;
+	static const size_t HEADER_SIZE = 4;
+	static const int MAX_OPERANDS = VMs::Reg::MAX_OPERANDS;
+public:
+	/* operand kinds of a RegVM opcode, always MAX_OPERANDS entries */
+	static EXPORT const Operand* GetOperands(u8 opcode);
+	/* size of an instruction in the v1 encoding, VMs::Reg::GetSize */
+	static EXPORT size_t GetSizeV1(u8 opcode);
+	static EXPORT bool IsV2(const void* program, size_t size);
+	/* v1 -> v2. returns false if the program cannot be represented */
+	static EXPORT bool Compact(const byte* program, size_t size, std::vector<byte>* out);
+	/* v2 -> v1. returns false if the image is malformed */
+	static EXPORT bool Expand(const byte* program, size_t size, std::vector<byte>* out);
+	/* StackVM program -> v1 that leaves StackVM's top of stack in a. the
+	   input row for COLUMN n is the 64-bit word n after the code, *rowOffset
+	   gets where that is. returns false if the program pops an empty stack
+	   or does not halt */
+	static EXPORT bool TranslateStack(const byte* program, size_t size, std::vector<byte>* out, size_t* rowOffset = nullptr);
+	/* FNV-1a of a program, what native code and cached programs are matched by */
+	static EXPORT u64 Hash(const byte* program, size_t size);
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 #define TRUE 1
@@ -27,6 +28,7 @@ namespace VMs
 		enum Opcode : u16
 		{
 			NOP = 0, HALT, ALERT, PUSH, ADD, SUB, MUL, DIV,
+			COLUMN,		// push input column n of the current row ($n in source)
 			OPCODE_END
 		};
 	};
@@ -73,13 +75,102 @@ namespace VMs
 			NOP,		// no operation
 			HALT,		// stop execution
 
+			/* register-immediate instructions. shifts already take an immediate */
+			ADDI, SUBI, 
+			CMPI,		// compare register with immediate
+			ANDI, 
+
+			/* compare and branch: cmp r1, r2 then jump to target.
+			   sets the flags exactly like CMP */
+			CJE, CJNE, CJGT, CJLT, CJGE, CJLE,
+			/* compare and branch against an immediate: cmpi r1, imm then jump */
+			CJEI, CJNEI, CJGTI, CJLTI, CJGEI, CJLEI,
+
 			OPCODE_END
 		};
+		/* operand kinds. every operand is 8 bytes in v1, see Bytecode.h for v2 */
+		enum Operand : u8
+		{
+			NONE,
+			REG,		// register code
+			IMM,		// immediate value
+			ADDR,		// data address
+			TARGET		// code address (jump/call target)
+		};
+		static const int MAX_OPERANDS = 3;
+		struct Operands
+		{
+			Operand kind[MAX_OPERANDS];
+		};
+		/* operands of an opcode, NONE for every one of an unknown opcode.
+		   the one table instruction sizes and encodings are derived from */
+		static constexpr Operands GetOperands(u8 opcode)
+		{
+			switch (opcode)
+			{
+			/* registers */
+			case MOVI:	return { { REG, IMM, NONE } };
+			case MOVF:	return { { REG, ADDR, NONE } };
+			case MOVT:	return { { ADDR, REG, NONE } };
+			case MOV:	return { { REG, REG, NONE } };
+			case PUSH:	return { { REG, NONE, NONE } };
+			case PUSHI:	return { { IMM, NONE, NONE } };
+			case POP:	return { { REG, NONE, NONE } };
+			case POPTO:	return { { ADDR, NONE, NONE } };
+			/* arithmetic */
+			case ADD: case SUB: case MUL: case DIV: case MOD: case CMP: case AND: case OR: case XOR:
+				return { { REG, REG, NONE } };
+			case INC: case DEC: case NOT:
+				return { { REG, NONE, NONE } };
+			case SHR: case SHL: case ADDI: case SUBI: case CMPI: case ANDI:
+				return { { REG, IMM, NONE } };
+			/* jumping/calling */
+			case CALLI:	return { { TARGET, NONE, NONE } };
+			case CALLR:	return { { REG, NONE, NONE } };
+			case JMP: case JE: case JZ: case JNE: case JNZ: case JGT: case JLT: case JGE: case JLE:
+				return { { TARGET, NONE, NONE } };
+			case CJE: case CJNE: case CJGT: case CJLT: case CJGE: case CJLE:
+				return { { REG, REG, TARGET } };
+			case CJEI: case CJNEI: case CJGTI: case CJLTI: case CJGEI: case CJLEI:
+				return { { REG, IMM, TARGET } };
+			default:	return { { NONE, NONE, NONE } };
+			}
+		}
+		/* size of an instruction in the v1 encoding */
+		static constexpr size_t GetSize(u8 opcode)
+		{
+			const Operands operands = GetOperands(opcode);
+			size_t size = 1;
+			for (int i = 0; i < MAX_OPERANDS; ++i)
+				if (operands.kind[i] != NONE)
+					size += 8;
+			return size;
+		}
+		/* the codes of a, b, c, ip, sp and f are the ones v1 images have
+		   always used, the other general purpose registers come after them */
 		enum Regcode : u64
 		{
-			A, B, C, IP, SP, F,
-			REG_END
+			R0, R1, R2,
+			/* special */
+			IP, SP, F,
+			/* general purpose */
+			R3, R4, R5, R6, R7, R8, R9,
+			R10, R11, R12, R13, R14, R15,
+			REG_END,
+			/* original names of the first three */
+			A = R0, B = R1, C = R2
 		};
+		static const u64 GPR_COUNT = 16;
+		/* regcode of general purpose register rn, n < GPR_COUNT */
+		static constexpr u64 GetGPR(u64 n)
+		{
+			return n < 3 ? R0 + n : R3 + (n - 3);
+		}
+		/* r0-r15, not IP, SP, F or out of range */
+		static constexpr bool IsGPR(u64 regcode)
+		{
+			return regcode < REG_END && regcode - IP >= 3;
+		}
 	};
 };
 
@@ -0,0 +1,70 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const char* path)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return;
+	m_file = file;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) return;
+	m_size = static_cast<size_t>(size.QuadPart);
+	if (!m_size) return;
+	m_section = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!m_section) return;
+	m_data = reinterpret_cast<const byte*>(MapViewOfFile(m_section, FILE_MAP_READ, 0, 0, 0));
+#else
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+	m_fd = fd;
+	struct stat st;
+	if (fstat(fd, &st) != 0) return;
+	m_size = static_cast<size_t>(st.st_size);
+	if (!m_size) return;
+	void* p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p != MAP_FAILED) m_data = reinterpret_cast<const byte*>(p);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (m_data) UnmapViewOfFile(m_data);
+	if (m_section) CloseHandle(m_section);
+	if (m_file) CloseHandle(m_file);
+#else
+	if (m_data) munmap(const_cast<byte*>(m_data), m_size);
+	if (m_fd >= 0) close(m_fd);
+#endif
+}
+
+bool MappedFile::Valid() const
+{
+#ifdef _WIN32
+	const bool open = m_file != nullptr;
+#else
+	const bool open = m_fd >= 0;
+#endif
+	return open && (m_data || m_size == 0);
+}
+
+bool MappedFile::MapAt(void* address) const
+{
+#ifdef _WIN32
+	// a view cannot replace part of an existing allocation
+	return false;
+#else
+	if (!m_data) return false;
+	return mmap(address, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, m_fd, 0) != MAP_FAILED;
+#endif
+}
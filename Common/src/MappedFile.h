@@ -0,0 +1,32 @@
+#pragma once
+#include "Definitions.h"
+#include "Instruction.h"
+
+/* a whole file mapped read-only, for loading programs without reading
+   them into a buffer first */
+class EXPORT MappedFile
+{
+private:
+	const byte* m_data = nullptr;
+	size_t m_size = 0;
+#ifdef _WIN32
+	void* m_file = nullptr;		// HANDLE
+	void* m_section = nullptr;	// HANDLE
+#else
+	int m_fd = -1;
+#endif
+public:
+	MappedFile(const char* path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	/* false if the file could not be opened or mapped. an empty file is valid */
+	bool Valid() const;
+	const byte* Data() const { return m_data; }
+	size_t Size() const { return m_size; }
+	/* map the file again, copy-on-write, over the pages at address (page
+	   aligned, at least Size() bytes rounded up to a page): writes go to
+	   private pages and never reach the file. the mapping outlives this
+	   object. not supported on windows, returns false */
+	bool MapAt(void* address) const;
+};
@@ -0,0 +1,262 @@
+#include "Bytecode.h"
+#include "Instruction.h"
+
+/* STACKVM -> REGVM
+	stack slot d lives in register r(d % REGISTERS) while it is one of the
+	top REGISTERS slots. pushing past that spills the deepest of them to the
+	RegVM stack, and an operator that needs it back pops it first, so spills
+	come off in the order they went on.
+	PUSH does not emit anything: a slot remembers its constant until an
+	operator needs it in a register, and operators on two constants are
+	folded. every slot also carries the range its value can be in, so the
+	16 bit cut StackVM applies to operands is only emitted where the value
+	might not fit already.
+	COLUMN n loads the 64-bit word n of a row area placed after the code.
+	it is zero, like a StackVM without SetRow, until the host writes the row
+	there (sign extended).
+	at HALT the top of stack, what StackVM's GetTop would give, goes to a.
+*/
+namespace
+{
+	using sop = VMs::Stack::Opcode;
+	using rop = VMs::Reg::Opcode;
+
+	const size_t REGISTERS = VMs::Reg::GPR_COUNT;
+	/* regcode of the register stack slot d lives in */
+	inline u64 SlotRegister(size_t d) { return VMs::Reg::GetGPR(d % REGISTERS); }
+	const i64 NARROW_MIN = -32768;
+	const i64 NARROW_MAX = 32767;
+
+	struct Slot
+	{
+		bool constant = false;
+		bool spilled = false;	// on the RegVM stack, not in its register
+		i64 value = 0;			// if constant
+		i64 lo = 0, hi = 0;		// range of the value
+	};
+
+	class Translator
+	{
+	private:
+		std::vector<byte>* m_out;
+		std::vector<Slot> m_slots;
+		size_t m_spilled = 0;	// slots below this are not in registers
+		std::vector<size_t> m_rowLoads;	// address operands of column loads, as column indices
+		size_t m_columns = 0;
+	public:
+		explicit Translator(std::vector<byte>* out) : m_out(out) {}
+
+		void Push(i64 value)
+		{
+			if (m_slots.size() - m_spilled == REGISTERS)
+				spill();
+			Slot slot;
+			slot.constant = true;
+			slot.value = slot.lo = slot.hi = value;
+			m_slots.push_back(slot);
+		}
+
+		void Column(u16 column)
+		{
+			if (m_slots.size() - m_spilled == REGISTERS)
+				spill();
+			Slot slot;
+			slot.lo = INT32_MIN;
+			slot.hi = INT32_MAX;
+			emit(rop::MOVF, SlotRegister(m_slots.size()), column * 8);
+			m_rowLoads.push_back(m_out->size() - 8);
+			m_columns = MAX(m_columns, (size_t)column + 1);
+			m_slots.push_back(slot);
+		}
+
+		/* false if the stack is too shallow */
+		bool Binary(u16 opcode)
+		{
+			const size_t depth = m_slots.size();
+			if (depth < 2)
+				return false;
+			Slot& lhs = m_slots[depth - 2];
+			Slot& rhs = m_slots[depth - 1];
+			if (lhs.constant && rhs.constant && !(opcode == sop::DIV && (i16)rhs.value == 0))
+			{
+				lhs.value = lhs.lo = lhs.hi = apply(opcode, (i16)lhs.value, (i16)rhs.value);
+				m_slots.pop_back();
+				return true;
+			}
+			// operands back into registers, top first
+			if (m_spilled == depth)
+				fill();
+			if (m_spilled == depth - 1)
+				fill();
+			const u64 r1 = SlotRegister(depth - 2);
+			const u64 r2 = SlotRegister(depth - 1);
+			if (lhs.constant)
+				materialise(r1, &lhs);
+			else
+				narrow(r1, &lhs);
+			if (rhs.constant && (opcode == sop::ADD || opcode == sop::SUB))
+			{
+				rhs.lo = rhs.hi = (i16)rhs.value;
+				emit(opcode == sop::ADD ? rop::ADDI : rop::SUBI, r1, (u64)rhs.lo);
+			}
+			else
+			{
+				if (rhs.constant)
+					materialise(r2, &rhs);
+				else
+					narrow(r2, &rhs);
+				emit(opcode == sop::ADD ? rop::ADD : opcode == sop::SUB ? rop::SUB : opcode == sop::MUL ? rop::MUL : rop::DIV, r1, r2);
+			}
+			range(opcode, &lhs, rhs);
+			lhs.constant = false;
+			m_slots.pop_back();
+			return true;
+		}
+
+		/* false if the stack is empty */
+		bool Halt(size_t* rowOffset)
+		{
+			const size_t depth = m_slots.size();
+			if (!depth)
+				return false;
+			const Slot& top = m_slots[depth - 1];
+			if (top.constant)
+				emit(rop::MOVI, VMs::Reg::A, (u64)top.value);
+			else if (m_spilled == depth)
+				emit(rop::POP, VMs::Reg::A);
+			else if (SlotRegister(depth - 1) != VMs::Reg::A)
+				emit(rop::MOV, VMs::Reg::A, SlotRegister(depth - 1));
+			emit(rop::HALT);
+			// the row goes after the code, column loads point into it
+			const u64 row = m_out->size();
+			for (size_t at : m_rowLoads)
+				*reinterpret_cast<u64*>(&(*m_out)[at]) += row;
+			m_out->resize(row + m_columns * 8);
+			if (rowOffset)
+				*rowOffset = row;
+			return true;
+		}
+	private:
+		static i64 apply(u16 opcode, i64 a, i64 b)
+		{
+			switch (opcode)
+			{
+			case sop::ADD:	return a + b;
+			case sop::SUB:	return a - b;
+			case sop::MUL:	return a * b;
+			default:		return a / b;
+			}
+		}
+
+		/* range of lhs op rhs, into lhs. both already fit 16 bits */
+		static void range(u16 opcode, Slot* lhs, const Slot& rhs)
+		{
+			if (opcode == sop::DIV)
+			{
+				// |a / b| <= |a|, whatever b is
+				lhs->hi = MAX(-lhs->lo, lhs->hi);
+				lhs->lo = -lhs->hi;
+				return;
+			}
+			const i64 a[2] = { lhs->lo, lhs->hi };
+			const i64 b[2] = { rhs.lo, rhs.hi };
+			lhs->lo = lhs->hi = apply(opcode, a[0], b[0]);
+			for (i64 x : a)
+			{
+				for (i64 y : b)
+				{
+					const i64 v = apply(opcode, x, y);
+					lhs->lo = MIN(lhs->lo, v);
+					lhs->hi = MAX(lhs->hi, v);
+				}
+			}
+		}
+
+		/* constant operand into r, already cut to 16 bits */
+		void materialise(u64 r, Slot* slot)
+		{
+			slot->lo = slot->hi = (i16)slot->value;
+			emit(rop::MOVI, r, (u64)slot->lo);
+		}
+
+		/* sign extends the low 16 bits of r in place, if it might not fit */
+		void narrow(u64 r, Slot* slot)
+		{
+			if (slot->lo >= NARROW_MIN && slot->hi <= NARROW_MAX)
+				return;
+			// bit 15 flipped, the rest cleared, then the flip undone by borrowing
+			emit(rop::ADDI, r, 0x8000);
+			emit(rop::ANDI, r, 0xffff);
+			emit(rop::SUBI, r, 0x8000);
+			slot->lo = NARROW_MIN;
+			slot->hi = NARROW_MAX;
+		}
+
+		void spill()
+		{
+			Slot& slot = m_slots[m_spilled];
+			if (!slot.constant)
+			{
+				emit(rop::PUSH, SlotRegister(m_spilled));
+				slot.spilled = true;
+			}
+			++m_spilled;
+		}
+
+		void fill()
+		{
+			Slot& slot = m_slots[--m_spilled];
+			if (slot.spilled)
+			{
+				emit(rop::POP, SlotRegister(m_spilled));
+				slot.spilled = false;
+			}
+		}
+
+		void emit(rop opcode, u64 a = 0, u64 b = 0)
+		{
+			const Bytecode::Operand* operands = Bytecode::GetOperands(opcode);
+			m_out->push_back(opcode);
+			const u64 values[2] = { a, b };
+			for (int i = 0; i < 2; ++i)
+			{
+				if (operands[i] == Bytecode::Operand::NONE) continue;
+				const byte* bytes = reinterpret_cast<const byte*>(&values[i]);
+				m_out->insert(m_out->end(), bytes, bytes + 8);
+			}
+		}
+	};
+}
+
+bool Bytecode::TranslateStack(const byte* program, size_t size, std::vector<byte>* out, size_t* rowOffset)
+{
+	out->clear();
+	Translator translator(out);
+	for (size_t pos = 0; pos + sizeof(u32) <= size; pos += sizeof(u32))
+	{
+		const Instruction instruction = Instruction::Get(AsType<u32>(program[pos]));
+		switch (instruction.opcode)
+		{
+		case sop::HALT:
+			return translator.Halt(rowOffset);
+		case sop::PUSH:
+			// StackVM pushes the raw 16 bits, and only cuts them to i16 as an operand
+			translator.Push(instruction.data);
+			break;
+		case sop::ADD:
+		case sop::SUB:
+		case sop::MUL:
+		case sop::DIV:
+			if (!translator.Binary(instruction.opcode))
+				return false;
+			break;
+		case sop::COLUMN:
+			translator.Column(instruction.data);
+			break;
+		default:
+			// NOP, ALERT and unknown opcodes do nothing in StackVM::Run
+			break;
+		}
+	}
+	return false;
+}
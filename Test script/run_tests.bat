@@ -0,0 +1,62 @@
+@echo off
+rem runs the test programs in src on every register vm engine and compares
+rem what they print with expected\ (guard page addresses there assume 4 KiB
+rem host pages). see run_tests.sh
+setlocal enabledelayedexpansion
+set ASM=..\..\x64\Release\assembler.exe
+set VM=..\..\x64\Release\virtualmachine.exe
+set FAILED=0
+mkdir bin > nul 2>&1
+pushd bin > nul
+
+rem the register dump each program leaves behind, from every engine and
+rem from the compact encoding (r2) as well
+for %%t in (engines write_past_code) do (
+	for %%f in (r r2) do (
+		%ASM% -m %%f -o %%t.%%f.bin ..\src\%%t > nul
+		for %%m in (t r d j v) do (
+			%VM% %%t.%%f.bin %%m | findstr /r /b /c:"[a-z0-9]*:	0x" > %%t.%%f.%%m.txt
+			fc /w %%t.%%f.%%m.txt ..\expected\%%t.txt > nul || (
+				echo %%t ^(%%f, %%m^): registers differ from expected\%%t.txt
+				set FAILED=1
+			)
+		)
+	)
+)
+
+rem guard page hits: the same fault report, and the same registers left
+rem behind, from every engine. a hit inside a JIT block is not caught on
+rem windows (see GuestMemory.h), so no j
+for %%f in (r r2) do (
+	%ASM% -m %%f -o guard_registers.%%f.bin ..\src\guard_registers > nul
+	for %%m in (t r d v) do (
+		%VM% guard_registers.%%f.bin %%m | findstr /r /b /c:"[a-z0-9]*:	0x" > guard_registers.%%f.%%m.txt
+		fc /w guard_registers.%%f.%%m.txt ..\expected\guard_registers.txt > nul || (
+			echo guard_registers ^(%%f, %%m^): registers differ from expected\guard_registers.txt
+			set FAILED=1
+		)
+	)
+)
+for %%t in (guard_overflow guard_underflow) do (
+	%ASM% -m r -o %%t.bin ..\src\%%t > nul
+	for %%m in (t r d v) do (
+		%VM% %%t.bin %%m | findstr /b /c:"guest fault" > %%t.%%m.txt
+		fc /w %%t.%%m.txt ..\expected\%%t.txt > nul || (
+			echo %%t ^(%%m^): fault report differs from expected\%%t.txt
+			set FAILED=1
+		)
+	)
+)
+
+rem batch jobs share a vm per worker: nothing one job leaves in guest
+rem memory may show up in the next
+%ASM% -m r -o leftover.bin ..\src\leftover > nul
+%VM% ..\src\leftover.manifest b 1 | findstr /c:"	a = " /c:"	fault: " > leftover.txt
+fc /w leftover.txt ..\expected\leftover.txt > nul || (
+	echo leftover ^(b^): batch results differ from expected\leftover.txt
+	set FAILED=1
+)
+
+popd > nul
+if !FAILED!==0 echo all tests passed
+pause
@@ -0,0 +1,74 @@
+#!/bin/sh
+# runs the test programs in src on every register vm engine and compares
+# what they print with expected/ (guard page addresses there assume 4 KiB
+# host pages). usage: run_tests.sh <assembler> <virtualmachine>
+here=$(cd "$(dirname "$0")" && pwd)
+ASM=${1:-$here/../x64/Release/assembler}
+VM=${2:-$here/../x64/Release/virtualmachine}
+mkdir -p "$here/bin"
+failed=0
+
+# the native engine needs the program written out as C and built
+modes="t r d j v"
+command -v cc > /dev/null && modes="$modes n"
+run() # <program> <mode>
+{
+	if [ "$2" = n ]; then
+		"$VM" "$1" g > /dev/null && cc -O2 -shared -fPIC "$1.c" -o "$1.so" && "$VM" "$1" n "$1.so"
+	else
+		"$VM" "$1" "$2"
+	fi
+}
+
+# the register dump each program leaves behind, halted or stopped by a
+# guard page hit, from every engine and from the compact encoding (r2) as well
+for test in engines write_past_code guard_registers; do
+	for format in r r2; do
+		bin=$here/bin/$test.$format.bin
+		if ! "$ASM" "$here/src/$test" -m $format -o "$bin" > /dev/null; then
+			echo "$test: does not assemble as $format"
+			failed=1
+			continue
+		fi
+		for mode in $modes; do
+			run "$bin" $mode | grep "^[a-z0-9]*:	0x" > "$bin.$mode.txt"
+			if ! cmp -s "$bin.$mode.txt" "$here/expected/$test.txt"; then
+				echo "$test ($format, $mode): registers differ from expected/$test.txt"
+				failed=1
+			fi
+		done
+	done
+done
+
+# guard page hits: the same fault report from every engine
+for test in guard_overflow guard_underflow; do
+	bin=$here/bin/$test.bin
+	if ! "$ASM" "$here/src/$test" -m r -o "$bin" > /dev/null; then
+		echo "$test: does not assemble"
+		failed=1
+		continue
+	fi
+	for mode in $modes; do
+		run "$bin" $mode | grep "guest fault" > "$bin.$mode.txt"
+		if ! cmp -s "$bin.$mode.txt" "$here/expected/$test.txt"; then
+			echo "$test ($mode): fault report differs from expected/$test.txt"
+			failed=1
+		fi
+	done
+done
+
+# batch jobs share a vm per worker: nothing one job leaves in guest memory
+# may show up in the next
+if "$ASM" "$here/src/leftover" -m r -o "$here/bin/leftover.bin" > /dev/null; then
+	(cd "$here/bin" && "$VM" ../src/leftover.manifest b 1) | grep -e "	a = " -e "	fault: " > "$here/bin/leftover.txt"
+	if ! cmp -s "$here/bin/leftover.txt" "$here/expected/leftover.txt"; then
+		echo "leftover (b): batch results differ from expected/leftover.txt"
+		failed=1
+	fi
+else
+	echo "leftover: does not assemble"
+	failed=1
+fi
+
+[ $failed = 0 ] && echo "all tests passed"
+exit $failed
@@ -0,0 +1,190 @@
+#include "Batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+namespace
+{
+	/* a, b, c, r0-r15, ip, sp, f. returns false if name is none of those */
+	bool ParseRegister(const std::string& name, u64* regcode)
+	{
+		using reg = RegVM::reg;
+		static const std::unordered_map<std::string, u64> special = {
+			{ "a", reg::A }, { "b", reg::B }, { "c", reg::C },
+			{ "ip", reg::IP }, { "sp", reg::SP }, { "f", reg::F }
+		};
+		auto it = special.find(name);
+		if (it != special.end())
+		{
+			*regcode = it->second;
+			return true;
+		}
+		if (name.size() < 2 || name.size() > 3 || name[0] != 'r')
+			return false;
+		char* end = nullptr;
+		unsigned long n = strtoul(name.c_str() + 1, &end, 10);
+		if (*end != '\0' || n > 15)
+			return false;
+		*regcode = VMs::Reg::GetGPR(n);
+		return true;
+	}
+
+	/* nearest-rank percentile of sorted values */
+	double Percentile(const std::vector<double>& sorted, double p)
+	{
+		if (sorted.empty()) return 0;
+		size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+		rank = std::min(std::max(rank, (size_t)1), sorted.size());
+		return sorted[rank - 1];
+	}
+}
+
+bool BatchRunner::LoadManifest(const char* path)
+{
+	std::ifstream manifest(path);
+	if (!manifest.is_open())
+	{
+		printf("error opening manifest [%s]\n", path);
+		return false;
+	}
+	std::string line;
+	size_t lineNumber = 0;
+	while (std::getline(manifest, line))
+	{
+		++lineNumber;
+		std::istringstream words(line);
+		Job job;
+		if (!(words >> job.program) || job.program[0] == '#')
+			continue;
+		std::string input;
+		while (words >> input)
+		{
+			size_t eq = input.find('=');
+			u64 regcode;
+			char* end = nullptr;
+			i64 value = eq == std::string::npos ? 0 : strtoll(input.c_str() + eq + 1, &end, 0);
+			if (eq == std::string::npos || !ParseRegister(input.substr(0, eq), &regcode) || end == input.c_str() + eq + 1 || *end != '\0')
+			{
+				printf("error: manifest line %zu: invalid input [%s]\n", lineNumber, input.c_str());
+				return false;
+			}
+			job.inputs.push_back({ regcode, value });
+		}
+		if (!m_programs.count(job.program))
+		{
+			std::ifstream file(job.program, std::ios::binary);
+			if (!file.is_open())
+			{
+				printf("error: manifest line %zu: unable to open program [%s]\n", lineNumber, job.program.c_str());
+				return false;
+			}
+			m_programs[job.program].assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		}
+		m_jobs.push_back(job);
+	}
+	return true;
+}
+
+void BatchRunner::Run(size_t workers)
+{
+	if (workers == 0)
+		workers = std::max(std::thread::hardware_concurrency(), 1u);
+	m_stats = Stats();
+	m_stats.workers = workers;
+	// deal the jobs out round-robin
+	std::vector<WorkQueue> queues(workers);
+	m_queues.swap(queues);
+	for (size_t i = 0; i < m_jobs.size(); ++i)
+		m_queues[i % workers].jobs.push_back(i);
+	std::vector<size_t> steals(workers, 0);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (size_t w = 1; w < workers; ++w)
+		threads.emplace_back(&BatchRunner::Work, this, w, &steals[w]);
+	Work(0, &steals[0]);
+	for (auto& t : threads)
+		t.join();
+	for (size_t n : steals)
+		m_stats.steals += n;
+	m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void BatchRunner::Work(size_t worker, size_t* steals)
+{
+	RegVM vm;
+	size_t index;
+	while (Take(worker, &index, steals))
+	{
+		Job& job = m_jobs[index];
+		const std::vector<byte>& program = m_programs.find(job.program)->second;
+		auto start = std::chrono::steady_clock::now();
+		vm.LoadProgram(program.data(), program.size());
+		for (const auto& input : job.inputs)
+			vm.SetRegister(input.first, input.second);
+		vm.Run();
+		job.result = vm.GetRegister(RegVM::reg::A);
+		job.fault = vm.GetFault();
+		job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+/* next job for worker: the back of its own deque, else the front of another.
+   jobs are never added once the batch runs, so all deques empty means done */
+bool BatchRunner::Take(size_t worker, size_t* job, size_t* steals)
+{
+	{
+		WorkQueue& own = m_queues[worker];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.jobs.empty())
+		{
+			*job = own.jobs.back();
+			own.jobs.pop_back();
+			return true;
+		}
+	}
+	for (size_t i = 1; i < m_queues.size(); ++i)
+	{
+		WorkQueue& victim = m_queues[(worker + i) % m_queues.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.jobs.empty())
+		{
+			*job = victim.jobs.front();
+			victim.jobs.pop_front();
+			++*steals;
+			return true;
+		}
+	}
+	return false;
+}
+
+void BatchRunner::PrintReport()
+{
+	for (size_t i = 0; i < m_jobs.size(); ++i)
+	{
+		if (m_jobs[i].fault)
+			printf("%zu\t%s\tfault: %s\n", i, m_jobs[i].program.c_str(), m_jobs[i].fault);
+		else
+			printf("%zu\t%s\ta = %lld\n", i, m_jobs[i].program.c_str(), m_jobs[i].result);
+	}
+
+	std::vector<double> latencies;
+	for (const Job& job : m_jobs)
+		latencies.push_back(job.seconds * 1000.0);
+	std::sort(latencies.begin(), latencies.end());
+	printf("BATCH:\n------------\n"
+		"jobs:\t\t%zu\n"
+		"workers:\t%zu\n"
+		"steals:\t\t%zu\n"
+		"wall time:\t%.3f s\n"
+		"throughput:\t%.1f jobs/s\n"
+		"latency (ms):\tp50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+		m_jobs.size(), m_stats.workers, m_stats.steals, m_stats.seconds,
+		m_stats.seconds > 0 ? m_jobs.size() / m_stats.seconds : 0.0,
+		Percentile(latencies, 50), Percentile(latencies, 90), Percentile(latencies, 99),
+		latencies.empty() ? 0.0 : latencies.back());
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "RegVM.h"
+
+/* BATCH RUNNER
+	runs a manifest of independent RegVM jobs on a pool of worker threads.
+	jobs are dealt out to one deque per worker up front. a worker takes jobs
+	from the back of its own deque and, once that is empty, steals from the
+	front of the others'. every worker keeps a single RegVM (and its guest
+	memory) and reloads it for each job. a reload starts the job on zeroed
+	memory past its program and a fresh context, as a new RegVM would.
+
+	manifest: one job per line. blank lines and lines starting with '#' are skipped
+		<program file> [<register>=<value> ...]
+	e.g. "fib.bin a=30 r4=-1" runs fib.bin with a = 30 and r4 = -1
+*/
+class BatchRunner
+{
+public:
+	struct Job
+	{
+		std::string program;
+		std::vector<std::pair<u64, i64>> inputs;	// regcode, initial value
+		/* filled in by Run */
+		double seconds = 0;		// load and run
+		i64 result = 0;			// register a once the program halted
+		const char* fault = nullptr;	// or why it was stopped (RegVM::GetFault)
+	};
+	struct Stats
+	{
+		size_t workers = 0;
+		size_t steals = 0;		// jobs taken from another worker's deque
+		double seconds = 0;		// wall clock for the whole batch
+	};
+private:
+	struct WorkQueue
+	{
+		std::mutex lock;
+		std::deque<size_t> jobs;	// indices into m_jobs
+	};
+	std::vector<Job> m_jobs;
+	std::unordered_map<std::string, std::vector<byte>> m_programs;	// file contents, read once
+	std::vector<WorkQueue> m_queues;
+	Stats m_stats;
+public:
+	/* read the manifest and every program it names. false on any error */
+	bool LoadManifest(const char* path);
+	/* run every job. workers = 0 uses one per hardware thread */
+	void Run(size_t workers = 0);
+	/* per-job results, throughput and latency percentiles */
+	void PrintReport();
+	const std::vector<Job>& GetJobs() const { return m_jobs; }
+	const Stats& GetStats() const { return m_stats; }
+private:
+	void Work(size_t worker, size_t* steals);
+	bool Take(size_t worker, size_t* job, size_t* steals);
+};
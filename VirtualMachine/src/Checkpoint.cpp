@@ -0,0 +1,340 @@
+#include "Checkpoint.h"
+#include "VMImage.h"
+#include "GuestMemory.h"
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <signal.h>
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+	/* trackers the fault handler knows about. a fixed array of atomics,
+	   since the handler cannot take locks */
+	const int MAX_TRACKERS = 256;
+	std::atomic<DirtyTracker*> s_trackers[MAX_TRACKERS];
+	std::once_flag s_installed;
+
+#ifdef _WIN32
+	LONG CALLBACK OnException(EXCEPTION_POINTERS* info)
+	{
+		const EXCEPTION_RECORD* e = info->ExceptionRecord;
+		if (e->ExceptionCode == EXCEPTION_ACCESS_VIOLATION && e->NumberParameters >= 2 && e->ExceptionInformation[0] == 1
+			&& DirtyTracker::OnWrite(reinterpret_cast<const void*>(e->ExceptionInformation[1])))
+			return EXCEPTION_CONTINUE_EXECUTION;
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	void InstallHandler()
+	{
+		AddVectoredExceptionHandler(1, OnException);
+	}
+#else
+	struct sigaction s_previous;
+
+	void OnSegv(int sig, siginfo_t* info, void* context)
+	{
+		if (DirtyTracker::OnWrite(info->si_addr))
+			return;
+		// not a tracked page: whoever was installed before us
+		if (s_previous.sa_flags & SA_SIGINFO)
+			s_previous.sa_sigaction(sig, info, context);
+		else if (s_previous.sa_handler != SIG_DFL && s_previous.sa_handler != SIG_IGN)
+			s_previous.sa_handler(sig);
+		else
+			// returning re-runs the faulting instruction, which now crashes normally
+			signal(sig, SIG_DFL);
+	}
+
+	void InstallHandler()
+	{
+		struct sigaction sa = {};
+		sa.sa_sigaction = OnSegv;
+		sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGSEGV, &sa, &s_previous);
+	}
+#endif
+
+	struct FileHeader
+	{
+		byte magic[4];
+		u32 version;
+		u64 memSize;
+	};
+	const byte FILE_MAGIC[4] = { 'V', 'M', 'C', 'K' };
+
+	struct RecordHeader
+	{
+		u32 magic;
+		u32 stateSize;
+		u64 sequence;
+		u64 ranges;
+		u64 payload;		// bytes after this header
+	};
+	const u32 RECORD_MAGIC = 0x544b4350;	// "PCKT"
+}
+
+#pragma region DirtyTracker
+DirtyTracker::DirtyTracker(byte* mem, size_t size, size_t guard, size_t guardLength)
+	: m_mem(mem), m_size(size), m_pageSize(GuestMemory::PageSize())
+{
+	const uintptr_t start = reinterpret_cast<uintptr_t>(mem);
+	const uintptr_t first = (start + m_pageSize - 1) / m_pageSize * m_pageSize;
+	const uintptr_t last = (start + size) / m_pageSize * m_pageSize;
+	m_head = first - start < size ? first - start : size;
+	m_pages = last > first ? (last - first) / m_pageSize : 0;
+	m_dirty.assign(m_pages, 0);
+	if (guardLength && m_pages)
+	{
+		// guard pages are whole pages, so they line up with ours
+		m_guardFirst = guard > m_head ? (guard - m_head) / m_pageSize : 0;
+		m_guardCount = guardLength / m_pageSize;
+	}
+#ifdef _WIN32
+	MEMORY_BASIC_INFORMATION region;
+	m_protection = PAGE_READWRITE;
+	if (m_pages && VirtualQuery(mem + m_head, &region, sizeof(region)) && region.State == MEM_COMMIT)
+		m_protection = region.Protect;
+#endif
+	std::call_once(s_installed, InstallHandler);
+	for (int i = 0; i < MAX_TRACKERS && !m_registered; ++i)
+	{
+		DirtyTracker* expected = nullptr;
+		m_registered = s_trackers[i].compare_exchange_strong(expected, this);
+	}
+	if (m_registered)
+		ProtectAll(false);
+}
+
+DirtyTracker::~DirtyTracker()
+{
+	if (!m_registered)
+		return;
+	ProtectAll(true);
+	for (int i = 0; i < MAX_TRACKERS; ++i)
+	{
+		DirtyTracker* expected = this;
+		if (s_trackers[i].compare_exchange_strong(expected, nullptr))
+			break;
+	}
+}
+
+/* every whole page but the guard */
+void DirtyTracker::ProtectAll(bool writable)
+{
+	const size_t first = m_guardFirst < m_pages ? m_guardFirst : m_pages;
+	Protect(0, first, writable);
+	if (first + m_guardCount < m_pages)
+		Protect(first + m_guardCount, m_pages - first - m_guardCount, writable);
+}
+
+void DirtyTracker::Protect(size_t first, size_t count, bool writable)
+{
+	if (!count)
+		return;
+	byte* p = m_mem + m_head + first * m_pageSize;
+	const size_t length = count * m_pageSize;
+#ifdef _WIN32
+	// GuestMemory commits on demand, and VirtualProtect fails on a range
+	// with uncommitted pages in it: go region by region
+	for (byte* end = p + length; p < end;)
+	{
+		MEMORY_BASIC_INFORMATION region;
+		if (!VirtualQuery(p, &region, sizeof(region)))
+			return;
+		byte* next = reinterpret_cast<byte*>(region.BaseAddress) + region.RegionSize;
+		const size_t n = (next < end ? next : end) - p;
+		DWORD old;
+		if (region.State == MEM_COMMIT)
+			VirtualProtect(p, n, writable ? m_protection : PAGE_READONLY, &old);
+		else if (writable)
+			// first write to a page that was never committed
+			VirtualAlloc(p, n, MEM_COMMIT, PAGE_READWRITE);
+		p += n;
+	}
+#else
+	mprotect(p, length, writable ? PROT_READ | PROT_WRITE : PROT_READ);
+#endif
+}
+
+bool DirtyTracker::OnWrite(const void* address)
+{
+	const byte* a = reinterpret_cast<const byte*>(address);
+	for (int i = 0; i < MAX_TRACKERS; ++i)
+	{
+		DirtyTracker* t = s_trackers[i].load();
+		if (!t || a < t->m_mem + t->m_head || a >= t->m_mem + t->m_head + t->m_pages * t->m_pageSize)
+			continue;
+		const size_t page = (a - t->m_mem - t->m_head) / t->m_pageSize;
+		if (page >= t->m_guardFirst && page < t->m_guardFirst + t->m_guardCount)
+			return false;
+		t->m_dirty[page] = 1;
+		t->Protect(page, 1, true);
+		return true;
+	}
+	return false;
+}
+#pragma endregion
+
+#pragma region CheckpointLog
+CheckpointLog::CheckpointLog(byte* mem, size_t size, size_t guard, size_t guardLength)
+	: m_mem(mem), m_size(size), m_guard(guard), m_guardLength(guardLength)
+{
+}
+
+CheckpointLog::~CheckpointLog()
+{
+	delete m_tracker;
+}
+
+bool CheckpointLog::Open(const char* path, const void* state, size_t stateSize)
+{
+	m_file.open(path, std::ios::binary | std::ios::trunc);
+	if (!m_file.is_open())
+	{
+		printf("error opening checkpoint log [%s]\n", path);
+		return false;
+	}
+	FileHeader header;
+	memcpy(header.magic, FILE_MAGIC, 4);
+	header.version = VERSION;
+	header.memSize = m_size;
+	m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	// first checkpoint: everything that is not zero, in page sized ranges
+	const size_t PAGE = 4096;
+	std::vector<std::pair<size_t, size_t>> ranges;
+	for (size_t at = 0; at < m_size; at += PAGE)
+	{
+		const size_t n = m_size - at < PAGE ? m_size - at : PAGE;
+		if (at >= m_guard && at < m_guard + m_guardLength)
+			continue;
+		size_t i = 0;
+		while (i < n && !m_mem[at + i]) ++i;
+		if (i == n) continue;
+		if (!ranges.empty() && ranges.back().first + ranges.back().second == at)
+			ranges.back().second += n;
+		else
+			ranges.push_back({ at, n });
+	}
+	if (!Write(state, stateSize, ranges))
+		return false;
+	// track from here on
+	m_tracker = new DirtyTracker(m_mem, m_size, m_guard, m_guardLength);
+	return true;
+}
+
+bool CheckpointLog::Append(const void* state, size_t stateSize)
+{
+	if (!m_tracker)
+		return false;
+	std::vector<std::pair<size_t, size_t>> ranges;
+	m_tracker->Collect([&ranges](size_t offset, size_t length) { ranges.push_back({ offset, length }); });
+	return Write(state, stateSize, ranges);
+}
+
+bool CheckpointLog::Write(const void* state, size_t stateSize, const std::vector<std::pair<size_t, size_t>>& ranges)
+{
+	RecordHeader header;
+	header.magic = RECORD_MAGIC;
+	header.stateSize = static_cast<u32>(stateSize);
+	header.sequence = m_stats.checkpoints;
+	header.ranges = ranges.size();
+	header.payload = stateSize;
+	u64 bytes = 0;
+	for (const auto& range : ranges)
+		bytes += range.second;
+	header.payload += ranges.size() * 16 + bytes;
+	m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	m_file.write(reinterpret_cast<const char*>(state), stateSize);
+	for (const auto& range : ranges)
+	{
+		const u64 where[2] = { range.first, range.second };
+		m_file.write(reinterpret_cast<const char*>(where), sizeof(where));
+		m_file.write(reinterpret_cast<const char*>(m_mem + range.first), range.second);
+	}
+	m_file.flush();
+	if (!m_file.good())
+	{
+		printf("error writing checkpoint\n");
+		return false;
+	}
+	m_stats.checkpoints++;
+	m_stats.bytes += bytes;
+	return true;
+}
+
+byte* CheckpointLog::Replay(const char* path, void* state, size_t stateSize, size_t* memSize)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+	{
+		printf("error opening checkpoint log [%s]\n", path);
+		return nullptr;
+	}
+	file.seekg(0, std::ios::end);
+	const u64 fileSize = file.tellg();
+	file.seekg(0, std::ios::beg);
+	FileHeader header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!file || memcmp(header.magic, FILE_MAGIC, 4) != 0 || header.version != VERSION)
+	{
+		printf("error: [%s] is not a checkpoint log\n", path);
+		return nullptr;
+	}
+	byte* mem = GuestMemory::Reserve(VMImage::MappedSize(header.memSize));
+	if (!mem)
+		return nullptr;
+	size_t complete = 0;
+	std::vector<byte> record;
+	for (;;)
+	{
+		RecordHeader r;
+		const u64 at = file.tellg();
+		if (!file.read(reinterpret_cast<char*>(&r), sizeof(r)) || r.magic != RECORD_MAGIC || r.stateSize != stateSize
+			|| r.sequence != complete || r.payload > fileSize - at - sizeof(r))
+			break;
+		// whole record first, so a torn one is never half applied
+		record.resize(r.payload);
+		if (!file.read(reinterpret_cast<char*>(record.data()), r.payload))
+			break;
+		// check every range before applying any
+		bool ok = true;
+		for (int apply = 0; apply < 2 && ok; ++apply)
+		{
+			size_t pos = stateSize;
+			for (u64 i = 0; i < r.ranges && ok; ++i)
+			{
+				u64 where[2];
+				ok = pos + sizeof(where) <= record.size();
+				if (!ok) break;
+				memcpy(where, &record[pos], sizeof(where));
+				pos += sizeof(where);
+				ok = where[0] <= header.memSize && where[1] <= header.memSize - where[0] && where[1] <= record.size() - pos;
+				if (ok && apply)
+					memcpy(mem + where[0], &record[pos], where[1]);
+				pos += where[1];
+			}
+		}
+		if (!ok)
+			break;
+		memcpy(state, record.data(), stateSize);
+		complete++;
+	}
+	if (!complete)
+	{
+		printf("error: checkpoint log [%s] holds no complete checkpoint\n", path);
+		GuestMemory::Release(mem, VMImage::MappedSize(header.memSize));
+		return nullptr;
+	}
+	*memSize = header.memSize;
+	return mem;
+}
+#pragma endregion
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <fstream>
+#include <vector>
+
+#include "Definitions.h"
+
+/* DIRTY PAGE TRACKING
+	write-protects the host pages of a guest memory block and catches the
+	first write to each one (SIGSEGV handler / vectored exception handler),
+	which marks the page dirty and makes it writable again. this covers every
+	engine, the JIT's stores included, without touching the store handlers.
+	partial pages at either end of the block are never protected (they may
+	be shared with other allocations) and always count as dirty.
+	if the process runs out of tracker slots, the whole block counts as dirty.
+	a guard range (GuestMemory::Guard) is never protected, tracked or
+	reported: faults on it belong to RunGuarded.
+*/
+class DirtyTracker
+{
+private:
+	byte* m_mem;
+	size_t m_size;
+	size_t m_pageSize;
+	size_t m_head;				// offset of the first whole page
+	size_t m_pages;				// whole pages
+	size_t m_guardFirst = 0;	// whole pages left alone
+	size_t m_guardCount = 0;
+	std::vector<byte> m_dirty;	// per whole page, written by the fault handler
+	bool m_registered = false;
+	u32 m_protection = 0;		// windows: protection to restore on written pages
+public:
+	/* guard: offset and length of a guard range in mem, page aligned */
+	DirtyTracker(byte* mem, size_t size, size_t guard = 0, size_t guardLength = 0);
+	~DirtyTracker();
+	DirtyTracker(const DirtyTracker&) = delete;
+	DirtyTracker& operator=(const DirtyTracker&) = delete;
+	/* calls f(offset, length) for every range written since the last Collect
+	   (or since construction), then write-protects those pages again */
+	template<typename F>
+	void Collect(F f);
+	/* fault handler entry: true if address belongs to a tracked page */
+	static bool OnWrite(const void* address);
+private:
+	void ProtectAll(bool writable);
+	void Protect(size_t first, size_t count, bool writable);
+};
+
+/* CHECKPOINT LOGS
+	an append-only file of checkpoints for one guest memory block.
+		header:		'V' 'M' 'C' 'K', version, memory size
+		record:		magic, sequence number, state size, range count, payload
+					size, then the VM state and per range: offset, length,
+					bytes
+	the first record holds every non-zero range, later ones only what
+	DirtyTracker saw written since the record before. Replay applies the
+	records in order and stops at the first incomplete one, so a crash while
+	appending loses only that checkpoint.
+*/
+class CheckpointLog
+{
+public:
+	struct Stats
+	{
+		size_t checkpoints = 0;
+		u64 bytes = 0;			// guest memory bytes written, over all checkpoints
+	};
+	static const u32 VERSION = 2;
+private:
+	std::ofstream m_file;
+	byte* m_mem;
+	size_t m_size;
+	size_t m_guard;				// skipped by the first checkpoint and the tracker
+	size_t m_guardLength;
+	DirtyTracker* m_tracker = nullptr;
+	Stats m_stats;
+public:
+	CheckpointLog(byte* mem, size_t size, size_t guard = 0, size_t guardLength = 0);
+	~CheckpointLog();
+	CheckpointLog(const CheckpointLog&) = delete;
+	CheckpointLog& operator=(const CheckpointLog&) = delete;
+	/* create the log and write the first, full checkpoint */
+	bool Open(const char* path, const void* state, size_t stateSize);
+	/* append what changed since the last checkpoint */
+	bool Append(const void* state, size_t stateSize);
+	const Stats& GetStats() const { return m_stats; }
+	/* memory (GuestMemory::Reserve'd) and state as of the last complete
+	   checkpoint, or nullptr */
+	static byte* Replay(const char* path, void* state, size_t stateSize, size_t* memSize);
+private:
+	bool Write(const void* state, size_t stateSize, const std::vector<std::pair<size_t, size_t>>& ranges);
+};
+
+template<typename F>
+void DirtyTracker::Collect(F f)
+{
+	if (!m_registered)
+	{
+		f(0, m_size);
+		return;
+	}
+	if (m_head)
+		f(0, m_head);
+	for (size_t page = 0; page < m_pages; ++page)
+	{
+		if (!m_dirty[page]) continue;
+		// runs of dirty pages become one range
+		size_t end = page;
+		while (end < m_pages && m_dirty[end])
+			m_dirty[end++] = 0;
+		f(m_head + page * m_pageSize, (end - page) * m_pageSize);
+		Protect(page, end - page, false);
+		page = end;
+	}
+	const size_t tail = m_head + m_pages * m_pageSize;
+	if (tail < m_size)
+		f(tail, m_size - tail);
+}
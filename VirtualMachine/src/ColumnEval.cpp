@@ -0,0 +1,249 @@
+#include "ColumnEval.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define COLUMN_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// msvc takes avx2 intrinsics anywhere, gcc/clang only in functions marked for it
+#if defined(COLUMN_AVX2) && defined(__GNUC__)
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define AVX2_TARGET
+#endif
+
+namespace
+{
+	using op = VMs::Stack::Opcode;
+
+	/* scalar kernels, and the tail of every avx2 one */
+	void AddScalar(const i32* lhs, const i32* rhs, i32* out, size_t rows)
+	{
+		for (size_t i = 0; i < rows; ++i)
+			out[i] = (i16)lhs[i] + (i16)rhs[i];
+	}
+
+	void SubScalar(const i32* lhs, const i32* rhs, i32* out, size_t rows)
+	{
+		for (size_t i = 0; i < rows; ++i)
+			out[i] = (i16)lhs[i] - (i16)rhs[i];
+	}
+
+	void MulScalar(const i32* lhs, const i32* rhs, i32* out, size_t rows)
+	{
+		for (size_t i = 0; i < rows; ++i)
+			out[i] = (i16)lhs[i] * (i16)rhs[i];
+	}
+
+	void DivScalar(const i32* lhs, const i32* rhs, i32* out, size_t rows)
+	{
+		for (size_t i = 0; i < rows; ++i)
+			out[i] = (i16)rhs[i] ? (i16)lhs[i] / (i16)rhs[i] : 0;
+	}
+
+#ifdef COLUMN_AVX2
+	/* sign extend the low 16 bits of each lane, like the (i16) casts */
+	AVX2_TARGET inline __m256i Narrow(__m256i v)
+	{
+		return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+	}
+
+	AVX2_TARGET inline __m256i Load(const i32* p)
+	{
+		return Narrow(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+	}
+
+	AVX2_TARGET inline void Store(i32* p, __m256i v)
+	{
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+	}
+
+	AVX2_TARGET void AddAVX2(const i32* lhs, const i32* rhs, i32* out, size_t rows)
+	{
+		size_t i = 0;
+		for (; i + 8 <= rows; i += 8)
+			Store(out + i, _mm256_add_epi32(Load(lhs + i), Load(rhs + i)));
+		AddScalar(lhs + i, rhs + i, out + i, rows - i);
+	}
+
+	AVX2_TARGET void SubAVX2(const i32* lhs, const i32* rhs, i32* out, size_t rows)
+	{
+		size_t i = 0;
+		for (; i + 8 <= rows; i += 8)
+			Store(out + i, _mm256_sub_epi32(Load(lhs + i), Load(rhs + i)));
+		SubScalar(lhs + i, rhs + i, out + i, rows - i);
+	}
+
+	AVX2_TARGET void MulAVX2(const i32* lhs, const i32* rhs, i32* out, size_t rows)
+	{
+		// 16 x 16 bit products always fit the low 32 bits
+		size_t i = 0;
+		for (; i + 8 <= rows; i += 8)
+			Store(out + i, _mm256_mullo_epi32(Load(lhs + i), Load(rhs + i)));
+		MulScalar(lhs + i, rhs + i, out + i, rows - i);
+	}
+
+	AVX2_TARGET void DivAVX2(const i32* lhs, const i32* rhs, i32* out, size_t rows)
+	{
+		// there is no integer divide. for 16 bit operands the float quotient,
+		// truncated, is exact: it is never closer than 1/|rhs| to the next
+		// integer, and its rounding error stays well below that
+		size_t i = 0;
+		const __m256i zero = _mm256_setzero_si256();
+		for (; i + 8 <= rows; i += 8)
+		{
+			const __m256i a = Load(lhs + i);
+			const __m256i b = Load(rhs + i);
+			const __m256i q = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(a), _mm256_cvtepi32_ps(b)));
+			Store(out + i, _mm256_andnot_si256(_mm256_cmpeq_epi32(b, zero), q));
+		}
+		DivScalar(lhs + i, rhs + i, out + i, rows - i);
+	}
+#endif
+}
+
+ColumnEvaluator::ColumnEvaluator()
+{
+	SetKernels(Kernels::AVX2);
+}
+
+bool ColumnEvaluator::HasAVX2()
+{
+#if !defined(COLUMN_AVX2)
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	// the os has to save ymm registers too
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+void ColumnEvaluator::SetKernels(Kernels kernels)
+{
+	m_kernels = Kernels::Scalar;
+	m_binary[op::ADD] = AddScalar;
+	m_binary[op::SUB] = SubScalar;
+	m_binary[op::MUL] = MulScalar;
+	m_binary[op::DIV] = DivScalar;
+#ifdef COLUMN_AVX2
+	if (kernels == Kernels::AVX2 && HasAVX2())
+	{
+		m_kernels = Kernels::AVX2;
+		m_binary[op::ADD] = AddAVX2;
+		m_binary[op::SUB] = SubAVX2;
+		m_binary[op::MUL] = MulAVX2;
+		m_binary[op::DIV] = DivAVX2;
+	}
+#endif
+}
+
+bool ColumnEvaluator::Compile(const void* program, size_t size)
+{
+	m_steps.clear();
+	m_depth = 0;
+	m_columns = 0;
+	const u32* words = reinterpret_cast<const u32*>(program);
+	size_t depth = 0;
+	for (size_t i = 0; i < size / sizeof(u32); ++i)
+	{
+		// same split as Instruction::Get
+		const Step step = { static_cast<u16>(words[i] >> 16), static_cast<u16>(words[i] & 0xffff) };
+		switch (step.opcode)
+		{
+		case op::HALT:
+			if (!depth)
+			{
+				m_error = "program halts with an empty stack";
+				m_steps.clear();
+				return false;
+			}
+			m_error = nullptr;
+			return true;
+		case op::PUSH:
+		case op::COLUMN:
+			if (step.opcode == op::COLUMN)
+				m_columns = std::max(m_columns, static_cast<size_t>(step.data) + 1);
+			m_steps.push_back(step);
+			m_depth = std::max(m_depth, ++depth);
+			break;
+		case op::ADD:
+		case op::SUB:
+		case op::MUL:
+		case op::DIV:
+			if (depth < 2)
+			{
+				m_error = "operator pops from an empty stack";
+				m_steps.clear();
+				return false;
+			}
+			m_steps.push_back(step);
+			--depth;
+			break;
+		default:
+			// NOP, ALERT and unknown opcodes leave the stack alone
+			break;
+		}
+	}
+	m_error = "program does not halt";
+	m_steps.clear();
+	return false;
+}
+
+bool ColumnEvaluator::Evaluate(const i32* const* columns, size_t columnCount, size_t rows, i32* out)
+{
+	if (m_steps.empty())
+	{
+		m_error = "no program compiled";
+		return false;
+	}
+	if (columnCount < m_columns)
+	{
+		m_error = "program reads more columns than were given";
+		return false;
+	}
+	m_blocks.resize(m_depth * BLOCK_ROWS);
+	// what each stack slot holds for the current block: its own block of
+	// m_blocks, or straight from an input column
+	std::vector<const i32*> slots(m_depth);
+	for (size_t first = 0; first < rows; first += BLOCK_ROWS)
+	{
+		const size_t n = std::min(BLOCK_ROWS, rows - first);
+		size_t sp = 0;
+		for (const Step& step : m_steps)
+		{
+			if (step.opcode == op::PUSH)
+			{
+				i32* block = &m_blocks[sp * BLOCK_ROWS];
+				std::fill(block, block + n, static_cast<i32>(step.data));
+				slots[sp++] = block;
+			}
+			else if (step.opcode == op::COLUMN)
+				slots[sp++] = columns[step.data] + first;
+			else
+			{
+				// result replaces the left operand, in its slot's block
+				i32* block = &m_blocks[(sp - 2) * BLOCK_ROWS];
+				m_binary[step.opcode](slots[sp - 2], slots[sp - 1], block, n);
+				slots[sp - 2] = block;
+				--sp;
+			}
+		}
+		memcpy(out + first, slots[sp - 1], n * sizeof(i32));
+	}
+	return true;
+}
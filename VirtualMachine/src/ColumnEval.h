@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "Definitions.h"
+
+/* COLUMNAR EVALUATION
+	runs one StackVM program over many rows at once. Compile checks the
+	program and turns it into a list of steps; Evaluate then streams the rows
+	through them BLOCK_ROWS at a time, each step covering the whole block
+	(operator at a time), so the arithmetic is a tight loop over arrays:
+		avx2:		8 rows per instruction, if the cpu has it
+		scalar:		anywhere else
+	each row gets what StackVM would leave on top of the stack with
+	SetRow(that row): $n (COLUMN n) reads input column n, operands are cut to
+	16 bits and results are 32 bits. division by zero gives 0 instead of
+	crashing the host.
+	a program is rejected if it does not end in HALT or would pop from an
+	empty stack.
+*/
+class ColumnEvaluator
+{
+public:
+	static constexpr size_t BLOCK_ROWS = 1024;
+	enum class Kernels : u8
+	{
+		Scalar,
+		AVX2
+	};
+	typedef void(*kernel)(const i32* lhs, const i32* rhs, i32* out, size_t rows);
+private:
+	struct Step
+	{
+		u16 opcode;
+		u16 data;
+	};
+	std::vector<Step> m_steps;
+	size_t m_depth = 0;				// deepest stack the program reaches
+	size_t m_columns = 0;			// input columns it reads
+	Kernels m_kernels;
+	kernel m_binary[VMs::Stack::OPCODE_END] = {};	// ADD, SUB, MUL, DIV
+	std::vector<i32> m_blocks;		// one block of rows per stack slot
+	const char* m_error = nullptr;
+public:
+	ColumnEvaluator();
+	/* program as for StackVM::LoadProgram. false if it has no columnar form,
+	   see GetError */
+	bool Compile(const void* program, size_t size);
+	/* columns[i] holds rows values of input column i, out gets rows
+	   results. false if the program reads more than columnCount columns */
+	bool Evaluate(const i32* const* columns, size_t columnCount, size_t rows, i32* out);
+	size_t GetColumnCount() const { return m_columns; }
+	const char* GetError() const { return m_error; }
+	/* the fastest the cpu supports by default. AVX2 falls back to Scalar
+	   where the cpu lacks it */
+	void SetKernels(Kernels kernels);
+	Kernels GetKernels() const { return m_kernels; }
+	static bool HasAVX2();
+};
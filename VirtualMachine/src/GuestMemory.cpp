@@ -0,0 +1,325 @@
+#include "GuestMemory.h"
+
+#include <atomic>
+#include <mutex>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	bool InGuard(const GuestMemory::Range* guards, size_t count, const byte* a)
+	{
+		for (size_t i = 0; i < count; ++i)
+			if (a >= guards[i].begin && a < guards[i].begin + guards[i].length)
+				return true;
+		return false;
+	}
+}
+
+#ifdef _WIN32
+namespace
+{
+	/* reserved ranges the exception handler commits pages in. size is set
+	   before base, base cleared before size, so the handler never sees half
+	   an entry */
+	const int MAX_RANGES = 1024;
+	std::atomic<byte*> s_bases[MAX_RANGES];
+	std::atomic<size_t> s_sizes[MAX_RANGES];
+	std::once_flag s_installed;
+
+	LONG CALLBACK OnException(EXCEPTION_POINTERS* info)
+	{
+		const EXCEPTION_RECORD* e = info->ExceptionRecord;
+		if (e->ExceptionCode == EXCEPTION_ACCESS_VIOLATION && e->NumberParameters >= 2
+			&& GuestMemory::Commit(reinterpret_cast<const void*>(e->ExceptionInformation[1])))
+			return EXCEPTION_CONTINUE_EXECUTION;
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	void InstallHandler()
+	{
+		// last in line, so dirty page tracking sees its writes first
+		AddVectoredExceptionHandler(0, OnException);
+	}
+
+	int GuardFilter(EXCEPTION_POINTERS* info, const GuestMemory::Range* guards, size_t count,
+		GuestMemory::FaultHook onFault, void* arg, const void** fault)
+	{
+		const EXCEPTION_RECORD* e = info->ExceptionRecord;
+		if (e->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || e->NumberParameters < 2)
+			return EXCEPTION_CONTINUE_SEARCH;
+		const byte* a = reinterpret_cast<const byte*>(e->ExceptionInformation[1]);
+		if (!InGuard(guards, count, a))
+			return EXCEPTION_CONTINUE_SEARCH;
+		if (onFault)
+			onFault(info->ContextRecord, arg);
+		*fault = a;
+		return EXCEPTION_EXECUTE_HANDLER;
+	}
+}
+#else
+namespace
+{
+	/* the innermost RunGuarded on this thread */
+	struct Recovery
+	{
+		sigjmp_buf env;
+		const GuestMemory::Range* guards;
+		size_t count;
+		GuestMemory::FaultHook onFault;
+		void* arg;
+		const void* fault;
+		Recovery* outer;
+	};
+	thread_local Recovery* t_recovery = nullptr;
+	struct sigaction s_previous;
+	std::once_flag s_installed;
+
+	void OnSegv(int sig, siginfo_t* info, void* context)
+	{
+		Recovery* r = t_recovery;
+		const byte* a = reinterpret_cast<const byte*>(info->si_addr);
+		if (r && InGuard(r->guards, r->count, a))
+		{
+			if (r->onFault)
+				r->onFault(context, r->arg);
+			r->fault = a;
+			siglongjmp(r->env, 1);
+		}
+		// not a guard hit: whoever was installed before us
+		if (s_previous.sa_flags & SA_SIGINFO)
+			s_previous.sa_sigaction(sig, info, context);
+		else if (s_previous.sa_handler != SIG_DFL && s_previous.sa_handler != SIG_IGN)
+			s_previous.sa_handler(sig);
+		else
+			signal(sig, SIG_DFL);
+	}
+
+	void InstallHandler()
+	{
+		struct sigaction sa = {};
+		sa.sa_sigaction = OnSegv;
+		sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGSEGV, &sa, &s_previous);
+	}
+}
+#endif
+
+byte* GuestMemory::Reserve(size_t size)
+{
+#ifdef _WIN32
+	std::call_once(s_installed, InstallHandler);
+	byte* base = reinterpret_cast<byte*>(VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE));
+	if (!base)
+		return nullptr;
+	for (int i = 0; i < MAX_RANGES; ++i)
+	{
+		if (s_bases[i].load())
+			continue;
+		s_sizes[i].store(size);
+		byte* expected = nullptr;
+		if (s_bases[i].compare_exchange_strong(expected, base))
+			return base;
+	}
+	// no slot for demand commit, commit it all
+	if (!VirtualAlloc(base, size, MEM_COMMIT, PAGE_READWRITE))
+	{
+		VirtualFree(base, 0, MEM_RELEASE);
+		return nullptr;
+	}
+	return base;
+#else
+	const bool huge = size >= HUGE_PAGE_MIN;
+	// room to align the start to a huge page
+	const size_t reserve = huge ? size + HUGE_PAGE : size;
+	void* p = mmap(nullptr, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+	byte* base = reinterpret_cast<byte*>(p);
+	if (huge)
+	{
+		byte* aligned = reinterpret_cast<byte*>((reinterpret_cast<uintptr_t>(base) + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE);
+		if (aligned > base)
+			munmap(base, aligned - base);
+		if (aligned + size < base + reserve)
+			munmap(aligned + size, base + reserve - (aligned + size));
+		base = aligned;
+#ifdef MADV_HUGEPAGE
+		madvise(base, size, MADV_HUGEPAGE);
+#endif
+	}
+	return base;
+#endif
+}
+
+void GuestMemory::Release(byte* base, size_t size)
+{
+	if (!base)
+		return;
+#ifdef _WIN32
+	for (int i = 0; i < MAX_RANGES; ++i)
+	{
+		byte* expected = base;
+		if (s_bases[i].compare_exchange_strong(expected, nullptr))
+			break;
+	}
+	VirtualFree(base, 0, MEM_RELEASE);
+#else
+	munmap(base, size);
+#endif
+}
+
+void GuestMemory::Discard(byte* address, size_t size)
+{
+	const size_t page = PageSize();
+	byte* first = reinterpret_cast<byte*>((reinterpret_cast<uintptr_t>(address) + page - 1) / page * page);
+	byte* last = reinterpret_cast<byte*>((reinterpret_cast<uintptr_t>(address) + size) / page * page);
+	if (first >= last)
+	{
+		memset(address, 0, size);
+		return;
+	}
+	// partial pages at either end are cleared by hand
+	memset(address, 0, first - address);
+	memset(last, 0, address + size - last);
+#ifdef _WIN32
+	VirtualFree(first, last - first, MEM_DECOMMIT);
+	// decommitted pages come back zeroed from the exception handler, unless
+	// the range had no slot and was committed up front
+	bool demand = false;
+	for (int i = 0; i < MAX_RANGES && !demand; ++i)
+	{
+		byte* base = s_bases[i].load();
+		demand = base && first >= base && first < base + s_sizes[i].load();
+	}
+	if (!demand)
+		VirtualAlloc(first, last - first, MEM_COMMIT, PAGE_READWRITE);
+#else
+	// private anonymous pages read as zero again after this
+	madvise(first, last - first, MADV_DONTNEED);
+#endif
+}
+
+bool GuestMemory::Commit(const void* address)
+{
+#ifdef _WIN32
+	const byte* a = reinterpret_cast<const byte*>(address);
+	for (int i = 0; i < MAX_RANGES; ++i)
+	{
+		byte* base = s_bases[i].load();
+		const size_t size = s_sizes[i].load();
+		if (!base || a < base || a >= base + size)
+			continue;
+		// a committed page faulting is protected on purpose (guard page,
+		// dirty tracking), not ours to fix
+		MEMORY_BASIC_INFORMATION region;
+		if (!VirtualQuery(a, &region, sizeof(region)) || region.State != MEM_RESERVE)
+			return false;
+		// commit the rest of the chunk without touching what is already
+		// committed, which may be protected
+		const size_t offset = (a - base) / COMMIT_CHUNK * COMMIT_CHUNK;
+		byte* p = base + offset;
+		byte* end = base + (size - offset < COMMIT_CHUNK ? size : offset + COMMIT_CHUNK);
+		while (p < end && VirtualQuery(p, &region, sizeof(region)))
+		{
+			byte* next = reinterpret_cast<byte*>(region.BaseAddress) + region.RegionSize;
+			const size_t n = (next < end ? next : end) - p;
+			if (region.State == MEM_RESERVE && !VirtualAlloc(p, n, MEM_COMMIT, PAGE_READWRITE))
+				return false;
+			p += n;
+		}
+		return true;
+	}
+	return false;
+#else
+	(void)address;
+	return false;
+#endif
+}
+
+size_t GuestMemory::PageSize()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+u32 GuestMemory::Guard(byte* address, size_t length)
+{
+#ifdef _WIN32
+	MEMORY_BASIC_INFORMATION region;
+	if (!VirtualQuery(address, &region, sizeof(region)))
+		return 0;
+	// reserved pages have to be committed to be protected; commit them
+	// inaccessible, and writable once unguarded
+	if (region.State == MEM_RESERVE)
+		return VirtualAlloc(address, length, MEM_COMMIT, PAGE_NOACCESS) ? PAGE_READWRITE : 0;
+	DWORD old;
+	return VirtualProtect(address, length, PAGE_NOACCESS, &old) ? old : 0;
+#else
+	if (mprotect(address, length, PROT_NONE) != 0)
+		return 0;
+	return PROT_READ | PROT_WRITE;
+#endif
+}
+
+void GuestMemory::Unguard(byte* address, size_t length, u32 protection)
+{
+#ifdef _WIN32
+	DWORD old;
+	VirtualProtect(address, length, protection, &old);
+#else
+	mprotect(address, length, protection);
+#endif
+}
+
+#ifdef _WIN32
+// no C++ objects in here, __try does not mix with unwinding
+const void* GuestMemory::RunGuarded(void (*run)(void*), void* arg, const Range* guards, size_t count, FaultHook onFault)
+{
+	const void* fault = nullptr;
+	__try
+	{
+		run(arg);
+	}
+	__except (GuardFilter(GetExceptionInformation(), guards, count, onFault, arg, &fault))
+	{
+	}
+	return fault;
+}
+#else
+const void* GuestMemory::RunGuarded(void (*run)(void*), void* arg, const Range* guards, size_t count, FaultHook onFault)
+{
+	std::call_once(s_installed, InstallHandler);
+	Recovery recovery;
+	recovery.guards = guards;
+	recovery.count = count;
+	recovery.onFault = onFault;
+	recovery.arg = arg;
+	recovery.fault = nullptr;
+	recovery.outer = t_recovery;
+	// saves the signal mask, since we come back out of the handler
+	if (sigsetjmp(recovery.env, 1))
+	{
+		t_recovery = recovery.outer;
+		return recovery.fault;
+	}
+	t_recovery = &recovery;
+	run(arg);
+	t_recovery = recovery.outer;
+	return nullptr;
+}
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "Definitions.h"
+
+/* GUEST MEMORY
+	large guest memories are reserved as one range of address space and only
+	backed by physical memory where the guest touches it, so a guest with
+	gigabytes of memory costs nothing up front and reads as zero until written.
+		linux:		one private anonymous mapping with MAP_NORESERVE, which the
+					kernel already fills in page by page. ranges of at least
+					HUGE_PAGE_MIN are aligned to and advised for transparent
+					huge pages
+		windows:	reserved with VirtualAlloc, then committed COMMIT_CHUNK bytes
+					at a time from a vectored exception handler on first access
+	the guest stack sits at the top, as before (SP = size - 1).
+*/
+/* GUARD PAGES
+	Guard makes pages of any guest memory (reserved, or a VMImage/snapshot
+	view) inaccessible. RunGuarded runs the guest with a recovery point: a
+	fault on one of the guard ranges it was given abandons the run and returns the
+	faulting address, so one guest hitting its guard stops that guest and
+	nothing else. faults anywhere else go on to the other handlers. an
+	onFault hook sees the host registers at the fault first, for state
+	the run kept in them (RegJIT::Recover).
+		linux:		SIGSEGV handler, siglongjmp back to RunGuarded
+		windows:	__try/__except around the run. compiled JIT blocks carry
+					no unwind data, so a guard hit inside one is not caught
+*/
+struct GuestMemory
+{
+public:
+	static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+	// below this, one touched byte committing a whole huge page costs too much
+	static const size_t HUGE_PAGE_MIN = 64 * 1024 * 1024;
+	static const size_t COMMIT_CHUNK = 64 * 1024;
+public:
+	/* zeroed memory, or nullptr if the range cannot be reserved */
+	static byte* Reserve(size_t size);
+	static void Release(byte* base, size_t size);
+	/* zero [address, address + size) of a Reserve range, handing whole
+	   pages back so they cost nothing until touched again. the pages must
+	   not be guarded */
+	static void Discard(byte* address, size_t size);
+	/* windows: commit the pages of a reserved range around address. true if
+	   address belongs to one (used by the fault handlers) */
+	static bool Commit(const void* address);
+	static size_t PageSize();
+	/* make whole pages inaccessible. returns what Unguard needs to make them
+	   accessible again, 0 on failure */
+	static u32 Guard(byte* address, size_t length);
+	static void Unguard(byte* address, size_t length, u32 protection);
+	struct Range
+	{
+		const byte* begin;
+		size_t length;
+	};
+	/* called from the fault handler with the faulting thread's registers:
+	   a ucontext_t on linux, a CONTEXT on windows */
+	typedef void (*FaultHook)(const void* machine, void* arg);
+	/* call run(arg). if it touches one of the count ranges in guards, it is
+	   abandoned there, after onFault(machine, arg) if given, and the faulting
+	   address is returned; nullptr if it returned */
+	static const void* RunGuarded(void (*run)(void*), void* arg, const Range* guards, size_t count, FaultHook onFault = nullptr);
+};
@@ -0,0 +1,127 @@
+#include "ProgramCache.h"
+#include "Bytecode.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	struct Header
+	{
+		byte magic[4];
+		u32 version;
+		ProgramCache::Info info;
+	};
+	const byte MAGIC[4] = { 'V', 'M', 'P', 'C' };
+}
+
+ProgramCache::ProgramCache(const char* dir) : m_dir(dir)
+{
+	// already there is the usual case
+#ifdef _WIN32
+	_mkdir(dir);
+#else
+	mkdir(dir, 0777);
+#endif
+}
+
+std::string ProgramCache::GetDirectory()
+{
+	std::string dir;
+#ifdef _WIN32
+	char* value = nullptr;
+	size_t length = 0;
+	if (_dupenv_s(&value, &length, "VM_CACHE") == 0 && value)
+	{
+		dir = value;
+		free(value);
+	}
+#else
+	if (const char* value = getenv("VM_CACHE"))
+		dir = value;
+#endif
+	return dir;
+}
+
+std::string ProgramCache::Key(const byte* program, size_t size, Kind kind) const
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/%016llx-v%u-%s", Bytecode::Hash(program, size), VERSION,
+		kind == Kind::Translated ? "stack" : "reg");
+	return m_dir + name;
+}
+
+MappedFile* ProgramCache::Find(const std::string& key, size_t sourceSize, Info* info) const
+{
+	Header header;
+	{
+		std::ifstream file(key + ".info", std::ios::binary);
+		if (!file.is_open())
+			return nullptr;
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!file || memcmp(header.magic, MAGIC, 4) != 0 || header.version != VERSION || header.info.sourceSize != sourceSize)
+			return nullptr;
+	}
+	MappedFile* code = new MappedFile((key + ".bin").c_str());
+	if (!code->Valid() || code->Size() != header.info.codeSize
+		|| Bytecode::Hash(code->Data(), code->Size()) != header.info.codeHash)
+	{
+		delete code;
+		return nullptr;
+	}
+	*info = header.info;
+	return code;
+}
+
+bool ProgramCache::Store(const std::string& key, const byte* code, const Info& info) const
+{
+	Info stored = info;
+	stored.codeHash = Bytecode::Hash(code, info.codeSize);
+	return Write(key + ".bin", code, info.codeSize) && Update(key, stored);
+}
+
+bool ProgramCache::Update(const std::string& key, const Info& info) const
+{
+	Header header;
+	memcpy(header.magic, MAGIC, 4);
+	header.version = VERSION;
+	header.info = info;
+	return Write(key + ".info", &header, sizeof(header));
+}
+
+/* whole file or nothing at path */
+bool ProgramCache::Write(const std::string& path, const void* data, size_t size)
+{
+	// one temporary per process, so concurrent writers do not share it
+	const std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(data), size);
+		if (!file.good())
+		{
+			printf("error: could not write cache file [%s]\n", temporary.c_str());
+			return false;
+		}
+	}
+#ifdef _WIN32
+	// windows does not rename over an existing file
+	remove(path.c_str());
+#endif
+	if (rename(temporary.c_str(), path.c_str()) != 0)
+	{
+		printf("error: could not write cache file [%s]\n", path.c_str());
+		remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
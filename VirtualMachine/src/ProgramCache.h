@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+
+#include "Definitions.h"
+#include "MappedFile.h"
+
+/* PROGRAM CACHE
+	a directory of programs already in the form the register vm runs them,
+	so a launch that has seen a program before maps it and starts instead of
+	expanding, translating or verifying it again.
+	entries are content addressed: the key is Bytecode::Hash of the program
+	file as given, VERSION and the Kind of work done on it. each entry is
+		<key>.bin	the v1 code, which RegVM::LoadProgram(const MappedFile&)
+					maps straight into guest memory where the platform allows
+		<key>.info	Info, behind a small header
+	both are written to a temporary file and renamed into place, .info last,
+	so a reader never sees half an entry and concurrent writers of the same
+	key just replace each other. Info records the hash of the .bin it was
+	written with, and Find rejects an entry whose .bin no longer matches, so
+	a replaced or damaged .bin is never run as verified.
+	bump VERSION whenever Expand, TranslateStack or the verifier change what
+	they produce. nothing is evicted; delete the directory to clear it.
+	the decoded stream and JIT blocks point into the process that built them
+	and are not cached, those engines rebuild them from the mapped code.
+*/
+class ProgramCache
+{
+public:
+	static const u32 VERSION = 3;
+	enum class Kind : u8
+	{
+		RegVM,		// v1 as given, or expanded from v2
+		Translated	// StackVM program run through Bytecode::TranslateStack
+	};
+	struct Info
+	{
+		u64 sourceSize = 0;		// checked along with the key, against collisions
+		u64 codeSize = 0;
+		u64 rowOffset = 0;		// Translated: where the COLUMN row starts
+		u64 verifiedMemory = 0;	// guest memory size it passed RegVM verification with, 0 if not
+		u64 codeHash = 0;		// Bytecode::Hash of the code, set by Store
+	};
+private:
+	std::string m_dir;
+public:
+	/* creates the directory if it is missing */
+	explicit ProgramCache(const char* dir);
+	/* the directory named by VM_CACHE, or empty if it is not set */
+	static std::string GetDirectory();
+	/* path of the entry for a program, without extension */
+	std::string Key(const byte* program, size_t size, Kind kind) const;
+	/* the cached code, or nullptr if there is no complete entry for a
+	   program of sourceSize bytes or its code does not hash to what was
+	   stored. the caller deletes it */
+	MappedFile* Find(const std::string& key, size_t sourceSize, Info* info) const;
+	/* add or replace an entry, info.codeSize bytes of code */
+	bool Store(const std::string& key, const byte* code, const Info& info) const;
+	/* replace only the Info of an entry, e.g. once it has been verified */
+	bool Update(const std::string& key, const Info& info) const;
+private:
+	static bool Write(const std::string& path, const void* data, size_t size);
+};
@@ -0,0 +1,502 @@
+#include "RegAOT.h"
+
+#include <cstdarg>
+#include <map>
+#include <set>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+namespace
+{
+	using reg = RegVM::reg;
+	using op = RegVM::op;
+
+	const u64 NO_TARGET = ~(u64)0;
+
+	/* what RegVM does with one instruction, as far as the emitter cares */
+	struct Insn
+	{
+		byte opcode = 0;
+		u64 size = 1;				// as RegVM steps over it
+		u64 a[Bytecode::MAX_OPERANDS] = {};
+		bool stop = false;			// left to the interpreter
+		bool falls = true;			// may carry on at the next instruction
+		u64 target = NO_TARGET;		// jump, branch or call target
+	};
+
+	bool IsJump(byte opcode)
+	{
+		return opcode >= op::JMP && opcode <= op::JLE;
+	}
+
+	bool IsBranch(byte opcode)
+	{
+		return opcode >= op::CJE && opcode <= op::CJLEI;
+	}
+
+	Insn Decode(const byte* program, size_t size, u64 address)
+	{
+		Insn in;
+		in.opcode = program[address];
+		// POPTO has no handler, RegVM runs it as a 1 byte NOP
+		in.size = in.opcode == op::POPTO ? 1 : Bytecode::GetSizeV1(in.opcode);
+		if (address + in.size > size)
+		{
+			in.stop = true;
+			return in;
+		}
+		const Bytecode::Operand* operands = Bytecode::GetOperands(in.opcode);
+		for (int i = 0; i < Bytecode::MAX_OPERANDS; ++i)
+		{
+			if (operands[i] == Bytecode::NONE) continue;
+			in.a[i] = AsType<u64>(program[address + 1 + 8 * i]);
+			// IP as an operand is a computed jump or reads where we are
+			if (operands[i] == Bytecode::REG && (in.a[i] >= reg::REG_END || in.a[i] == reg::IP))
+				in.stop = true;
+		}
+		switch (in.opcode)
+		{
+		case op::HALT:
+			in.stop = true;
+			in.falls = false;
+			break;
+		case op::INT: case op::POPTO:
+			in.stop = true;
+			break;
+		case op::JMP:
+			in.target = in.a[0];
+			in.falls = false;
+			break;
+		case op::CALLI:
+			in.target = in.a[0];
+			break;
+		case op::RET:
+			in.falls = false;
+			break;
+		default:
+			if (IsJump(in.opcode))
+				in.target = in.a[0];
+			else if (IsBranch(in.opcode))
+				in.target = in.a[2];
+			else if (in.opcode >= op::OPCODE_END)
+				in.stop = true;
+			break;
+		}
+		if (in.stop)
+			in.target = NO_TARGET;
+		return in;
+	}
+
+	/* one C function: a call target and every instruction it reaches
+	   without calling or returning */
+	struct Function
+	{
+		u64 entry;
+		std::map<u64, Insn> code;
+		std::set<u64> labels;
+	};
+
+	void Append(std::string* out, const char* format, ...)
+	{
+		va_list args, copy;
+		va_start(args, format);
+		va_copy(copy, args);
+		const int length = vsnprintf(nullptr, 0, format, copy);
+		va_end(copy);
+		const size_t at = out->size();
+		out->resize(at + length + 1);
+		vsnprintf(&(*out)[at], length + 1, format, args);
+		va_end(args);
+		out->resize(at + length);
+	}
+
+	class Emitter
+	{
+	private:
+		const byte* m_program;
+		size_t m_size;
+		std::map<u64, Function> m_functions;
+		std::string* m_out;
+	public:
+		Emitter(const byte* program, size_t size, std::string* out) : m_program(program), m_size(size), m_out(out) {}
+
+		bool Run()
+		{
+			std::vector<u64> pending = { 0 };
+			while (!pending.empty())
+			{
+				const u64 entry = pending.back();
+				pending.pop_back();
+				if (entry >= m_size || m_functions.count(entry))
+					continue;
+				Function& f = m_functions[entry];
+				f.entry = entry;
+				Trace(&f, &pending);
+			}
+			if (m_functions.empty())
+				return false;
+			Header();
+			for (auto& f : m_functions)
+				Append(m_out, "static uint64_t proc_%llu(int64_t* RESTRICT R, uint8_t* RESTRICT mem, uint64_t entry, int depth);\n", f.first);
+			for (auto& f : m_functions)
+				Body(f.second);
+			Enter();
+			return true;
+		}
+	private:
+		void Trace(Function* f, std::vector<u64>* calls)
+		{
+			std::vector<u64> work = { f->entry };
+			f->labels.insert(f->entry);
+			while (!work.empty())
+			{
+				const u64 address = work.back();
+				work.pop_back();
+				if (address >= m_size || f->code.count(address))
+					continue;
+				const Insn in = Decode(m_program, m_size, address);
+				f->code[address] = in;
+				const u64 next = address + in.size;
+				if (in.opcode == op::CALLI && !in.stop)
+					calls->push_back(in.target);
+				else if (in.target != NO_TARGET && in.target < m_size)
+				{
+					f->labels.insert(in.target);
+					work.push_back(in.target);
+				}
+				if (!in.falls || next >= m_size)
+					continue;
+				// after a call, or anything left to the interpreter, the
+				// engine comes back in at the next instruction
+				if (Reenters(in))
+					f->labels.insert(next);
+				work.push_back(next);
+			}
+			// plain fallthrough into something not emitted right after
+			for (auto it = f->code.begin(); it != f->code.end(); ++it)
+			{
+				const u64 next = it->first + it->second.size;
+				auto after = std::next(it);
+				if (FallsThrough(it->second) && next < m_size && (after == f->code.end() || after->first != next))
+					f->labels.insert(next);
+			}
+		}
+
+		static bool Reenters(const Insn& in)
+		{
+			return in.stop || in.opcode == op::CALLI || in.opcode == op::CALLR;
+		}
+
+		/* carries on at the next instruction within the emitted code */
+		static bool FallsThrough(const Insn& in)
+		{
+			return in.falls && !Reenters(in);
+		}
+
+		void Header()
+		{
+			Append(m_out,
+				"/* generated by RegAOT from a %zu byte RegVM program, see RegAOT.h */\n"
+				"#include <stdint.h>\n"
+				"#include <string.h>\n\n"
+				"#ifdef _WIN32\n"
+				"#define EXPORT __declspec(dllexport)\n"
+				"#else\n"
+				"#define EXPORT __attribute__((visibility(\"default\")))\n"
+				"#endif\n"
+				"#ifdef _MSC_VER\n"
+				"#define RESTRICT __restrict\n"
+				"#else\n"
+				"#define RESTRICT restrict\n"
+				"#endif\n"
+				"#ifdef _MSC_VER\n"
+				"#include <intrin.h>\n"
+				"#define BARRIER() _ReadWriteBarrier()\n"
+				"#else\n"
+				"#define BARRIER() __asm__ __volatile__(\"\" ::: \"memory\")\n"
+				"#endif\n\n", m_size);
+			Append(m_out,
+				"/* registers, in the order of RegVM::Regcode */\n"
+				"enum { IP = %d, SP = %d, F = %d };\n"
+				"/* zero/sign flags into R[F], like MaterialiseFlags */\n"
+				"#define FLAGS() do { if (fpend) { R[F] = (R[F] & ~(int64_t)3) | (fres == 0) | ((int64_t)(fres < 0) << 1); fpend = 0; } } while (0)\n"
+				"#define SETF(v) (fres = (v), fpend = 1)\n"
+				"#define ZF (fpend ? fres == 0 : (R[F] & 1) != 0)\n"
+				"#define SF (fpend ? fres < 0 : (R[F] & 2) != 0)\n"
+				"#define GET(addr, dst) memcpy(&(dst), mem + (uint64_t)(addr), 8)\n"
+				"#define PUT(addr, src) do { int64_t v_ = (src); memcpy(mem + (uint64_t)(addr), &v_, 8); } while (0)\n"
+				"#define WRAP(a, o, b) ((int64_t)((uint64_t)(a) o (uint64_t)(b)))\n"
+				"/* IP, SP and the flags in R before a guest memory access, so a guard page hit leaves R where the guest stopped */\n"
+				"#define AT(addr) do { R[IP] = (int64_t)(addr); FLAGS(); BARRIER(); } while (0)\n\n",
+				(int)reg::IP, (int)reg::SP, (int)reg::F);
+			Append(m_out, "EXPORT const uint32_t rvm_aot_version = %u;\n", RegAOT::VERSION);
+			Append(m_out, "EXPORT const uint64_t rvm_aot_size = %zuULL;\n", m_size);
+			Append(m_out, "EXPORT const uint64_t rvm_aot_hash = 0x%016llxULL;\n\n", Bytecode::Hash(m_program, m_size));
+		}
+
+		/* control to address: a label here, or back to the engine */
+		void Go(const Function& f, u64 address)
+		{
+			if (f.labels.count(address))
+				Append(m_out, "goto L%llu;", address);
+			else
+				Append(m_out, "{ next = %lluULL; goto out; }", address);
+		}
+
+		void Body(const Function& f)
+		{
+			Append(m_out, "static uint64_t proc_%llu(int64_t* RESTRICT R, uint8_t* RESTRICT mem, uint64_t entry, int depth)\n{\n", f.entry);
+			Append(m_out,
+				"\tint64_t fres = 0;\n"
+				"\tint fpend = 0;\n"
+				"\tuint64_t next;\n"
+				"\t(void)depth;\n"
+				"\tswitch (entry)\n\t{\n");
+			for (u64 label : f.labels)
+				Append(m_out, "\tcase %lluULL: goto L%llu;\n", label, label);
+			Append(m_out, "\tdefault: return entry;\n\t}\n");
+			for (auto it = f.code.begin(); it != f.code.end(); ++it)
+			{
+				const u64 address = it->first;
+				const Insn& in = it->second;
+				if (f.labels.count(address))
+					Append(m_out, "L%llu:\n", address);
+				Instruction(f, address, in);
+				// fell off the end of the code, or into the gap before a label
+				auto next = std::next(it);
+				const u64 fall = address + in.size;
+				if (FallsThrough(in) && (next == f.code.end() || next->first != fall))
+				{
+					Append(m_out, "\t");
+					Go(f, fall);
+					Append(m_out, "\n");
+				}
+			}
+			Append(m_out,
+				"out:\n"
+				"\tFLAGS();\n"
+				"\treturn next;\n"
+				"}\n\n");
+		}
+
+		void Instruction(const Function& f, u64 address, const Insn& in)
+		{
+			const u64* a = in.a;
+			const i64 imm = static_cast<i64>(a[1]);
+			if (in.stop)
+			{
+				Append(m_out, "\tnext = %lluULL; goto out;\t/* interpreted */\n", address);
+				return;
+			}
+			// an instruction naming F sees and replaces the whole register
+			const Bytecode::Operand* operands = Bytecode::GetOperands(in.opcode);
+			for (int i = 0; i < Bytecode::MAX_OPERANDS; ++i)
+			{
+				if (operands[i] == Bytecode::REG && a[i] == reg::F)
+				{
+					Append(m_out, "\tFLAGS();\n");
+					break;
+				}
+			}
+			Append(m_out, "\t");
+			switch (in.opcode)
+			{
+			case op::NOP:	Append(m_out, ";"); break;
+			case op::CLF:	Append(m_out, "R[F] = 0; fpend = 0;"); break;
+			case op::MOVI:	Append(m_out, "R[%llu] = %lldLL;", a[0], imm); break;
+			case op::MOVF:	Append(m_out, "AT(%lluULL); GET(%lluULL, R[%llu]);", address, a[1], a[0]); break;
+			case op::MOVT:	Append(m_out, "AT(%lluULL); PUT(%lluULL, R[%llu]);", address, a[0], a[1]); break;
+			case op::MOV:	Append(m_out, "R[%llu] = R[%llu];", a[0], a[1]); break;
+			case op::PUSH:	Append(m_out, "R[SP] -= 8; AT(%lluULL); PUT(R[SP], R[%llu]);", address, a[0]); break;
+			case op::PUSHI:	Append(m_out, "R[SP] -= 8; AT(%lluULL); PUT(R[SP], %lldLL);", address, static_cast<i64>(a[0])); break;
+			case op::POP:	Append(m_out, "AT(%lluULL); GET(R[SP], R[%llu]); R[SP] += 8;", address, a[0]); break;
+			case op::PUSHF:	Append(m_out, "FLAGS(); R[SP] -= 8; AT(%lluULL); PUT(R[SP], R[F]);", address); break;
+			case op::POPF:	Append(m_out, "AT(%lluULL); GET(R[SP], R[F]); fpend = 0; R[SP] += 8;", address); break;
+			case op::ADD:	Append(m_out, "R[%llu] = WRAP(R[%llu], +, R[%llu]); SETF(R[%llu]);", a[0], a[0], a[1], a[0]); break;
+			case op::SUB:	Append(m_out, "R[%llu] = WRAP(R[%llu], -, R[%llu]); SETF(R[%llu]);", a[0], a[0], a[1], a[0]); break;
+			case op::MUL:	Append(m_out, "R[%llu] = WRAP(R[%llu], *, R[%llu]); SETF(R[%llu]);", a[0], a[0], a[1], a[0]); break;
+			case op::DIV:	Append(m_out, "R[%llu] = R[%llu] / R[%llu]; SETF(R[%llu]);", a[0], a[0], a[1], a[0]); break;
+			case op::MOD:	Append(m_out, "R[%llu] = R[%llu] %% R[%llu]; SETF(R[%llu]);", a[0], a[0], a[1], a[0]); break;
+			case op::CMP:	Append(m_out, "SETF(WRAP(R[%llu], -, R[%llu]));", a[0], a[1]); break;
+			case op::INC:	Append(m_out, "R[%llu] = WRAP(R[%llu], +, 1); SETF(R[%llu]);", a[0], a[0], a[0]); break;
+			case op::DEC:	Append(m_out, "R[%llu] = WRAP(R[%llu], -, 1); SETF(R[%llu]);", a[0], a[0], a[0]); break;
+			case op::AND:	Append(m_out, "R[%llu] &= R[%llu]; SETF(R[%llu]);", a[0], a[1], a[0]); break;
+			case op::OR:	Append(m_out, "R[%llu] |= R[%llu]; SETF(R[%llu]);", a[0], a[1], a[0]); break;
+			case op::XOR:	Append(m_out, "R[%llu] ^= R[%llu]; SETF(R[%llu]);", a[0], a[1], a[0]); break;
+			case op::NOT:	Append(m_out, "R[%llu] = ~R[%llu]; SETF(R[%llu]);", a[0], a[0], a[0]); break;
+			// counts past 63 wrap, as the host shift in OpImpl does
+			case op::SHR:	Append(m_out, "R[%llu] = R[%llu] >> %llu; SETF(R[%llu]);", a[0], a[0], a[1] & 63, a[0]); break;
+			case op::SHL:	Append(m_out, "R[%llu] = WRAP(R[%llu], <<, %llu); SETF(R[%llu]);", a[0], a[0], a[1] & 63, a[0]); break;
+			case op::ADDI:	Append(m_out, "R[%llu] = WRAP(R[%llu], +, %lldLL); SETF(R[%llu]);", a[0], a[0], imm, a[0]); break;
+			case op::SUBI:	Append(m_out, "R[%llu] = WRAP(R[%llu], -, %lldLL); SETF(R[%llu]);", a[0], a[0], imm, a[0]); break;
+			case op::ANDI:	Append(m_out, "R[%llu] &= %lldLL; SETF(R[%llu]);", a[0], imm, a[0]); break;
+			case op::CMPI:	Append(m_out, "SETF(WRAP(R[%llu], -, %lldLL));", a[0], imm); break;
+			case op::CALLI:
+				// the return address pushed is the last byte of the call
+				Append(m_out, "R[SP] -= 8; AT(%lluULL); PUT(R[SP], %lluULL);\n", address, address + 8);
+				if (in.target < m_size)
+				{
+					Append(m_out,
+						"\tif (depth >= %d) { next = %lluULL; goto out; }\n"
+						"\tFLAGS();\n"
+						"\tnext = proc_%llu(R, mem, %lluULL, depth + 1);\n"
+						"\tif (next != %lluULL) return next;\n\t",
+						RegAOT::MAX_DEPTH, in.target, in.target, in.target, address + in.size);
+					Go(f, address + in.size);
+				}
+				else
+					Append(m_out, "\tnext = %lluULL; goto out;", in.target);
+				break;
+			case op::CALLR:
+				Append(m_out, "next = (uint64_t)R[%llu]; R[SP] -= 8; AT(%lluULL); PUT(R[SP], %lluULL); goto out;", a[0], address, address + 8);
+				break;
+			case op::RET:
+				Append(m_out, "AT(%lluULL); GET(R[SP], next); R[SP] += 8; next += 1; goto out;", address);
+				break;
+			case op::JMP:
+				Go(f, in.target);
+				break;
+			default:
+			{
+				if (IsBranch(in.opcode))
+				{
+					static const char* const tests[] = { "== 0", "!= 0", "> 0", "< 0", ">= 0", "<= 0" };
+					const int test = (in.opcode - op::CJE) % 6;
+					if (in.opcode >= op::CJEI)
+						Append(m_out, "SETF(WRAP(R[%llu], -, %lldLL)); if (fres %s) ", a[0], imm, tests[test]);
+					else
+						Append(m_out, "SETF(WRAP(R[%llu], -, R[%llu])); if (fres %s) ", a[0], a[1], tests[test]);
+				}
+				else
+				{
+					// the flag tests of OpImpl::_jz and friends
+					const char* test = "";
+					switch (in.opcode)
+					{
+					case op::JE: case op::JZ:	test = "ZF"; break;
+					case op::JNE: case op::JNZ:	test = "!ZF"; break;
+					case op::JGT:				test = "!ZF && !SF"; break;
+					case op::JLT:				test = "!ZF && SF"; break;
+					case op::JGE:				test = "ZF || !SF"; break;
+					case op::JLE:				test = "ZF || SF"; break;
+					}
+					Append(m_out, "if (%s) ", test);
+				}
+				Go(f, in.target);
+				break;
+			}
+			}
+			Append(m_out, "\t/* %llu */\n", address);
+		}
+
+		/* entry point: the first function with a label for ip */
+		void Enter()
+		{
+			Append(m_out, "EXPORT uint64_t rvm_aot_enter(int64_t* r, uint8_t* mem, uint64_t ip)\n{\n\tswitch (ip)\n\t{\n");
+			std::set<u64> seen;
+			for (auto& f : m_functions)
+				for (u64 label : f.second.labels)
+					if (seen.insert(label).second)
+						Append(m_out, "\tcase %lluULL: return proc_%llu(r, mem, ip, 0);\n", label, f.first);
+			Append(m_out, "\tdefault: return ip;\n\t}\n}\n");
+		}
+	};
+}
+
+RegAOT::~RegAOT()
+{
+	Unload();
+}
+
+void RegAOT::Unload()
+{
+	if (!m_module)
+		return;
+#ifdef _WIN32
+	FreeLibrary(reinterpret_cast<HMODULE>(m_module));
+#else
+	dlclose(m_module);
+#endif
+	m_module = nullptr;
+	m_enter = nullptr;
+}
+
+bool RegAOT::Emit(const byte* program, size_t size, std::string* out)
+{
+	out->clear();
+	return Emitter(program, size, out).Run();
+}
+
+bool RegAOT::Load(const char* path)
+{
+#ifdef _WIN32
+	HMODULE module = LoadLibraryA(path);
+	auto symbol = [module](const char* name) { return reinterpret_cast<void*>(GetProcAddress(module, name)); };
+#else
+	void* module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	auto symbol = [module](const char* name) { return dlsym(module, name); };
+#endif
+	if (!module)
+	{
+		printf("error: could not load native code [%s]\n", path);
+		return false;
+	}
+	const u32* version = reinterpret_cast<const u32*>(symbol("rvm_aot_version"));
+	const u64* size = reinterpret_cast<const u64*>(symbol("rvm_aot_size"));
+	const u64* hash = reinterpret_cast<const u64*>(symbol("rvm_aot_hash"));
+	enterFn enter = reinterpret_cast<enterFn>(symbol("rvm_aot_enter"));
+	if (!version || !size || !hash || !enter || *version != VERSION)
+	{
+		printf("error: [%s] is not native code from this version of RegAOT\n", path);
+#ifdef _WIN32
+		FreeLibrary(module);
+#else
+		dlclose(module);
+#endif
+		return false;
+	}
+	Unload();
+	m_module = module;
+	m_enter = enter;
+	m_size = *size;
+	m_hash = *hash;
+	return true;
+}
+
+bool RegAOT::Matches(const byte* program, size_t size) const
+{
+	return m_enter && size == m_size && Bytecode::Hash(program, size) == m_hash;
+}
+
+bool RegVM::LoadNative(const char* path)
+{
+	if (!m_native)
+		m_native = new RegAOT();
+	return m_native->Load(path);
+}
+
+void RegVM::RunNative()
+{
+	m_context.running = true;
+	u64 ip = m_context.r[reg::IP] + 1;
+	while (m_context.running)
+	{
+		// native code expects r[F] to be current and leaves it that way
+		MaterialiseFlags(&m_context);
+		const u64 next = m_native->Enter(m_context.r, m_context.mem, ip);
+		if (next != ip)
+		{
+			ip = next;
+			continue;
+		}
+		// interpret one instruction
+		m_context.r[reg::IP] = ip;
+		m_opTable[m_context.mem[ip]](&m_context);
+		ip = m_context.r[reg::IP] + 1;
+	}
+}
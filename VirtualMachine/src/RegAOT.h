@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+
+#include "RegVM.h"
+
+/* AHEAD OF TIME COMPILATION
+	Emit writes a v1 RegVM program out as one C translation unit, to be
+	built with the host compiler into a shared object:
+		linux:		cc -O2 -shared -fPIC prog.bin.c -o prog.so
+		windows:	cl /O2 /LD prog.bin.c
+	which RegVM::LoadNative loads for the Native engine.
+
+	every call target (and address 0) becomes a C function, and every jump
+	target and call continuation a label in it. functions work on
+	Context::r through a restrict pointer, so the compiler is free to keep
+	guest registers in host registers and to inline calls, except that
+	everything is written back before every guest memory access, behind a
+	compiler barrier, for a guard page hit to stop the guest exactly there.
+	zero/sign flags are evaluated lazily in locals, the same way as
+	Context::flagResult, and materialised at those points too.
+	calls are C calls while the return address on the guest stack is the
+	one pushed, up to MAX_DEPTH deep; past that, or for CALLR and RET, the
+	function returns the next guest address and the engine enters again
+	there. like the JIT, the generated code stops before INT, HALT, anything
+	naming IP as an operand and opcodes it does not know, and RegVM::RunNative
+	runs those through m_opTable.
+	the shared object records the size and Bytecode::Hash of the program it was
+	made from; a program that does not match runs on the threaded engine.
+	it assumes the program does not overwrite its own code.
+*/
+class RegAOT
+{
+public:
+	typedef u64(*enterFn)(i64* r, byte* mem, u64 ip);
+	static const u32 VERSION = 3;
+	static const int MAX_DEPTH = 64;
+private:
+	void* m_module = nullptr;	// HMODULE or dlopen handle
+	enterFn m_enter = nullptr;
+	u64 m_size = 0;
+	u64 m_hash = 0;
+public:
+	RegAOT() = default;
+	~RegAOT();
+	RegAOT(const RegAOT&) = delete;
+	RegAOT& operator=(const RegAOT&) = delete;
+	/* C source for a v1 program. false if there is nothing to compile */
+	static bool Emit(const byte* program, size_t size, std::string* out);
+	/* false if the shared object cannot be loaded or was not made by Emit */
+	bool Load(const char* path);
+	bool Matches(const byte* program, size_t size) const;
+	/* runs native code from ip for as long as it can, materialising the
+	   flags into r[F] before it returns. returns the next guest address,
+	   ip itself if there is no native code for it */
+	u64 Enter(i64* r, byte* mem, u64 ip) const { return m_enter(r, mem, ip); }
+private:
+	void Unload();
+};
@@ -0,0 +1,686 @@
+#include "RegJIT.h"
+#include "GuestMemory.h"
+
+#include <chrono>
+#include <cstddef>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define REGJIT_X64
+#endif
+
+namespace
+{
+	using reg = RegVM::reg;
+	using op = RegVM::op;
+
+	/* longest block, in guest instructions */
+	const size_t MAX_BLOCK = 256;
+
+	enum HostReg
+	{
+		RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+		R8, R9, R10, R11, R12, R13, R14, R15
+	};
+
+	/* just enough of an x86-64 assembler for the block compiler */
+	class X64
+	{
+	private:
+		std::vector<byte>& m_out;
+	public:
+		X64(std::vector<byte>& out) : m_out(out) {}
+
+		void Byte(byte b) { m_out.push_back(b); }
+		void Bytes(std::initializer_list<byte> bytes) { for (byte b : bytes) Byte(b); }
+		void Imm32(u32 v) { for (int i = 0; i < 4; ++i) Byte((v >> (8 * i)) & 0xff); }
+		void Imm64(u64 v) { for (int i = 0; i < 8; ++i) Byte((v >> (8 * i)) & 0xff); }
+
+		void Rex(bool w, int r, int x, int b)
+		{
+			byte rex = 0x40 | (w << 3) | (((r >> 3) & 1) << 2) | (((x >> 3) & 1) << 1) | ((b >> 3) & 1);
+			if (rex != 0x40) Byte(rex);
+		}
+
+		/* opcode with a [base + disp32] operand. r is a register or /digit */
+		void Mem(std::initializer_list<byte> opcode, bool w, int r, int base, i32 disp)
+		{
+			Rex(w, r, 0, base);
+			Bytes(opcode);
+			Byte(0x80 | ((r & 7) << 3) | (base & 7));
+			if ((base & 7) == RSP) Byte(0x24);
+			Imm32(disp);
+		}
+
+		/* opcode with a [base + index] operand */
+		void MemIndex(std::initializer_list<byte> opcode, bool w, int r, int base, int index)
+		{
+			Rex(w, r, index, base);
+			Bytes(opcode);
+			Byte(0x44 | ((r & 7) << 3));
+			Byte(((index & 7) << 3) | (base & 7));
+			Byte(0);
+		}
+
+		/* opcode with a register operand. r is a register or /digit */
+		void RegReg(std::initializer_list<byte> opcode, bool w, int r, int rm)
+		{
+			Rex(w, r, 0, rm);
+			Bytes(opcode);
+			Byte(0xc0 | ((r & 7) << 3) | (rm & 7));
+		}
+
+		void MovImm64(int r, u64 imm)
+		{
+			Rex(true, 0, 0, r);
+			Byte(0xb8 + (r & 7));
+			Imm64(imm);
+		}
+
+		void Load(int r, int base, i32 disp) { Mem({ 0x8b }, true, r, base, disp); }
+		void Store(int base, i32 disp, int r) { Mem({ 0x89 }, true, r, base, disp); }
+		void Mov(int dst, int src) { RegReg({ 0x89 }, true, src, dst); }
+
+		void Prologue()
+		{
+			for (int r : s_saved)
+				Push(r);
+#ifdef _WIN32
+			Mov(RBX, RCX);
+#else
+			Mov(RBX, RDI);
+#endif
+			Load(R13, RBX, offsetof(RegVM::Context, mem));
+		}
+
+		void Epilogue()
+		{
+			for (int i = sizeof(s_saved) / sizeof(s_saved[0]) - 1; i >= 0; --i)
+				Pop(s_saved[i]);
+			Byte(0xc3);					// ret
+		}
+
+		void Push(int r) { Rex(false, 0, 0, r); Byte(0x50 + (r & 7)); }
+		void Pop(int r) { Rex(false, 0, 0, r); Byte(0x58 + (r & 7)); }
+	private:
+		/* callee-saved on either ABI, or used as a guest register home */
+		static const int s_saved[8];
+	};
+	const int X64::s_saved[8] = { RBX, RBP, RSI, RDI, R12, R13, R14, R15 };
+
+	/* host registers
+		rbx		Context*
+		r13		guest memory
+		r12		last flag-setting result (see materialise)
+		rax, rcx, rdx	scratch
+		the rest hold guest registers for the length of a block */
+	inline int Home(u64 regcode)
+	{
+		// r0-r6
+		static const int gprs[] = { R8, R9, R10, R11, R14, R15, RBP };
+		if (regcode == reg::SP) return RSI;
+		if (regcode == reg::F) return RDI;
+		for (u64 n = 0; n < sizeof(gprs) / sizeof(gprs[0]); ++n)
+			if (regcode == VMs::Reg::GetGPR(n)) return gprs[n];
+		return -1;
+	}
+
+	/* Context layout */
+	inline i32 R(u64 regcode) { return static_cast<i32>(offsetof(RegVM::Context, r) + 8 * regcode); }
+
+	/* register operands the block compiler can handle */
+	inline bool Compilable(u64 regcode) { return regcode < reg::REG_END && regcode != reg::IP; }
+
+	/* bit n of the mask is set if the jump is taken when (F & 3) == n
+	   (bit 0 of F is zero, bit 1 is sign) */
+	inline u32 ConditionMask(byte opcode)
+	{
+		switch (opcode)
+		{
+		case op::JZ: case op::JE:	return 0xa;	// zero
+		case op::JNZ: case op::JNE:	return 0x5;	// !zero
+		case op::JGE:				return 0xb;	// zero || !sign
+		case op::JLE:				return 0xe;	// zero || sign
+		case op::JGT:				return 0x1;	// !zero && !sign
+		case op::JLT:				return 0x4;	// !zero && sign
+		default:					return 0xf;
+		}
+	}
+
+	/* the conditional jump a compare-and-branch opcode ends with */
+	inline byte BranchJump(byte opcode)
+	{
+		switch (opcode)
+		{
+		case op::CJE: case op::CJEI:	return op::JE;
+		case op::CJNE: case op::CJNEI:	return op::JNE;
+		case op::CJGT: case op::CJGTI:	return op::JGT;
+		case op::CJLT: case op::CJLTI:	return op::JLT;
+		case op::CJGE: case op::CJGEI:	return op::JGE;
+		case op::CJLE: case op::CJLEI:	return op::JLE;
+		default:						return op::JMP;
+		}
+	}
+}
+
+RegJIT::RegJIT(const size_t* opSizeTable, size_t cacheSize) : m_sizeTable(opSizeTable)
+{
+#if defined(REGJIT_X64)
+	// never writable and executable at once, see Protect
+#ifdef _WIN32
+	m_code = reinterpret_cast<byte*>(VirtualAlloc(nullptr, cacheSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+#else
+	void* p = mmap(nullptr, cacheSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	m_code = p == MAP_FAILED ? nullptr : reinterpret_cast<byte*>(p);
+#endif
+	if (m_code)
+		m_capacity = cacheSize;
+#endif
+}
+
+RegJIT::~RegJIT()
+{
+	if (!m_code) return;
+#ifdef _WIN32
+	VirtualFree(m_code, 0, MEM_RELEASE);
+#else
+	munmap(m_code, m_capacity);
+#endif
+}
+
+bool RegJIT::Supported()
+{
+#if defined(REGJIT_X64)
+	return true;
+#else
+	return false;
+#endif
+}
+
+void RegJIT::Recover(RegVM::Context* c, const void* machine) const
+{
+#if defined(REGJIT_X64)
+#ifdef _WIN32
+	// Rax to R15 are laid out in HostReg order
+	const CONTEXT* host = static_cast<const CONTEXT*>(machine);
+	const u64 rip = host->Rip;
+	auto hostReg = [&](int r) { return static_cast<i64>((&host->Rax)[r]); };
+#else
+	static const int slots[] = {
+		REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+		REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+	};
+	const greg_t* gregs = static_cast<const ucontext_t*>(machine)->uc_mcontext.gregs;
+	const u64 rip = static_cast<u64>(gregs[REG_RIP]);
+	auto hostReg = [&](int r) { return static_cast<i64>(gregs[slots[r]]); };
+#endif
+	if (rip < reinterpret_cast<u64>(m_code) || rip >= reinterpret_cast<u64>(m_code + m_used))
+		return;
+	for (u64 g = 0; g < reg::REG_END; ++g)
+		if (Home(g) >= 0)
+			c->r[g] = hostReg(Home(g));
+#else
+	(void)c;
+	(void)machine;
+#endif
+}
+
+RegJIT::blockFn RegJIT::GetBlock(const RegVM::Context* c, u64 address)
+{
+	auto it = m_blocks.find(address);
+	if (it != m_blocks.end())
+		return it->second;
+	auto start = std::chrono::high_resolution_clock::now();
+	blockFn fn = Compile(c, address);
+	auto end = std::chrono::high_resolution_clock::now();
+	m_stats.compileSeconds += std::chrono::duration<double>(end - start).count();
+	m_blocks[address] = fn;
+	return fn;
+}
+
+void RegJIT::Protect(size_t begin, size_t end, bool writable)
+{
+	const size_t page = GuestMemory::PageSize();
+	begin -= begin % page;
+	end = (end + page - 1) / page * page;
+	if (end > m_capacity)
+		end = m_capacity;
+#ifdef _WIN32
+	DWORD old;
+	VirtualProtect(m_code + begin, end - begin, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old);
+#else
+	mprotect(m_code + begin, end - begin, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+#endif
+}
+
+void RegJIT::Flush()
+{
+	m_blocks.clear();
+	m_used = 0;
+	m_stats.codeBytes = 0;
+	m_stats.flushes++;
+}
+
+RegJIT::blockFn RegJIT::Compile(const RegVM::Context* c, u64 address)
+{
+	if (!m_code) return nullptr;
+
+	const byte* mem = c->mem;
+	std::vector<byte> code;
+	X64 x(code);
+
+	/* guest register access, through its home register if it has one */
+	auto loadG = [&](int dst, u64 g)
+	{
+		if (Home(g) >= 0) x.Mov(dst, Home(g));
+		else x.Load(dst, RBX, R(g));
+	};
+	auto storeG = [&](u64 g, int src)
+	{
+		if (Home(g) >= 0) x.Mov(Home(g), src);
+		else x.Store(RBX, R(g), src);
+	};
+	auto opG = [&](std::initializer_list<byte> opcode, int dst, u64 g)
+	{
+		if (Home(g) >= 0) x.RegReg(opcode, true, dst, Home(g));
+		else x.Mem(opcode, true, dst, RBX, R(g));
+	};
+	auto enterHomes = [&]()
+	{
+		for (u64 g = 0; g < reg::REG_END; ++g)
+			if (Home(g) >= 0) x.Load(Home(g), RBX, R(g));
+	};
+	auto leaveHomes = [&]()
+	{
+		for (u64 g = 0; g < reg::REG_END; ++g)
+			if (Home(g) >= 0) x.Store(RBX, R(g), Home(g));
+	};
+
+	x.Prologue();
+	enterHomes();
+	// blocks that jump back to their own start loop here
+	const size_t loop = code.size();
+
+	/* the last flag-setting result lives in r12 until it has to be
+	   merged into F */
+	bool pending = false;
+	auto materialise = [&]()
+	{
+		if (!pending) return;
+		x.Bytes({ 0x31, 0xc9 });				// xor ecx, ecx
+		x.Bytes({ 0x31, 0xd2 });				// xor edx, edx
+		x.RegReg({ 0x85 }, true, R12, R12);		// test r12, r12
+		x.Bytes({ 0x0f, 0x94, 0xc1 });			// sete cl
+		x.Bytes({ 0x0f, 0x98, 0xc2 });			// sets dl
+		x.Bytes({ 0xd1, 0xe2 });				// shl edx, 1
+		x.Bytes({ 0x09, 0xd1 });				// or ecx, edx
+		loadG(RAX, reg::F);
+		x.RegReg({ 0x83 }, true, 4, RAX);		// and rax, ~3
+		x.Byte(0xfc);
+		x.RegReg({ 0x09 }, true, RCX, RAX);		// or rax, rcx
+		storeG(reg::F, RAX);
+		pending = false;
+	};
+	auto setFlags = [&]()
+	{
+		x.Mov(R12, RAX);
+		pending = true;
+	};
+	/* rax = new SP, written back */
+	auto growStack = [&]()
+	{
+		loadG(RAX, reg::SP);
+		x.RegReg({ 0x83 }, true, 5, RAX);		// sub rax, 8
+		x.Byte(8);
+		storeG(reg::SP, RAX);
+	};
+	auto shrinkStack = [&]()
+	{
+		loadG(RCX, reg::SP);
+		x.RegReg({ 0x83 }, true, 0, RCX);		// add rcx, 8
+		x.Byte(8);
+		storeG(reg::SP, RCX);
+	};
+	/* flags into F and IP into the Context before a guest memory access,
+	   so a guard page hit stops the guest exactly there once Recover has
+	   stored the homes. uses rax, rcx and rdx */
+	auto faultPoint = [&](u64 at)
+	{
+		materialise();
+		x.MovImm64(RCX, at);
+		x.Store(RBX, R(reg::IP), RCX);
+	};
+	/* leave the block with rax = next guest address */
+	auto exit = [&]()
+	{
+		leaveHomes();
+		x.Epilogue();
+	};
+	auto exitTo = [&](u64 target)
+	{
+		materialise();
+		x.MovImm64(RAX, target);
+		exit();
+	};
+	auto jumpLoop = [&](std::initializer_list<byte> opcode)
+	{
+		x.Bytes(opcode);
+		x.Imm32(static_cast<u32>(loop - (code.size() + 4)));
+	};
+	/* leave the block at target if the jump is taken, else at next */
+	auto condJump = [&](byte jump, u64 target, u64 next)
+	{
+		materialise();
+		loadG(RCX, reg::F);
+		x.Bytes({ 0x83, 0xe1, 0x03 });		// and ecx, 3
+		x.Byte(0xba);						// mov edx, mask
+		x.Imm32(ConditionMask(jump));
+		x.Bytes({ 0x0f, 0xa3, 0xca });		// bt edx, ecx
+		if (target == address)
+		{
+			// loop back to the start of the block without leaving
+			jumpLoop({ 0x0f, 0x82 });		// jc loop
+			x.MovImm64(RAX, next);
+		}
+		else
+		{
+			x.MovImm64(RAX, next);
+			x.MovImm64(RCX, target);
+			x.RegReg({ 0x0f, 0x42 }, true, RAX, RCX);	// cmovc rax, rcx
+		}
+		exit();
+	};
+
+	u64 ip = address;
+	size_t count = 0;
+	bool terminated = false;
+	while (!terminated && count < MAX_BLOCK)
+	{
+		const byte opcode = mem[ip];
+		const u64 a0 = AsType<u64>(mem[ip + 1]);
+		const u64 a1 = AsType<u64>(mem[ip + 1 + 8]);
+		const u64 a2 = AsType<u64>(mem[ip + 1 + 16]);
+		const u64 next = ip + m_sizeTable[opcode];
+		// register operands of this instruction, for the checks below
+		u64 regs[2] = { reg::A, reg::A };
+		bool ok = true;
+		switch (opcode)
+		{
+		case op::MOV: case op::CMP:
+		case op::ADD: case op::SUB: case op::MUL: case op::DIV: case op::MOD:
+		case op::AND: case op::OR: case op::XOR:
+		case op::CJE: case op::CJNE: case op::CJGT: case op::CJLT: case op::CJGE: case op::CJLE:
+			regs[0] = a0; regs[1] = a1;
+			break;
+		case op::MOVI: case op::MOVF: case op::SHL: case op::SHR:
+		case op::ADDI: case op::SUBI: case op::CMPI: case op::ANDI:
+		case op::CJEI: case op::CJNEI: case op::CJGTI: case op::CJLTI: case op::CJGEI: case op::CJLEI:
+		case op::PUSH: case op::POP: case op::INC: case op::DEC: case op::NOT: case op::CALLR:
+			regs[0] = a0;
+			break;
+		case op::MOVT:
+			regs[0] = a1;
+			break;
+		case op::NOP: case op::CLF: case op::PUSHI: case op::PUSHF: case op::POPF:
+		case op::CALLI: case op::RET: case op::JMP:
+		case op::JZ: case op::JNZ: case op::JE: case op::JNE:
+		case op::JGT: case op::JLT: case op::JLE: case op::JGE:
+			break;
+		default:
+			// INT, HALT and unknown opcodes are left to the interpreter
+			ok = false;
+			break;
+		}
+		if (!ok || !Compilable(regs[0]) || !Compilable(regs[1]))
+			break;
+		if (regs[0] == reg::F || regs[1] == reg::F)
+			materialise();
+
+		switch (opcode)
+		{
+		/* registers */
+		case op::NOP:
+			break;
+		case op::CLF:
+			x.Bytes({ 0x31, 0xc0 });			// xor eax, eax
+			storeG(reg::F, RAX);
+			pending = false;
+			break;
+		case op::MOVI:
+			x.MovImm64(RAX, a1);
+			storeG(a0, RAX);
+			break;
+		case op::MOVF:
+			faultPoint(ip);
+			x.MovImm64(RCX, a1);
+			x.MemIndex({ 0x8b }, true, RAX, R13, RCX);
+			storeG(a0, RAX);
+			break;
+		case op::MOVT:
+			faultPoint(ip);
+			x.MovImm64(RCX, a0);
+			loadG(RAX, a1);
+			x.MemIndex({ 0x89 }, true, RAX, R13, RCX);
+			break;
+		case op::MOV:
+			loadG(RAX, a1);
+			storeG(a0, RAX);
+			break;
+		case op::PUSH:
+			faultPoint(ip);
+			growStack();
+			loadG(RCX, a0);
+			x.MemIndex({ 0x89 }, true, RCX, R13, RAX);
+			break;
+		case op::PUSHI:
+			faultPoint(ip);
+			growStack();
+			x.MovImm64(RCX, a0);
+			x.MemIndex({ 0x89 }, true, RCX, R13, RAX);
+			break;
+		case op::PUSHF:
+			faultPoint(ip);
+			growStack();
+			loadG(RCX, reg::F);
+			x.MemIndex({ 0x89 }, true, RCX, R13, RAX);
+			break;
+		case op::POP:
+			faultPoint(ip);
+			loadG(RAX, reg::SP);
+			x.MemIndex({ 0x8b }, true, RCX, R13, RAX);
+			storeG(a0, RCX);
+			shrinkStack();
+			break;
+		case op::POPF:
+			faultPoint(ip);
+			loadG(RAX, reg::SP);
+			x.MemIndex({ 0x8b }, true, RCX, R13, RAX);
+			storeG(reg::F, RCX);
+			shrinkStack();
+			pending = false;
+			break;
+		/* arithmetic */
+		case op::ADD: case op::SUB: case op::MUL: case op::AND: case op::OR: case op::XOR:
+		{
+			loadG(RAX, a0);
+			switch (opcode)
+			{
+			case op::ADD: opG({ 0x03 }, RAX, a1); break;
+			case op::SUB: opG({ 0x2b }, RAX, a1); break;
+			case op::MUL: opG({ 0x0f, 0xaf }, RAX, a1); break;
+			case op::AND: opG({ 0x23 }, RAX, a1); break;
+			case op::OR:  opG({ 0x0b }, RAX, a1); break;
+			case op::XOR: opG({ 0x33 }, RAX, a1); break;
+			}
+			storeG(a0, RAX);
+			setFlags();
+			break;
+		}
+		case op::DIV: case op::MOD:
+			loadG(RCX, a1);
+			loadG(RAX, a0);
+			x.Bytes({ 0x48, 0x99 });			// cqo
+			x.RegReg({ 0xf7 }, true, 7, RCX);	// idiv rcx
+			if (opcode == op::MOD)
+				x.Mov(RAX, RDX);
+			storeG(a0, RAX);
+			setFlags();
+			break;
+		case op::CMP:
+			loadG(RAX, a0);
+			opG({ 0x2b }, RAX, a1);
+			setFlags();
+			break;
+		case op::INC: case op::DEC: case op::NOT:
+			loadG(RAX, a0);
+			if (opcode == op::NOT)
+				x.RegReg({ 0xf7 }, true, 2, RAX);		// not rax
+			else
+			{
+				x.RegReg({ 0x83 }, true, opcode == op::INC ? 0 : 5, RAX);	// add/sub rax, 1
+				x.Byte(1);
+			}
+			storeG(a0, RAX);
+			setFlags();
+			break;
+		case op::SHL: case op::SHR:
+			loadG(RAX, a0);
+			x.MovImm64(RCX, a1);
+			x.RegReg({ 0xd3 }, true, opcode == op::SHL ? 4 : 7, RAX);	// shl/sar rax, cl
+			storeG(a0, RAX);
+			setFlags();
+			break;
+		case op::ADDI: case op::SUBI: case op::ANDI: case op::CMPI:
+			loadG(RAX, a0);
+			x.MovImm64(RCX, a1);
+			switch (opcode)
+			{
+			case op::ADDI: x.RegReg({ 0x01 }, true, RCX, RAX); break;	// add rax, rcx
+			case op::SUBI: case op::CMPI: x.RegReg({ 0x29 }, true, RCX, RAX); break;	// sub rax, rcx
+			case op::ANDI: x.RegReg({ 0x21 }, true, RCX, RAX); break;	// and rax, rcx
+			}
+			if (opcode != op::CMPI)
+				storeG(a0, RAX);
+			setFlags();
+			break;
+		/* jumping/calling. the return address pushed is the last byte of
+		   the call, same as OpImpl::_calli */
+		case op::CALLI:
+			faultPoint(ip);
+			growStack();
+			x.MovImm64(RCX, ip + 8);
+			x.MemIndex({ 0x89 }, true, RCX, R13, RAX);
+			exitTo(a0);
+			terminated = true;
+			break;
+		case op::CALLR:
+			faultPoint(ip);
+			loadG(RDX, a0);
+			growStack();
+			x.MovImm64(RCX, ip + 8);
+			x.MemIndex({ 0x89 }, true, RCX, R13, RAX);
+			x.Mov(RAX, RDX);
+			exit();
+			terminated = true;
+			break;
+		case op::RET:
+			faultPoint(ip);
+			loadG(RAX, reg::SP);
+			x.MemIndex({ 0x8b }, true, RDX, R13, RAX);
+			shrinkStack();
+			x.Mov(RAX, RDX);
+			x.RegReg({ 0x83 }, true, 0, RAX);	// add rax, 1
+			x.Byte(1);
+			exit();
+			terminated = true;
+			break;
+		case op::JMP:
+			if (a0 == address)
+			{
+				materialise();
+				jumpLoop({ 0xe9 });				// jmp loop
+			}
+			else
+				exitTo(a0);
+			terminated = true;
+			break;
+		case op::CJE: case op::CJNE: case op::CJGT: case op::CJLT: case op::CJGE: case op::CJLE:
+		case op::CJEI: case op::CJNEI: case op::CJGTI: case op::CJLTI: case op::CJGEI: case op::CJLEI:
+			loadG(RAX, a0);
+			if (opcode >= op::CJEI)
+			{
+				x.MovImm64(RCX, a1);
+				x.RegReg({ 0x29 }, true, RCX, RAX);	// sub rax, rcx
+			}
+			else
+				opG({ 0x2b }, RAX, a1);
+			setFlags();
+			condJump(BranchJump(opcode), a2, next);
+			terminated = true;
+			break;
+		default: // conditional jumps
+			condJump(opcode, a0, next);
+			terminated = true;
+			break;
+		}
+		++count;
+		ip = next;
+	}
+	if (count == 0)
+		return nullptr;
+	if (!terminated)
+		exitTo(ip);
+
+	if (code.size() > m_capacity)
+		return nullptr;
+	if (m_used + code.size() > m_capacity)
+		Flush();
+	byte* fn = m_code + m_used;
+	// the pages the block lands on may already hold blocks: they stop being
+	// executable only while it is copied in
+	Protect(m_used, m_used + code.size(), true);
+	memcpy(fn, code.data(), code.size());
+	Protect(m_used, m_used + code.size(), false);
+	m_used += code.size();
+	m_stats.blocks++;
+	m_stats.instructions += count;
+	m_stats.codeBytes = m_used;
+	return reinterpret_cast<blockFn>(fn);
+}
+
+void RegVM::RunJIT()
+{
+	if (!RegJIT::Supported())
+	{
+		RunThreaded<false>(0);
+		return;
+	}
+	if (!m_jit)
+		m_jit = new RegJIT(m_opSizeTable);
+	m_context.running = true;
+	u64 ip = m_context.r[reg::IP] + 1;
+	while (m_context.running)
+	{
+		RegJIT::blockFn fn = m_jit->GetBlock(&m_context, ip);
+		if (fn)
+		{
+			// blocks expect r[F] to be current and leave it that way
+			MaterialiseFlags(&m_context);
+			ip = fn(&m_context);
+		}
+		else
+		{
+			// interpret one instruction
+			m_context.r[reg::IP] = ip;
+			m_opTable[m_context.mem[ip]](&m_context);
+			ip = m_context.r[reg::IP] + 1;
+		}
+	}
+}
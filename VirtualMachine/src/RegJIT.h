@@ -0,0 +1,67 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "RegVM.h"
+
+/* JIT
+	translates basic blocks of RegVM bytecode into x86-64 machine code in a
+	code cache. a compiled block takes the Context and returns the guest
+	address of the next instruction to run. the cache is never writable and
+	executable at the same time: pages are made writable to copy a block in,
+	then read-only and executable again.
+
+	guest registers with a host home register are loaded into it when a
+	block is entered and stored back to Context::r when it leaves, the rest
+	are used in place; flags are only written to r[F] at block exits, before
+	instructions that read F and before guest memory accesses. lazy flags
+	left by the interpreter are materialised before a block is entered. a
+	guard page hit inside a block finds IP and r[F] current in the Context,
+	and Recover takes the registers still in their homes from the host
+	registers at the fault. blocks stop before
+	INT, HALT, anything naming IP as an operand and opcodes the compiler
+	does not know; RegVM::RunJIT runs those through m_opTable.
+	like the decoded engine, this assumes the program does not overwrite
+	its own code.
+*/
+class RegJIT
+{
+public:
+	typedef u64(*blockFn)(RegVM::Context*);
+	struct Stats
+	{
+		size_t blocks = 0;			// blocks compiled
+		size_t instructions = 0;	// guest instructions compiled
+		size_t codeBytes = 0;		// bytes of machine code in the cache
+		size_t flushes = 0;			// times the cache was cleared: full, or a new program loaded
+		double compileSeconds = 0;	// time spent compiling
+	};
+private:
+	byte* m_code = nullptr;		// code cache, read-only and executable outside Compile
+	size_t m_capacity = 0;
+	size_t m_used = 0;
+	std::unordered_map<u64, blockFn> m_blocks;
+	const size_t* m_sizeTable;
+	Stats m_stats;
+public:
+	RegJIT(const size_t* opSizeTable, size_t cacheSize = 16 * 1024 * 1024);
+	~RegJIT();
+	RegJIT(const RegJIT&) = delete;
+	RegJIT& operator=(const RegJIT&) = delete;
+	/* true if machine code can be generated on this host */
+	static bool Supported();
+	/* compiled block starting at address, or nullptr if the first
+	   instruction has to be interpreted */
+	blockFn GetBlock(const RegVM::Context* c, u64 address);
+	const Stats& GetStats() const { return m_stats; }
+	/* drop every compiled block */
+	void Flush();
+	/* after a guard page hit inside a block: store the guest registers it
+	   kept in host registers into c, from the faulting thread's registers
+	   (see GuestMemory::FaultHook). faults outside the cache leave c alone */
+	void Recover(RegVM::Context* c, const void* machine) const;
+private:
+	blockFn Compile(const RegVM::Context* c, u64 address);
+	/* the pages of [begin, end) of the cache, read-write or read-execute */
+	void Protect(size_t begin, size_t end, bool writable);
+};
@@ -1,17 +1,68 @@
 #include "RegVM.h"
+#include "RegJIT.h"
+#include "RegAOT.h"
+#include "VMImage.h"
+#include "Snapshot.h"
+#include "Checkpoint.h"
+#include "GuestMemory.h"
 
-RegVM::RegVM()
+/* what snapshots and checkpoints store besides guest memory. flags are
+   materialised first */
+struct RegVM::SavedState
+{
+	i64 r[reg::REG_END];
+	u64 codeSize;
+	u64 running;
+};
+
+RegVM::RegVM(Engine engine, size_t memSize) : m_memSize(memSize), m_engine(engine), m_active(engine)
+{
+	Reset();
+	m_context.mem = GuestMemory::Reserve(VMImage::MappedSize(m_memSize));
+	m_context.r[reg::SP] = m_memSize - 1;
+	Configure();
+}
+
+RegVM::RegVM(const VMImage& image, Engine engine) : m_engine(engine), m_active(engine)
 {
 	Reset();
-	size_t memSize = 1024 * 1024;
-	m_context.mem = reinterpret_cast<byte*>(malloc(memSize));
-	m_context.r[reg::SP] = memSize - 1;
+	m_memSize = image.GetMemorySize();
+	m_context.mem = image.Map();
+	m_mapped = true;
 	Configure();
+	if (!m_context.mem)
+	{
+		printf("error: could not map vm image\n");
+		return;
+	}
+	Start(image.GetCodeSize());
 }
 
 RegVM::~RegVM()
 {
-	free(m_context.mem);
+	delete m_jit;
+	delete m_native;
+	ReleaseMemory();
+}
+
+void RegVM::ReleaseMemory()
+{
+	// stop tracking before the pages go away
+	delete m_checkpoints;
+	m_checkpoints = nullptr;
+	// goes with the memory
+	m_guard = 0;
+	m_guardLength = 0;
+	m_topGuard = 0;
+	if (m_mapped)
+	{
+		if (m_context.mem)
+			VMImage::Unmap(m_context.mem, m_memSize);
+	}
+	else
+		GuestMemory::Release(m_context.mem, VMImage::MappedSize(m_memSize));
+	m_context.mem = nullptr;
+	m_codeMapped = false;
 }
 
 void RegVM::LoadProgram(const void* mem, size_t size)
@@ -19,21 +70,324 @@ void RegVM::LoadProgram(const void* mem, size_t size)
 #ifndef NDEBUG
 	printf("loading program of size %llu bytes\n", size);
 #endif
+	std::vector<byte> expanded;
+	if (Bytecode::IsV2(mem, size))
+	{
+		// compact encoding, expand to what the engines execute
+		if (!Bytecode::Expand(reinterpret_cast<const byte*>(mem), size, &expanded))
+		{
+			printf("error: malformed v2 program\n");
+			return;
+		}
+		mem = expanded.data();
+		size = expanded.size();
+	}
+	const bool reuse = !m_codeMapped && m_context.mem;
+	if (!reuse)
+	{
+		// the last program was mapped from its file, start over with plain memory
+		ReleaseMemory();
+		m_context.mem = GuestMemory::Reserve(VMImage::MappedSize(m_memSize));
+		m_mapped = false;
+		if (!m_context.mem)
+		{
+			printf("error: could not reserve guest memory\n");
+			return;
+		}
+	}
+	if (size > m_memSize)
+	{
+		printf("error: program does not fit in guest memory\n");
+		return;
+	}
+	// the new program may reach into the old guard page
+	RemoveGuard();
 	memcpy(m_context.mem, mem, size);
+	if (reuse)
+	{
+		// nothing the last program left behind may show through
+		const size_t mapped = VMImage::MappedSize(m_memSize);
+		if (m_mapped)
+			memset(m_context.mem + size, 0, mapped - size);
+		else
+			GuestMemory::Discard(m_context.mem + size, mapped - size);
+	}
+	Start(size);
+}
+
+void RegVM::LoadProgram(const MappedFile& file)
+{
+	if (!file.Valid())
+	{
+		printf("error: program file is not mapped\n");
+		return;
+	}
+	byte* mem = Bytecode::IsV2(file.Data(), file.Size()) ? nullptr : VMImage::MapProgram(file, m_memSize);
+	if (!mem)
+	{
+		LoadProgram(file.Data(), file.Size());
+		return;
+	}
+	ReleaseMemory();
+	m_context.mem = mem;
+	m_mapped = true;
+	m_codeMapped = true;
+	Start(file.Size());
+}
+
+/* get ready to run the codeSize byte program at the start of guest memory */
+void RegVM::Start(size_t codeSize)
+{
+	m_codeSize = codeSize;
+	// a fresh context, so one instance can run program after program
+	byte* mem = m_context.mem;
+	m_context = Context();
+	m_context.mem = mem;
+	m_context.r[reg::SP] = m_memSize - 1;
+	// every engine carries on at IP + 1
+	m_context.r[reg::IP] = -1;
+	m_context.running = true;
+	Prepare();
+}
+
+/* per program engine state, once guest memory holds the program */
+void RegVM::Prepare()
+{
+	m_active = m_engine;
+	if (m_verify)
+	{
+		m_verified = m_assumeVerified || Verify(m_codeSize);
+		if (!m_verified)
+			m_active = Engine::Checked;
+	}
+	m_assumeVerified = false;
+	// compiled blocks belong to the previous program
+	if (m_jit)
+		m_jit->Flush();
+	if (m_active == Engine::Decoded)
+		Decode(m_codeSize);
+	if (m_active == Engine::Native && !(m_native && m_native->Matches(m_context.mem, m_codeSize)))
+		m_active = Engine::Threaded;
+	PlaceGuard();
+}
+
+/* guard pages between heap and stack and past the top of the stack, see
+   MEMORY LAYOUT in RegVM.h */
+void RegVM::PlaceGuard()
+{
+	RemoveGuard();
+	const size_t page = GuestMemory::PageSize();
+	if (!m_context.mem || reinterpret_cast<uintptr_t>(m_context.mem) % page)
+		return;
+	// every mapping of guest memory ends with this page (VMImage::MappedSize)
+	const size_t top = VMImage::MappedSize(m_memSize) - page;
+	m_topGuardProtection = GuestMemory::Guard(m_context.mem + top, page);
+	if (m_topGuardProtection)
+		m_topGuard = top;
+	const size_t stack = (m_memSize - m_memSize / STACK_SHARE) / page * page;
+	const size_t code = (m_codeSize + page - 1) / page * page;
+	// no room between program and stack, or a restored stack already below it
+	if (stack < code + page || static_cast<u64>(m_context.r[reg::SP]) < stack)
+		return;
+	m_guardProtection = GuestMemory::Guard(m_context.mem + stack - page, page);
+	if (!m_guardProtection)
+		return;
+	m_guard = stack - page;
+	m_guardLength = page;
+}
+
+void RegVM::RemoveGuard()
+{
+	if (m_topGuard)
+		GuestMemory::Unguard(m_context.mem + m_topGuard, GuestMemory::PageSize(), m_topGuardProtection);
+	m_topGuard = 0;
+	if (!m_guardLength)
+		return;
+	GuestMemory::Unguard(m_context.mem + m_guard, m_guardLength, m_guardProtection);
+	m_guard = 0;
+	m_guardLength = 0;
+}
+
+void RegVM::SaveState(SavedState* state)
+{
+	MaterialiseFlags(&m_context);
+	memset(state, 0, sizeof(SavedState));
+	memcpy(state->r, m_context.r, sizeof(state->r));
+	state->codeSize = m_codeSize;
+	state->running = m_context.running;
+}
+
+void RegVM::RestoreState(const SavedState& state, byte* mem, size_t memSize, bool mapped)
+{
+	ReleaseMemory();
+	m_context.mem = mem;
+	m_memSize = memSize;
+	m_mapped = mapped;
+	memcpy(m_context.r, state.r, sizeof(m_context.r));
+	m_context.flagResult = 0;
+	m_context.flagsPending = false;
+	m_context.running = state.running != 0;
+	m_context.fault = nullptr;
+	m_codeSize = state.codeSize;
+	Prepare();
+}
+
+bool RegVM::SaveSnapshot(const char* path)
+{
+	SavedState state;
+	SaveState(&state);
+	// the snapshot reads every page
+	RemoveGuard();
+	const bool saved = Snapshot::Save(path, Snapshot::REGVM, &state, sizeof(state), m_context.mem, m_memSize);
+	PlaceGuard();
+	return saved;
+}
+
+bool RegVM::LoadSnapshot(const char* path)
+{
+	SavedState state;
+	size_t memSize;
+	byte* mem = Snapshot::Restore(path, Snapshot::REGVM, &state, sizeof(state), &memSize);
+	if (!mem)
+		return false;
+	RestoreState(state, mem, memSize, true);
+	return true;
+}
+
+bool RegVM::StartCheckpoints(const char* path)
+{
+	delete m_checkpoints;
+	SavedState state;
+	SaveState(&state);
+	m_checkpoints = new CheckpointLog(m_context.mem, m_memSize, m_guard, m_guardLength);
+	if (m_checkpoints->Open(path, &state, sizeof(state)))
+		return true;
+	delete m_checkpoints;
+	m_checkpoints = nullptr;
+	return false;
+}
+
+bool RegVM::Checkpoint()
+{
+	if (!m_checkpoints)
+		return false;
+	SavedState state;
+	SaveState(&state);
+	return m_checkpoints->Append(&state, sizeof(state));
+}
+
+bool RegVM::LoadCheckpoint(const char* path)
+{
+	SavedState state;
+	size_t memSize;
+	byte* mem = CheckpointLog::Replay(path, &state, sizeof(state), &memSize);
+	if (!mem)
+		return false;
+	RestoreState(state, mem, memSize, false);
+	return true;
 }
 
 void RegVM::Run()
+{
+	RunGuarded(~(u64)0, false);
+}
+
+bool RegVM::Run(u64 budget)
+{
+	if (!m_context.running)
+		return false;
+	RunGuarded(budget, true);
+	return m_context.running;
+}
+
+/* run on the active engine. a guard page hit stops the guest, not the host */
+void RegVM::RunGuarded(u64 budget, bool metered)
+{
+	GuestMemory::Range guards[2];
+	size_t count = 0;
+	if (m_guardLength)
+		guards[count++] = { m_context.mem + m_guard, m_guardLength };
+	if (m_topGuard)
+		guards[count++] = { m_context.mem + m_topGuard, GuestMemory::PageSize() };
+	if (!count)
+	{
+		Dispatch(budget, metered);
+		return;
+	}
+	struct Call { RegVM* vm; u64 budget; bool metered; } call = { this, budget, metered };
+	const void* fault = GuestMemory::RunGuarded([](void* arg)
+	{
+		Call* call = reinterpret_cast<Call*>(arg);
+		call->vm->Dispatch(call->budget, call->metered);
+	}, &call, guards, count, [](const void* machine, void* arg)
+	{
+		// a JIT block keeps guest registers in host registers
+		Call* call = reinterpret_cast<Call*>(arg);
+		if (call->vm->m_jit)
+			call->vm->m_jit->Recover(&call->vm->m_context, machine);
+	});
+	if (!fault)
+		return;
+	const u64 address = reinterpret_cast<const byte*>(fault) - m_context.mem;
+	m_context.fault = m_topGuard && address >= m_topGuard
+		? "guard page hit (stack underflow or access past the end of memory)"
+		: "guard page hit (stack overflow or heap overrun)";
+	m_context.running = false;
+	printf("guest fault: %s at address %llu (ip %llu, sp %llu)\n", m_context.fault,
+		address, (u64)m_context.r[reg::IP], (u64)m_context.r[reg::SP]);
+}
+
+void RegVM::Dispatch(u64 budget, bool metered)
+{
+	if (metered)
+	{
+		if (m_active == Engine::Table)
+			RunTable(budget);
+		else if (m_active == Engine::Checked)
+			RunChecked(budget);
+		else
+			// the decoded stream, JIT blocks and native code have no cheap
+			// place to stop, so metered runs go through the threaded engine
+			RunThreaded<true>(budget);
+		return;
+	}
+	switch (m_active)
+	{
+	case Engine::Threaded:
+		RunThreaded<false>(0);
+		break;
+	case Engine::Decoded:
+		RunDecoded();
+		break;
+	case Engine::JIT:
+		RunJIT();
+		break;
+	case Engine::Native:
+		RunNative();
+		break;
+	case Engine::Checked:
+		RunChecked(~(u64)0);
+		break;
+	case Engine::Table:
+	default:
+		RunTable(~(u64)0);
+		break;
+	}
+}
+
+void RegVM::RunTable(u64 budget)
 {
 	m_context.running = true;
-	m_context.r[reg::IP] = -1;
-	while (m_context.running)
+	while (m_context.running && budget--)
 	{
 		// increment the instruction pointer
 		m_context.r[reg::IP]++;
 		// read instruction byte, call relevant handler
 #ifndef NDEBUG
 		printf("----------\n");
-		printf("tos: %lld\n", AsType<i64>(m_context.mem[AsType<u64>(m_context.r[reg::SP])]));
+		// a stack that underflowed is left to fault on the instruction that pops it
+		if (AsType<u64>(m_context.r[reg::SP]) <= m_memSize + VMImage::OVERHANG - 8)
+			printf("tos: %lld\n", AsType<i64>(m_context.mem[AsType<u64>(m_context.r[reg::SP])]));
 		printf("opcode: %u\n", AsType<u8>(m_context.mem[AsType<u64>(m_context.r[reg::IP])]));
 		printf("ip: %llu\n", AsType<u64>(m_context.r[reg::IP]));
 		printf("----------\n");
@@ -48,33 +402,72 @@ void RegVM::Run()
 	}
 }
 
+i64 RegVM::GetRegister(u64 regcode)
+{
+	MaterialiseFlags(&m_context);
+	return m_context.r[regcode];
+}
+
+void RegVM::SetRegister(u64 regcode, i64 value)
+{
+	MaterialiseFlags(&m_context);
+	m_context.r[regcode] = value;
+}
+
 void RegVM::PrintState()
 {
-	printf("REGISTERS:\n------------\n"
-		"a:\t0x%016llx ( %lld )\n"
-		"b:\t0x%016llx ( %lld )\n"
-		"c:\t0x%016llx ( %lld )\n"
-		"ip:\t0x%016llx ( %lld )\n"
-		"sp:\t0x%016llx ( %lld )\n"
-		"f:\t0x%016llx ( %lld )\n",
-		m_context.r[0], m_context.r[0],
-		m_context.r[1], m_context.r[1],
-		m_context.r[2], m_context.r[2],
-		m_context.r[3], m_context.r[3],
-		m_context.r[4], m_context.r[4],
-		m_context.r[5], m_context.r[5]
-	);
-}
-
-//size_t RegVM::GetInstructionSize(byte opcode)
-//{
-//	return m_opSizeTable[opcode];
-//}
+	// same dump as the INT instruction
+	OpImpl::_int(&m_context);
+}
+
+void RegVM::PrintStats()
+{
+	if (m_jit)
+	{
+		const RegJIT::Stats& s = m_jit->GetStats();
+		printf("JIT:\n------------\n"
+			"blocks:\t\t%zu\n"
+			"instructions:\t%zu\n"
+			"code cache:\t%zu bytes\n"
+			"cache flushes:\t%zu\n"
+			"compile time:\t%.3f ms\n",
+			s.blocks, s.instructions, s.codeBytes, s.flushes, s.compileSeconds * 1000.0);
+	}
+	if (m_active == Engine::Decoded)
+		PrintFusionStats();
+	if (m_verify)
+	{
+		printf("VERIFIER:\n------------\n");
+		if (m_verified)
+			printf("verified, engine unchecked\n");
+		else
+			printf("rejected at %llu: %s, engine checked\n", m_verifyAddress, m_verifyError);
+	}
+	if (m_engine == Engine::Native)
+	{
+		printf("NATIVE:\n------------\n");
+		printf(m_active == Engine::Native ? "ran native code\n" : "no native code for this program, ran threaded\n");
+	}
+	if (m_checkpoints)
+	{
+		const CheckpointLog::Stats& s = m_checkpoints->GetStats();
+		printf("CHECKPOINTS:\n------------\n"
+			"checkpoints:\t%zu\n"
+			"bytes written:\t%llu\n",
+			s.checkpoints, s.bytes);
+	}
+}
+
+size_t RegVM::GetInstructionSize(byte opcode)
+{
+	return m_opSizeTable[opcode];
+}
 
 /* reset context. DOES NOT FREE MEMORY */
 void RegVM::Reset()
 {
-	memset(&m_context, 0, sizeof(Context));
+	// every field back to its initialiser in RegVM.h
+	m_context = Context();
 }
 
 /* configure optable */
@@ -82,51 +475,71 @@ void RegVM::Configure()
 {
 	/* clear all to noop. should prevent crash on invalid opcode */
 	for (int i = 0; i < 256; i++)
-	{
 		m_opTable[i] = OpImpl::_nop;
-		//m_opSizeTable[i] = 1;
-	}
 	/* miscellaneous*/
-	m_opTable[op::HALT] =	OpImpl::_halt;	//m_opSizeTable[op::HALT] = 1;
-	m_opTable[op::NOP ] =	OpImpl::_nop;	//m_opSizeTable[op::NOP ] = 1;
-	m_opTable[op::INT ] =	OpImpl::_int;	//m_opSizeTable[op::INT ] = 1;
-	/* registers */							//
-	m_opTable[op::CLF  ] =	OpImpl::_clf;	//m_opSizeTable[op::CLF  ] = 1;
-	m_opTable[op::MOVF ] =	OpImpl::_movf;	//m_opSizeTable[op::MOVF ] = 1 + 8 + 8;
-	m_opTable[op::MOVI ] =	OpImpl::_movi;	//m_opSizeTable[op::MOVI ] = 1 + 8 + 8;
-	m_opTable[op::MOVT ] =	OpImpl::_movt;	//m_opSizeTable[op::MOVT ] = 1 + 8 + 8;
-	m_opTable[op::MOV  ] =	OpImpl::_mov;	//m_opSizeTable[op::MOV  ] = 1 + 8 + 8;
-	m_opTable[op::PUSH ] =	OpImpl::_push;	//m_opSizeTable[op::PUSH ] = 1 + 8;
-	m_opTable[op::PUSHF] =	OpImpl::_pushf;	//m_opSizeTable[op::PUSHF] = 1;
-	m_opTable[op::PUSHI] =	OpImpl::_pushi;	//m_opSizeTable[op::PUSHI] = 1 + 8;
-	m_opTable[op::POP  ] =	OpImpl::_pop;	//m_opSizeTable[op::POP  ] = 1 + 8;
-	m_opTable[op::POPF ] =	OpImpl::_popf;	//m_opSizeTable[op::POPF ] = 1;
-	/* arithmetic */						//
-	m_opTable[op::ADD] =	OpImpl::_add;	//m_opSizeTable[op::ADD] = 1 + 8 + 8;
-	m_opTable[op::SUB] =	OpImpl::_sub;	//m_opSizeTable[op::SUB] = 1 + 8 + 8;
-	m_opTable[op::CMP] =	OpImpl::_cmp;	//m_opSizeTable[op::CMP] = 1 + 8 + 8;
-	m_opTable[op::MUL] =	OpImpl::_mul;	//m_opSizeTable[op::MUL] = 1 + 8 + 8;
-	m_opTable[op::DIV] =	OpImpl::_div;	//m_opSizeTable[op::DIV] = 1 + 8 + 8;
-	m_opTable[op::MOD] =	OpImpl::_mod;	//m_opSizeTable[op::MOD] = 1 + 8 + 8;
-	m_opTable[op::INC] =	OpImpl::_inc;	//m_opSizeTable[op::INC] = 1 + 8;
-	m_opTable[op::DEC] =	OpImpl::_dec;	//m_opSizeTable[op::DEC] = 1 + 8;
-	m_opTable[op::AND] =	OpImpl::_and;	//m_opSizeTable[op::AND] = 1 + 8 + 8;
-	m_opTable[op::OR ] =	OpImpl::_or;	//m_opSizeTable[op::OR ] = 1 + 8 + 8;
-	m_opTable[op::XOR] =	OpImpl::_xor;	//m_opSizeTable[op::XOR] = 1 + 8 + 8;
-	m_opTable[op::NOT] =	OpImpl::_not;	//m_opSizeTable[op::NOT] = 1 + 8;
-	m_opTable[op::SHL] =	OpImpl::_shl;	//m_opSizeTable[op::SHL] = 1 + 8 + 8;
-	m_opTable[op::SHR] =	OpImpl::_shr;	//m_opSizeTable[op::SHR] = 1 + 8 + 8;
-	/* jumping/calling */					//
-	m_opTable[op::CALLI] =	OpImpl::_calli; //m_opSizeTable[op::CALLI] = 1 + 8;
-	m_opTable[op::CALLR] =	OpImpl::_callr;	//m_opSizeTable[op::CALLR] = 1 + 8;
-	m_opTable[op::RET  ] =	OpImpl::_ret;	//m_opSizeTable[op::RET  ] = 1;
-	m_opTable[op::JMP  ] =	OpImpl::_jmp;	//m_opSizeTable[op::JMP  ] = 1 + 8;
-	m_opTable[op::JZ   ] =	OpImpl::_jz;	//m_opSizeTable[op::JZ   ] = 1 + 8;
-	m_opTable[op::JNZ  ] =	OpImpl::_jnz;	//m_opSizeTable[op::JNZ  ] = 1 + 8;
-	m_opTable[op::JE   ] =	OpImpl::_jz;	//m_opSizeTable[op::JE   ] = 1 + 8;
-	m_opTable[op::JNE  ] =	OpImpl::_jnz;	//m_opSizeTable[op::JNE  ] = 1 + 8;
-	m_opTable[op::JGT  ] =	OpImpl::_jgt;	//m_opSizeTable[op::JGT  ] = 1 + 8;
-	m_opTable[op::JLT  ] =	OpImpl::_jlt;	//m_opSizeTable[op::JLT  ] = 1 + 8;
-	m_opTable[op::JLE  ] =	OpImpl::_jle;	//m_opSizeTable[op::JLE  ] = 1 + 8;
-	m_opTable[op::JGE  ] =	OpImpl::_jge;	//m_opSizeTable[op::JGE  ] = 1 + 8;
+	m_opTable[op::HALT] =	OpImpl::_halt;
+	m_opTable[op::NOP ] =	OpImpl::_nop;
+	m_opTable[op::INT ] =	OpImpl::_int;
+	/* registers */
+	m_opTable[op::CLF  ] =	OpImpl::_clf;
+	m_opTable[op::MOVF ] =	OpImpl::_movf;
+	m_opTable[op::MOVI ] =	OpImpl::_movi;
+	m_opTable[op::MOVT ] =	OpImpl::_movt;
+	m_opTable[op::MOV  ] =	OpImpl::_mov;
+	m_opTable[op::PUSH ] =	OpImpl::_push;
+	m_opTable[op::PUSHF] =	OpImpl::_pushf;
+	m_opTable[op::PUSHI] =	OpImpl::_pushi;
+	m_opTable[op::POP  ] =	OpImpl::_pop;
+	m_opTable[op::POPF ] =	OpImpl::_popf;
+	/* arithmetic */
+	m_opTable[op::ADD] =	OpImpl::_add;
+	m_opTable[op::SUB] =	OpImpl::_sub;
+	m_opTable[op::CMP] =	OpImpl::_cmp;
+	m_opTable[op::MUL] =	OpImpl::_mul;
+	m_opTable[op::DIV] =	OpImpl::_div;
+	m_opTable[op::MOD] =	OpImpl::_mod;
+	m_opTable[op::INC] =	OpImpl::_inc;
+	m_opTable[op::DEC] =	OpImpl::_dec;
+	m_opTable[op::AND] =	OpImpl::_and;
+	m_opTable[op::OR ] =	OpImpl::_or;
+	m_opTable[op::XOR] =	OpImpl::_xor;
+	m_opTable[op::NOT] =	OpImpl::_not;
+	m_opTable[op::SHL] =	OpImpl::_shl;
+	m_opTable[op::SHR] =	OpImpl::_shr;
+	m_opTable[op::ADDI] =	OpImpl::_addi;
+	m_opTable[op::SUBI] =	OpImpl::_subi;
+	m_opTable[op::CMPI] =	OpImpl::_cmpi;
+	m_opTable[op::ANDI] =	OpImpl::_andi;
+	/* jumping/calling */
+	m_opTable[op::CALLI] =	OpImpl::_calli;
+	m_opTable[op::CALLR] =	OpImpl::_callr;
+	m_opTable[op::RET  ] =	OpImpl::_ret;
+	m_opTable[op::JMP  ] =	OpImpl::_jmp;
+	m_opTable[op::JZ   ] =	OpImpl::_jz;
+	m_opTable[op::JNZ  ] =	OpImpl::_jnz;
+	m_opTable[op::JE   ] =	OpImpl::_jz;
+	m_opTable[op::JNE  ] =	OpImpl::_jnz;
+	m_opTable[op::JGT  ] =	OpImpl::_jgt;
+	m_opTable[op::JLT  ] =	OpImpl::_jlt;
+	m_opTable[op::JLE  ] =	OpImpl::_jle;
+	m_opTable[op::JGE  ] =	OpImpl::_jge;
+	/* compare and branch */
+	m_opTable[op::CJE  ] =	OpImpl::_cje;
+	m_opTable[op::CJNE ] =	OpImpl::_cjne;
+	m_opTable[op::CJGT ] =	OpImpl::_cjgt;
+	m_opTable[op::CJLT ] =	OpImpl::_cjlt;
+	m_opTable[op::CJGE ] =	OpImpl::_cjge;
+	m_opTable[op::CJLE ] =	OpImpl::_cjle;
+	m_opTable[op::CJEI ] =	OpImpl::_cjei;
+	m_opTable[op::CJNEI] =	OpImpl::_cjnei;
+	m_opTable[op::CJGTI] =	OpImpl::_cjgti;
+	m_opTable[op::CJLTI] =	OpImpl::_cjlti;
+	m_opTable[op::CJGEI] =	OpImpl::_cjgei;
+	m_opTable[op::CJLEI] =	OpImpl::_cjlei;
+	// sizes come from VMs::Reg::GetOperands, except that opcodes without a
+	// handler run as a 1 byte NOP
+	for (int i = 0; i < 256; i++)
+		m_opSizeTable[i] = m_opTable[i] == OpImpl::_nop && i != op::NOP ? 1 : VMs::Reg::GetSize(static_cast<u8>(i));
+
+	ConfigureDecoded();
 }
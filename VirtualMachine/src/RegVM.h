@@ -6,51 +6,261 @@
 #include "VM.h"
 #include "Definitions.h"
 #include "Instruction.h"
+#include "Bytecode.h"
 
 /* INSTRUCTIONS
 	8-bit opcodes
 	64-bit values
 	produces 1 and 9 byte instructions
+	(programs in the compact v2 encoding are expanded on load, see Bytecode.h)
+*/
+/* REGISTERS
+	r0-r15: general purpose, r0-r2 also go by a, b, c
+	ip, sp, f: special
+	a, b, c, ip, sp, f keep their original regcodes 0-5 and r3-r15 follow
+	them (VMs::Reg::Regcode), so older v1 images still run
 */
 /* FLAGS REGISTER
 	starting from LSB:
 	0: zero
 	1: sign
 	2: overflow
+	zero and sign are evaluated lazily: arithmetic only records its result
+	in Context::flagResult, and the bits are merged into r[F] by
+	MaterialiseFlags when something reads or replaces F as a whole.
+*/
+
+/* MEMORY LAYOUT
+	program from address 0, then heap, then the stack at the top (SP starts
+	at the last byte and grows down). the top 1/STACK_SHARE of guest memory,
+	rounded to host pages, is the stack; the page below it is a guard page
+	(GuestMemory::Guard), unless the program reaches into it or memory is
+	too small. a second guard page sits past the end of guest memory and
+	VMImage::OVERHANG (see VMImage::MappedSize), for a stack that underflows.
+	a guest that overflows or underflows its stack, or writes past its heap
+	into the stack, faults a guard: Run stops that guest with
+	Context::fault set, and the host and other guests carry on.
+	the guards cost nothing per instruction. every engine writes IP and SP
+	back to the Context before each guest memory access, so the report has
+	the address of the faulting instruction and SP as it accessed memory.
 */
 
+class RegJIT;
+class RegAOT;
+class VMImage;
+class CheckpointLog;
+
 class RegVM final : public VM
 {
 public:
 	typedef VMs::Reg::Opcode op;
 	typedef VMs::Reg::Regcode reg;
+	struct DecodedProgram;
 	struct Context
 	{
 		i64 r[reg::REG_END] = {};
 		byte* mem = nullptr;
 		bool running = false;
+		const DecodedProgram* decoded = nullptr;
+		i64 flagResult = 0;			// last flag-setting result
+		bool flagsPending = false;	// zero/sign bits of r[F] are stale, derive them from flagResult
+		const char* fault = nullptr;	// why the guest was stopped, if it did not halt
 	};
 	typedef void(*opHandler)(Context*);
+	/* one instruction of the pre-decoded stream.
+		handlers return the next instruction to run, or nullptr to stop */
+	struct Decoded;
+	typedef const Decoded*(*decodedHandler)(Context*, const Decoded*);
+	struct Decoded
+	{
+		decodedHandler handler = nullptr;
+		i64* r1 = nullptr;					// resolved register operands
+		i64* r2 = nullptr;
+		i64 imm = 0;						// immediate or address operand
+		const Decoded* target = nullptr;	// jump/call target, if it is an instruction boundary
+		u64 addr = 0;						// guest address of the opcode
+	};
+	struct DecodedProgram
+	{
+		enum : u32 { NO_ENTRY = 0xffffffff };
+		std::vector<Decoded> code;	// in address order, plus a trailing sentinel
+		std::vector<u32> index;		// guest address -> entry in code
+		const opHandler* opTable = nullptr;
+		size_t fusedSites = 0;					// entries turned into superinstructions
+		std::vector<u64> fusedPairSites;		// the same, per fusion pair
+		mutable std::vector<u64> fusedHits;		// superinstruction runs, per fusion pair, if counted
+		const Decoded* Lookup(u64 address) const
+		{
+			if (address >= index.size() || index[address] == NO_ENTRY) return nullptr;
+			return &code[index[address]];
+		}
+	};
+	/* dispatch engine, chosen at construction
+		Table:		indirect call through m_opTable per instruction
+		Threaded:	direct threading, IP/SP/F kept in host locals
+		Decoded:	runs a stream decoded once by LoadProgram
+		JIT:		compiles basic blocks to x86-64 (RegJIT.h)
+		Checked:	like Table, but checks operands, addresses and the stack
+					before every instruction and faults the guest instead of
+					running a bad one (RegVMVerify.cpp)
+		Native:		runs C compiled ahead of time from the program, loaded
+					with LoadNative (RegAOT.h). Threaded if there is none
+					for the program
+	*/
+	enum class Engine : u8
+	{
+		Table,
+		Threaded,
+		Decoded,
+		JIT,
+		Checked,
+		Native
+	};
 private:
 	Context m_context;
+	size_t m_memSize;
+	bool m_mapped = false;			// guest memory is a VMImage or snapshot view, not GuestMemory
+	bool m_codeMapped = false;		// the program is mapped from its file (VMImage::MapProgram)
+	size_t m_codeSize = 0;			// program size, to decode again after a restore
+	size_t m_guard = 0;				// guest address of the guard page, 0 if there is none
+	size_t m_guardLength = 0;
+	u32 m_guardProtection = 0;		// what the guard page was before
+	size_t m_topGuard = 0;			// guest address of the guard page past the top of memory, 0 if there is none
+	u32 m_topGuardProtection = 0;
+	CheckpointLog* m_checkpoints = nullptr;
+	Engine m_engine;
+	Engine m_active;				// engine for the loaded program: m_engine, or Checked if it failed verification
+	bool m_verify = false;
+	bool m_verified = false;
+	bool m_assumeVerified = false;	// the next program passed before (ProgramCache.h)
+	u64 m_verifyAddress = 0;		// where verification failed, and why
+	const char* m_verifyError = nullptr;
 	opHandler m_opTable[256];
-	//size_t m_opSizeTable[256];
+	decodedHandler m_decodedTable[256];
+	size_t m_opSizeTable[256];
+	DecodedProgram m_decoded;
+	std::vector<bool> m_fusion;		// enabled fusion pairs, see RegVMDecoded.cpp
+	bool m_countFusion = false;
+	RegJIT* m_jit = nullptr;
+	RegAOT* m_native = nullptr;
 public:
-	RegVM();
+	static const size_t DEFAULT_MEMORY = 1024 * 1024;
+	static const size_t STACK_SHARE = 4;
+	/* memSize bytes of guest memory, reserved up front and backed as the
+	   guest touches it (see GuestMemory.h), so it can run into gigabytes */
+	RegVM(Engine engine = Engine::Threaded, size_t memSize = DEFAULT_MEMORY);
+	/* guest memory is a copy-on-write view of image, ready to Run. the
+	   image only has to outlive the constructor */
+	RegVM(const VMImage& image, Engine engine = Engine::Threaded);
 	~RegVM();
 	void LoadProgram(const void* mem, size_t size) override;
+	/* v1 programs are mapped copy-on-write into guest memory where the
+	   platform allows (VMImage::MapProgram), anything else is copied */
+	void LoadProgram(const MappedFile& file) override;
 	void Run() override;
+	/* run at most budget instructions. returns true if the program ran out
+	   of budget and can be resumed with another call, false once it has
+	   halted. the Context is left intact between calls */
+	bool Run(u64 budget);
+	/* registers as the guest sees them, for inputs and results */
+	i64 GetRegister(u64 regcode);
+	void SetRegister(u64 regcode, i64 value);
+	/* write registers and guest memory to a snapshot file (see Snapshot.h).
+	   after Run(budget) returns true, the restored guest carries on where
+	   this one stopped */
+	bool SaveSnapshot(const char* path);
+	/* replace the program and state with a snapshot. guest memory is mapped
+	   from the file, not read */
+	bool LoadSnapshot(const char* path);
+	/* start an append-only checkpoint log (see Checkpoint.h) with a full
+	   checkpoint. each Checkpoint() then appends only the pages written
+	   since the one before */
+	bool StartCheckpoints(const char* path);
+	bool Checkpoint();
+	/* replace the program and state with the last complete checkpoint in a log */
+	bool LoadCheckpoint(const char* path);
+	size_t GetMemorySize() const { return m_memSize; }
+	/* verify each program as it is loaded (RegVMVerify.cpp). programs that
+	   pass run on the engine chosen at construction without any checks,
+	   the rest on the Checked engine. takes effect at the next load */
+	void SetVerify(bool verify) { m_verify = verify; }
+	/* the next program loaded is known to pass verification, do not verify
+	   it again. it is only ever trusted by a verifying VM */
+	void AssumeVerified() { m_assumeVerified = true; }
+	bool IsVerified() const { return m_verified; }
+	/* why the guest stopped without halting, or nullptr */
+	const char* GetFault() const { return m_context.fault; }
 	void PrintState();
-	//size_t GetInstructionSize(byte opcode);
+	void PrintStats();
+	size_t GetInstructionSize(byte opcode);
+	/* fuse only the pairs listed in a profile (one "first second" pair of
+	   handler names per line). takes effect at the next LoadProgram */
+	bool LoadFusionProfile(const char* path);	// RegVMDecoded.cpp
+	/* count how often each superinstruction runs, for writing a profile.
+	   costs a counter update per run. takes effect at the next LoadProgram */
+	void SetFusionCounting(bool count) { m_countFusion = count; }
+	/* shared object built from RegAOT::Emit output, for the Native engine.
+	   takes effect at the next LoadProgram */
+	bool LoadNative(const char* path);		// RegAOT.cpp
 private:
 	void Reset();
 	void Configure();
+	void Start(size_t codeSize);
+	void Prepare();
+	void PlaceGuard();
+	void RemoveGuard();
+	void RunGuarded(u64 budget, bool metered);
+	void Dispatch(u64 budget, bool metered);
+	bool Verify(size_t codeSize);	// RegVMVerify.cpp
+	void RunChecked(u64 budget);	// RegVMVerify.cpp
+	void ReleaseMemory();
+	struct SavedState;
+	void SaveState(SavedState* state);
+	void RestoreState(const SavedState& state, byte* mem, size_t memSize, bool mapped);
+	void ConfigureDecoded();	// RegVMDecoded.cpp
+	void Decode(size_t size);	// RegVMDecoded.cpp
+	void PrintFusionStats();	// RegVMDecoded.cpp
+	void RunTable(u64 budget);
+	template<bool Metered>
+	void RunThreaded(u64 budget);	// RegVMThreaded.cpp. budget is ignored unless Metered
+	void RunDecoded();			// RegVMDecoded.cpp
+	void RunJIT();				// RegJIT.cpp
+	void RunNative();			// RegAOT.cpp
 };
 
 inline void SetArithmeticFlags(i64 value, RegVM::Context* c)
 {
-	c->r[RegVM::reg::F] = SetBit(c->r[RegVM::reg::F], 0, value == 0); // zero flag
-	c->r[RegVM::reg::F] = SetBit(c->r[RegVM::reg::F], 1, value < 0);  // sign flag
+	c->flagResult = value;
+	c->flagsPending = true;
+}
+
+/* bring r[F] up to date. needed before F is read or overwritten as a whole */
+inline void MaterialiseFlags(RegVM::Context* c)
+{
+	if (!c->flagsPending) return;
+	c->r[RegVM::reg::F] = SetBit(c->r[RegVM::reg::F], 0, c->flagResult == 0); // zero flag
+	c->r[RegVM::reg::F] = SetBit(c->r[RegVM::reg::F], 1, c->flagResult < 0);  // sign flag
+	c->flagsPending = false;
+}
+
+inline bool ZeroFlag(const RegVM::Context* c)
+{
+	return c->flagsPending ? c->flagResult == 0 : GetBit(c->r[RegVM::reg::F], 0);
+}
+
+inline bool SignFlag(const RegVM::Context* c)
+{
+	return c->flagsPending ? c->flagResult < 0 : GetBit(c->r[RegVM::reg::F], 1);
+}
+
+/* regcode of the n-th operand. an instruction naming F sees and replaces
+   the whole register, so the flags are materialised first */
+inline u64 RegOperand(RegVM::Context* c, int n)
+{
+	u64 regcode = AsType<u64>(c->mem[c->r[RegVM::reg::IP] + 1 + 8 * n]);
+	if (regcode == RegVM::reg::F)
+		MaterialiseFlags(c);
+	return regcode;
 }
 
 class OpImpl
@@ -63,27 +273,26 @@ public:
 		c->running = false;
 	}
 
-	static void _nop(RegVM::Context* c)
+	static void _nop(RegVM::Context*)
 	{
 		// do nothing
 	}
 
 	static void _int(RegVM::Context* c)
 	{
-		printf("REGISTERS:\n------------\n"
-			"a:\t0x%016llx ( %lld )\n"
-			"b:\t0x%016llx ( %lld )\n"
-			"c:\t0x%016llx ( %lld )\n"
-			"ip:\t0x%016llx ( %lld )\n"
-			"sp:\t0x%016llx ( %lld )\n"
-			"f:\t0x%016llx ( %lld )\n",
-			c->r[0], c->r[0],
-			c->r[1], c->r[1],
-			c->r[2], c->r[2],
-			c->r[3], c->r[3],
-			c->r[4], c->r[4],
-			c->r[5], c->r[5]
-		);
+		// general purpose registers in order, then the special ones
+		static const char* const names[reg::REG_END] = {
+			"a", "b", "c", "r3", "r4", "r5", "r6", "r7",
+			"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+			"ip", "sp", "f"
+		};
+		MaterialiseFlags(c);
+		printf("REGISTERS:\n------------\n");
+		for (u64 i = 0; i < reg::REG_END; ++i)
+		{
+			const u64 regcode = i < VMs::Reg::GPR_COUNT ? VMs::Reg::GetGPR(i) : reg::IP + (i - VMs::Reg::GPR_COUNT);
+			printf("%s:\t0x%016llx ( %lld )\n", names[i], c->r[regcode], c->r[regcode]);
+		}
 	}
 #pragma endregion
 
@@ -91,12 +300,13 @@ public:
 	static void _clf(RegVM::Context* c)
 	{
 		c->r[reg::F] = 0;
+		c->flagsPending = false;
 	}
 
 	static void _movi(RegVM::Context* c)
 	{
 		// read args
-		u64 regcode = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
+		u64 regcode = RegOperand(c, 0);
 		i64 value = AsType<i64>(c->mem[c->r[reg::IP] + 1 + 8]);
 		// do stuff
 		memcpy(&c->r[regcode], &value, 8);
@@ -107,7 +317,7 @@ public:
 	static void _movf(RegVM::Context* c)
 	{
 		// read args
-		u64 regcode = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
+		u64 regcode = RegOperand(c, 0);
 		u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
 		// do stuff
 		memcpy(&c->r[regcode], &c->mem[address], 8);
@@ -119,7 +329,7 @@ public:
 	{
 		// read args
 		u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 regcode = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 regcode = RegOperand(c, 1);
 		// do stuff
 		memcpy(&c->mem[address], &c->r[regcode], 8);
 		// avoid reading the 2 arguments as opcodes
@@ -129,8 +339,8 @@ public:
 	static void _mov(RegVM::Context* c)
 	{
 		// read args
-		u64 reg1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 reg2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 reg1 = RegOperand(c, 0);
+		u64 reg2 = RegOperand(c, 1);
 		// move value
 		memcpy(&c->r[reg1], &c->r[reg2], 8);
 		// avoid reading args as opcodes
@@ -140,7 +350,7 @@ public:
 	static void _push(RegVM::Context* c)
 	{
 		// read arg
-		u64 regcode = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
+		u64 regcode = RegOperand(c, 0);
 		// grow stack
 		c->r[reg::SP] -= 8;
 		// place value on stack
@@ -154,6 +364,7 @@ public:
 
 	static void _pushf(RegVM::Context* c)
 	{
+		MaterialiseFlags(c);
 		c->r[reg::SP] -= 8;
 		memcpy(&c->mem[c->r[reg::SP]], &c->r[reg::F], 8);
 	}
@@ -174,7 +385,7 @@ public:
 	static void _pop(RegVM::Context* c)
 	{
 		// read arg
-		u64 regcode = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
+		u64 regcode = RegOperand(c, 0);
 #ifndef NDEBUG
 		
 		printf("popping a value into register %llu\n", regcode);
@@ -193,6 +404,7 @@ public:
 	static void _popf(RegVM::Context* c)
 	{
 		memcpy(&c->r[reg::F], &c->mem[c->r[reg::SP]], 8);
+		c->flagsPending = false;
 		c->r[reg::SP] += 8;
 	}
 
@@ -204,8 +416,8 @@ public:
 
 	static void _add(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 r2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 r1 = RegOperand(c, 0);
+		u64 r2 = RegOperand(c, 1);
 		c->r[r1] = c->r[r1] + c->r[r2];
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 16;
@@ -213,8 +425,8 @@ public:
 
 	static void _cmp(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 r2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 r1 = RegOperand(c, 0);
+		u64 r2 = RegOperand(c, 1);
 		i64 res = c->r[r1] - c->r[r2];
 		SetArithmeticFlags(res, c);
 		c->r[reg::IP] += 16;
@@ -225,8 +437,8 @@ public:
 
 	static void _sub(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 r2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 r1 = RegOperand(c, 0);
+		u64 r2 = RegOperand(c, 1);
 		c->r[r1] = c->r[r1] - c->r[r2];
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 16;
@@ -234,8 +446,8 @@ public:
 
 	static void _mul(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 r2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 r1 = RegOperand(c, 0);
+		u64 r2 = RegOperand(c, 1);
 		c->r[r1] = c->r[r1] * c->r[r2];
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 16;
@@ -243,8 +455,8 @@ public:
 
 	static void _div(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 r2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 r1 = RegOperand(c, 0);
+		u64 r2 = RegOperand(c, 1);
 		c->r[r1] = c->r[r1] / c->r[r2];
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 16;
@@ -252,8 +464,8 @@ public:
 
 	static void _mod(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 r2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 r1 = RegOperand(c, 0);
+		u64 r2 = RegOperand(c, 1);
 		c->r[r1] = c->r[r1] % c->r[r2];
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 16;
@@ -262,7 +474,7 @@ public:
 	static void _inc(RegVM::Context* c)
 	{
 		// read arg
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
+		u64 r1 = RegOperand(c, 0);
 		// get value from stack
 		++c->r[r1];
 		SetArithmeticFlags(c->r[r1], c);
@@ -273,7 +485,7 @@ public:
 	static void _dec(RegVM::Context* c)
 	{
 		// read arg
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
+		u64 r1 = RegOperand(c, 0);
 		// get value from stack
 		--c->r[r1];
 		SetArithmeticFlags(c->r[r1], c);
@@ -283,8 +495,8 @@ public:
 
 	static void _and(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 r2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 r1 = RegOperand(c, 0);
+		u64 r2 = RegOperand(c, 1);
 		c->r[r1] = c->r[r1] & c->r[r2];
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 16;
@@ -292,8 +504,8 @@ public:
 
 	static void _or(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 r2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 r1 = RegOperand(c, 0);
+		u64 r2 = RegOperand(c, 1);
 		c->r[r1] = c->r[r1] | c->r[r2];
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 16;
@@ -301,8 +513,8 @@ public:
 
 	static void _xor(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		u64 r2 = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		u64 r1 = RegOperand(c, 0);
+		u64 r2 = RegOperand(c, 1);
 		c->r[r1] = c->r[r1] ^ c->r[r2];
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 16;
@@ -310,7 +522,7 @@ public:
 
 	static void _not(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
+		u64 r1 = RegOperand(c, 0);
 		c->r[r1] = ~c->r[r1];
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 8;
@@ -318,7 +530,7 @@ public:
 
 	static void _shr(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
+		u64 r1 = RegOperand(c, 0);
 		u64 val = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
 		c->r[r1] = c->r[r1] >> val;
 		SetArithmeticFlags(c->r[r1], c);
@@ -327,12 +539,47 @@ public:
 
 	static void _shl(RegVM::Context* c)
 	{
-		u64 r1 = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
+		u64 r1 = RegOperand(c, 0);
 		u64 val = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 8]);
 		c->r[r1] = c->r[r1] << val;
 		SetArithmeticFlags(c->r[r1], c);
 		c->r[reg::IP] += 16;
 	}
+
+	static void _addi(RegVM::Context* c)
+	{
+		u64 r1 = RegOperand(c, 0);
+		i64 val = AsType<i64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		c->r[r1] = c->r[r1] + val;
+		SetArithmeticFlags(c->r[r1], c);
+		c->r[reg::IP] += 16;
+	}
+
+	static void _subi(RegVM::Context* c)
+	{
+		u64 r1 = RegOperand(c, 0);
+		i64 val = AsType<i64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		c->r[r1] = c->r[r1] - val;
+		SetArithmeticFlags(c->r[r1], c);
+		c->r[reg::IP] += 16;
+	}
+
+	static void _cmpi(RegVM::Context* c)
+	{
+		u64 r1 = RegOperand(c, 0);
+		i64 val = AsType<i64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		SetArithmeticFlags(c->r[r1] - val, c);
+		c->r[reg::IP] += 16;
+	}
+
+	static void _andi(RegVM::Context* c)
+	{
+		u64 r1 = RegOperand(c, 0);
+		i64 val = AsType<i64>(c->mem[c->r[reg::IP] + 1 + 8]);
+		c->r[r1] = c->r[r1] & val;
+		SetArithmeticFlags(c->r[r1], c);
+		c->r[reg::IP] += 16;
+	}
 #pragma endregion
 
 #pragma region jumping/calling
@@ -340,10 +587,11 @@ public:
 	{
 		// address of subroutine
 		u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		c->r[reg::IP] += 8;
-		// push ip to stack
+		// push the last byte of the call. IP stays on the call until the
+		// push is done, for a guard page hit to report
+		u64 ret = c->r[reg::IP] + 8;
 		c->r[reg::SP] -= 8;
-		memcpy(&c->mem[AsType<u64>(c->r[reg::SP])], &c->r[reg::IP], 8);
+		memcpy(&c->mem[AsType<u64>(c->r[reg::SP])], &ret, 8);
 		// change ip
 		c->r[reg::IP] = address - 1;
 #ifndef NDEBUG
@@ -353,13 +601,13 @@ public:
 
 	static void _callr(RegVM::Context* c)
 	{
-		u64 reg = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
-		c->r[reg::IP] += 8;
-		// address of subroutine
-		u64 address = AsType<u64>(&c->r[reg]);
-		// push ip to stack
+		u64 reg = RegOperand(c, 0);
+		// push the last byte of the call, as _calli
+		u64 ret = c->r[reg::IP] + 8;
+		// address of subroutine. callr ip reads IP past the operand
+		u64 address = reg == reg::IP ? ret : AsType<u64>(c->r[reg]);
 		c->r[reg::SP] -= 8;
-		memcpy(&c->mem[AsType<u64>(c->r[reg::SP])], &c->r[reg::IP], 8);
+		memcpy(&c->mem[AsType<u64>(c->r[reg::SP])], &ret, 8);
 		// change ip
 		c->r[reg::IP] = address - 1;
 #ifndef NDEBUG
@@ -390,7 +638,7 @@ public:
 	static void _jz(RegVM::Context* c)
 	{
 		// if zero flag set
-		if (GetBit(c->r[reg::F], 0))
+		if (ZeroFlag(c))
 		{
 			u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
 			c->r[reg::IP] = address - 1u;
@@ -407,7 +655,7 @@ public:
 	static void _jnz(RegVM::Context* c)
 	{
 		// if zero flag not set
-		if (!(GetBit(c->r[reg::F], 0)))
+		if (!ZeroFlag(c))
 		{
 			u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
 			c->r[reg::IP] = address - 1u;
@@ -424,7 +672,7 @@ public:
 	static void _jge(RegVM::Context* c)
 	{
 		// if zero flag set OR negative flag not set
-		if (GetBit(c->r[reg::F], 0) || !(GetBit(c->r[reg::F], 1)))
+		if (ZeroFlag(c) || !SignFlag(c))
 		{
 			u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
 			c->r[reg::IP] = address - 1u;
@@ -441,7 +689,7 @@ public:
 	static void _jle(RegVM::Context* c)
 	{
 		// if zero flag set OR negative flag set
-		if (GetBit(c->r[reg::F], 0) || GetBit(c->r[reg::F], 1))
+		if (ZeroFlag(c) || SignFlag(c))
 		{
 			u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
 			c->r[reg::IP] = address - 1u;
@@ -458,7 +706,7 @@ public:
 	static void _jgt(RegVM::Context* c)
 	{
 		// if zero flag not set and negative flag not set
-		if (!(GetBit(c->r[reg::F], 0)) && !(GetBit(c->r[reg::F], 1)))
+		if (!ZeroFlag(c) && !SignFlag(c))
 		{
 			u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
 			c->r[reg::IP] = address - 1u;
@@ -475,7 +723,7 @@ public:
 	static void _jlt(RegVM::Context* c)
 	{
 		// if zero flag not set and negative flag set
-		if (!(GetBit(c->r[reg::F], 0)) && GetBit(c->r[reg::F], 1))
+		if (!ZeroFlag(c) && SignFlag(c))
 		{
 			u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1]);
 			c->r[reg::IP] = address - 1u;
@@ -489,5 +737,45 @@ public:
 		}
 	}
 
+	/* compare and branch: r1, r2 (or an immediate), target.
+	   the compare sets the flags exactly like _cmp */
+	static i64 CompareOperands(RegVM::Context* c, bool immediate)
+	{
+		u64 r1 = RegOperand(c, 0);
+		i64 rhs = immediate ? AsType<i64>(c->mem[c->r[reg::IP] + 1 + 8]) : c->r[RegOperand(c, 1)];
+		i64 res = c->r[r1] - rhs;
+		SetArithmeticFlags(res, c);
+		return res;
+	}
+
+	static void Branch(RegVM::Context* c, bool taken)
+	{
+		if (taken)
+		{
+			u64 address = AsType<u64>(c->mem[c->r[reg::IP] + 1 + 16]);
+			c->r[reg::IP] = address - 1u;
+#ifndef NDEBUG
+			printf("compare and branch to address %llu\n", address);
+#endif
+		}
+		else
+		{
+			c->r[reg::IP] += 24;
+		}
+	}
+
+	static void _cje(RegVM::Context* c) { Branch(c, CompareOperands(c, false) == 0); }
+	static void _cjne(RegVM::Context* c) { Branch(c, CompareOperands(c, false) != 0); }
+	static void _cjgt(RegVM::Context* c) { Branch(c, CompareOperands(c, false) > 0); }
+	static void _cjlt(RegVM::Context* c) { Branch(c, CompareOperands(c, false) < 0); }
+	static void _cjge(RegVM::Context* c) { Branch(c, CompareOperands(c, false) >= 0); }
+	static void _cjle(RegVM::Context* c) { Branch(c, CompareOperands(c, false) <= 0); }
+	static void _cjei(RegVM::Context* c) { Branch(c, CompareOperands(c, true) == 0); }
+	static void _cjnei(RegVM::Context* c) { Branch(c, CompareOperands(c, true) != 0); }
+	static void _cjgti(RegVM::Context* c) { Branch(c, CompareOperands(c, true) > 0); }
+	static void _cjlti(RegVM::Context* c) { Branch(c, CompareOperands(c, true) < 0); }
+	static void _cjgei(RegVM::Context* c) { Branch(c, CompareOperands(c, true) >= 0); }
+	static void _cjlei(RegVM::Context* c) { Branch(c, CompareOperands(c, true) <= 0); }
+
 #pragma endregion
 };
\ No newline at end of file
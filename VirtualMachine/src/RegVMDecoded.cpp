@@ -0,0 +1,563 @@
+#include "RegVM.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+/* DECODED ENGINE
+	LoadProgram walks the program once (using m_opSizeTable) and builds one
+	Decoded entry per instruction, with register operands resolved to
+	pointers into Context::r and jump/call targets resolved to entries.
+	Run then only chases handler pointers.
+
+	IP is not kept up to date while running, only set before each guest
+	memory access so a guard page hit reports it. instructions that name IP or F
+	as an operand (F needs its lazy flags materialised, see RegVM.h), INT, and anything the decoder does not understand run through
+	the normal m_opTable handler instead (DecodedImpl::_generic). jumps and
+	returns that land outside the decoded stream are interpreted one
+	instruction at a time until they get back onto it.
+
+	the decoded stream is built from the program as loaded; programs that
+	overwrite their own code should use one of the other engines.
+
+	SUPERINSTRUCTIONS
+	after decoding, an entry whose handler and the next entry's handler form
+	one of the FUSION_PAIRS gets a fused handler that runs both with a single
+	dispatch. the second entry is left as it is, so jumps into the middle of
+	a pair still land on a plain instruction. every pair is fused unless a
+	profile narrows it down (RegVM::LoadFusionProfile).
+	fusion sites are counted per pair as the program is decoded. how often
+	each superinstruction runs is only counted on request
+	(RegVM::SetFusionCounting), by a second set of fused handlers, so the
+	usual ones do nothing but dispatch.
+*/
+
+using reg = RegVM::reg;
+using op = RegVM::op;
+using Decoded = RegVM::Decoded;
+
+class DecodedImpl
+{
+public:
+	/* find the decoded instruction at address, interpreting until one is reached */
+	static const Decoded* Continue(RegVM::Context* c, u64 address)
+	{
+		for (;;)
+		{
+			const Decoded* d = c->decoded->Lookup(address);
+			if (d) return d;
+			c->r[reg::IP] = address;
+			c->decoded->opTable[c->mem[address]](c);
+			if (!c->running) return nullptr;
+			address = c->r[reg::IP] + 1;
+		}
+	}
+
+	static const Decoded* Jump(RegVM::Context* c, const Decoded* d)
+	{
+		return d->target ? d->target : Continue(c, d->imm);
+	}
+
+#pragma region misc
+	static const Decoded* _generic(RegVM::Context* c, const Decoded* d)
+	{
+		c->r[reg::IP] = d->addr;
+		c->decoded->opTable[c->mem[d->addr]](c);
+		if (!c->running) return nullptr;
+		return Continue(c, c->r[reg::IP] + 1);
+	}
+
+	/* past the last decoded instruction */
+	static const Decoded* _end(RegVM::Context* c, const Decoded* d)
+	{
+		return Continue(c, d->addr);
+	}
+
+	static const Decoded* _halt(RegVM::Context* c, const Decoded* d)
+	{
+		c->r[reg::IP] = d->addr;
+		c->running = false;
+		return nullptr;
+	}
+
+	static const Decoded* _nop(RegVM::Context*, const Decoded* d)
+	{
+		return d + 1;
+	}
+#pragma endregion
+
+#pragma region registers
+	static const Decoded* _clf(RegVM::Context* c, const Decoded* d)
+	{
+		c->r[reg::F] = 0;
+		c->flagsPending = false;
+		return d + 1;
+	}
+
+	static const Decoded* _movi(RegVM::Context*, const Decoded* d)
+	{
+		*d->r1 = d->imm;
+		return d + 1;
+	}
+
+	static const Decoded* _movf(RegVM::Context* c, const Decoded* d)
+	{
+		c->r[reg::IP] = d->addr;
+		memcpy(d->r1, &c->mem[d->imm], 8);
+		return d + 1;
+	}
+
+	static const Decoded* _movt(RegVM::Context* c, const Decoded* d)
+	{
+		c->r[reg::IP] = d->addr;
+		memcpy(&c->mem[d->imm], d->r1, 8);
+		return d + 1;
+	}
+
+	static const Decoded* _mov(RegVM::Context*, const Decoded* d)
+	{
+		*d->r1 = *d->r2;
+		return d + 1;
+	}
+
+	static const Decoded* _push(RegVM::Context* c, const Decoded* d)
+	{
+		c->r[reg::IP] = d->addr;
+		c->r[reg::SP] -= 8;
+		memcpy(&c->mem[c->r[reg::SP]], d->r1, 8);
+		return d + 1;
+	}
+
+	static const Decoded* _pushf(RegVM::Context* c, const Decoded* d)
+	{
+		MaterialiseFlags(c);
+		c->r[reg::IP] = d->addr;
+		c->r[reg::SP] -= 8;
+		memcpy(&c->mem[c->r[reg::SP]], &c->r[reg::F], 8);
+		return d + 1;
+	}
+
+	static const Decoded* _pushi(RegVM::Context* c, const Decoded* d)
+	{
+		c->r[reg::IP] = d->addr;
+		c->r[reg::SP] -= 8;
+		memcpy(&c->mem[c->r[reg::SP]], &d->imm, 8);
+		return d + 1;
+	}
+
+	static const Decoded* _pop(RegVM::Context* c, const Decoded* d)
+	{
+		c->r[reg::IP] = d->addr;
+		memcpy(d->r1, &c->mem[c->r[reg::SP]], 8);
+		c->r[reg::SP] += 8;
+		return d + 1;
+	}
+
+	static const Decoded* _popf(RegVM::Context* c, const Decoded* d)
+	{
+		c->r[reg::IP] = d->addr;
+		memcpy(&c->r[reg::F], &c->mem[c->r[reg::SP]], 8);
+		c->flagsPending = false;
+		c->r[reg::SP] += 8;
+		return d + 1;
+	}
+#pragma endregion
+
+#pragma region arithmetic
+#define ARITH(name, expr) \
+	static const Decoded* name(RegVM::Context* c, const Decoded* d) \
+	{ \
+		*d->r1 = (expr); \
+		SetArithmeticFlags(*d->r1, c); \
+		return d + 1; \
+	}
+
+	ARITH(_add, *d->r1 + *d->r2)
+	ARITH(_sub, *d->r1 - *d->r2)
+	ARITH(_mul, *d->r1 * *d->r2)
+	ARITH(_div, *d->r1 / *d->r2)
+	ARITH(_mod, *d->r1 % *d->r2)
+	ARITH(_and, *d->r1 & *d->r2)
+	ARITH(_or, *d->r1 | *d->r2)
+	ARITH(_xor, *d->r1 ^ *d->r2)
+	ARITH(_inc, *d->r1 + 1)
+	ARITH(_dec, *d->r1 - 1)
+	ARITH(_not, ~*d->r1)
+	ARITH(_shr, *d->r1 >> d->imm)
+	ARITH(_shl, *d->r1 << d->imm)
+	ARITH(_addi, *d->r1 + d->imm)
+	ARITH(_subi, *d->r1 - d->imm)
+	ARITH(_andi, *d->r1 & d->imm)
+#undef ARITH
+
+	static const Decoded* _cmp(RegVM::Context* c, const Decoded* d)
+	{
+		SetArithmeticFlags(*d->r1 - *d->r2, c);
+		return d + 1;
+	}
+
+	static const Decoded* _cmpi(RegVM::Context* c, const Decoded* d)
+	{
+		SetArithmeticFlags(*d->r1 - d->imm, c);
+		return d + 1;
+	}
+#pragma endregion
+
+#pragma region jumping/calling
+	static const Decoded* _calli(RegVM::Context* c, const Decoded* d)
+	{
+		// same return address as OpImpl::_calli: last byte of the call
+		u64 ret = d->addr + 8;
+		c->r[reg::IP] = d->addr;
+		c->r[reg::SP] -= 8;
+		memcpy(&c->mem[c->r[reg::SP]], &ret, 8);
+		return Jump(c, d);
+	}
+
+	static const Decoded* _callr(RegVM::Context* c, const Decoded* d)
+	{
+		u64 ret = d->addr + 8;
+		u64 address = *d->r1;
+		c->r[reg::IP] = d->addr;
+		c->r[reg::SP] -= 8;
+		memcpy(&c->mem[c->r[reg::SP]], &ret, 8);
+		return Continue(c, address);
+	}
+
+	static const Decoded* _ret(RegVM::Context* c, const Decoded* d)
+	{
+		u64 address;
+		c->r[reg::IP] = d->addr;
+		memcpy(&address, &c->mem[c->r[reg::SP]], 8);
+		c->r[reg::SP] += 8;
+		return Continue(c, address + 1);
+	}
+
+#define JUMP_IF(name, cond) \
+	static const Decoded* name(RegVM::Context* c, const Decoded* d) \
+	{ \
+		return (cond) ? Jump(c, d) : d + 1; \
+	}
+
+	JUMP_IF(_jmp, true)
+	JUMP_IF(_jz, ZeroFlag(c))
+	JUMP_IF(_jnz, !ZeroFlag(c))
+	JUMP_IF(_jge, ZeroFlag(c) || !SignFlag(c))
+	JUMP_IF(_jle, ZeroFlag(c) || SignFlag(c))
+	JUMP_IF(_jgt, !ZeroFlag(c) && !SignFlag(c))
+	JUMP_IF(_jlt, !ZeroFlag(c) && SignFlag(c))
+#undef JUMP_IF
+
+	/* compare and branch. the register form keeps the target address in imm,
+	   the immediate form needs a resolved target (Decode checks) */
+#define CMP_BRANCH(name, rhs, cond) \
+	static const Decoded* name(RegVM::Context* c, const Decoded* d) \
+	{ \
+		const i64 v = *d->r1 - (rhs); \
+		SetArithmeticFlags(v, c); \
+		return (cond) ? Jump(c, d) : d + 1; \
+	}
+
+	CMP_BRANCH(_cje, *d->r2, v == 0)
+	CMP_BRANCH(_cjne, *d->r2, v != 0)
+	CMP_BRANCH(_cjgt, *d->r2, v > 0)
+	CMP_BRANCH(_cjlt, *d->r2, v < 0)
+	CMP_BRANCH(_cjge, *d->r2, v >= 0)
+	CMP_BRANCH(_cjle, *d->r2, v <= 0)
+	CMP_BRANCH(_cjei, d->imm, v == 0)
+	CMP_BRANCH(_cjnei, d->imm, v != 0)
+	CMP_BRANCH(_cjgti, d->imm, v > 0)
+	CMP_BRANCH(_cjlti, d->imm, v < 0)
+	CMP_BRANCH(_cjgei, d->imm, v >= 0)
+	CMP_BRANCH(_cjlei, d->imm, v <= 0)
+#undef CMP_BRANCH
+#pragma endregion
+};
+
+/* candidate pairs, as DecodedImpl handlers. the first of each pair must
+   always continue with the next entry */
+#define FUSION_PAIRS(X) \
+	X(_cmp, _jz) X(_cmp, _jnz) X(_cmp, _jge) X(_cmp, _jle) X(_cmp, _jgt) X(_cmp, _jlt) \
+	X(_dec, _jnz) X(_dec, _jz) X(_dec, _jgt) X(_inc, _jnz) X(_sub, _jnz) X(_sub, _jz) \
+	X(_and, _jz) X(_and, _jnz) \
+	X(_push, _push) X(_pop, _pop) X(_push, _pop) X(_push, _calli) X(_pushi, _calli) X(_pop, _ret) \
+	X(_movi, _movi) X(_mov, _ret)
+
+namespace
+{
+	enum FusionPair
+	{
+#define X(a, b) FUSE##a##b,
+		FUSION_PAIRS(X)
+#undef X
+		FUSION_COUNT
+	};
+
+	template<RegVM::decodedHandler A, RegVM::decodedHandler B, int ID, bool Counted>
+	const Decoded* Fused(RegVM::Context* c, const Decoded* d)
+	{
+		if (Counted)
+			c->decoded->fusedHits[ID]++;
+		A(c, d);
+		return B(c, d + 1);
+	}
+
+	struct Fusion
+	{
+		const char* first;		// handler names, without the leading '_'
+		const char* second;
+		RegVM::decodedHandler a;
+		RegVM::decodedHandler b;
+		RegVM::decodedHandler fused;
+		RegVM::decodedHandler counted;	// fused, counting its runs
+	};
+
+	const Fusion s_fusion[FUSION_COUNT] =
+	{
+#define X(a, b) { #a + 1, #b + 1, DecodedImpl::a, DecodedImpl::b, \
+	Fused<DecodedImpl::a, DecodedImpl::b, FUSE##a##b, false>, Fused<DecodedImpl::a, DecodedImpl::b, FUSE##a##b, true> },
+		FUSION_PAIRS(X)
+#undef X
+	};
+}
+
+bool RegVM::LoadFusionProfile(const char* path)
+{
+	std::ifstream file(path);
+	if (!file.is_open())
+	{
+		printf("error opening fusion profile [%s]\n", path);
+		return false;
+	}
+	std::vector<bool> enabled(FUSION_COUNT, false);
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::istringstream words(line);
+		std::string first, second;
+		if (!(words >> first) || first[0] == '#')
+			continue;
+		words >> second;
+		int i = 0;
+		while (i < FUSION_COUNT && (first != s_fusion[i].first || second != s_fusion[i].second))
+			++i;
+		if (i == FUSION_COUNT)
+		{
+			printf("error: unknown fusion pair [%s %s]\n", first.c_str(), second.c_str());
+			return false;
+		}
+		enabled[i] = true;
+	}
+	m_fusion = enabled;
+	return true;
+}
+
+void RegVM::PrintFusionStats()
+{
+	printf("FUSION:\n------------\n"
+		"superinstructions:\t%zu\n",
+		m_decoded.fusedSites);
+	// per pair, in the "first second" format LoadFusionProfile reads: runs
+	// if they were counted, sites otherwise
+	const std::vector<u64>& counts = m_countFusion ? m_decoded.fusedHits : m_decoded.fusedPairSites;
+	if (m_countFusion)
+	{
+		u64 saved = 0;
+		for (u64 hits : m_decoded.fusedHits)
+			saved += hits;
+		printf("dispatches saved:\t%llu\n", saved);
+	}
+	printf("pair\t\t%s\n", m_countFusion ? "runs" : "sites");
+	for (int i = 0; i < FUSION_COUNT && i < (int)counts.size(); ++i)
+		if (counts[i])
+			printf("%s %s\t%llu\n", s_fusion[i].first, s_fusion[i].second, counts[i]);
+}
+
+/* configure decoded handler table. anything left as _generic runs through m_opTable */
+void RegVM::ConfigureDecoded()
+{
+	for (int i = 0; i < 256; i++)
+		m_decodedTable[i] = DecodedImpl::_generic;
+	/* miscellaneous */
+	m_decodedTable[op::HALT ] = DecodedImpl::_halt;
+	m_decodedTable[op::NOP  ] = DecodedImpl::_nop;
+	/* registers */
+	m_decodedTable[op::CLF  ] = DecodedImpl::_clf;
+	m_decodedTable[op::MOVI ] = DecodedImpl::_movi;
+	m_decodedTable[op::MOVF ] = DecodedImpl::_movf;
+	m_decodedTable[op::MOVT ] = DecodedImpl::_movt;
+	m_decodedTable[op::MOV  ] = DecodedImpl::_mov;
+	m_decodedTable[op::PUSH ] = DecodedImpl::_push;
+	m_decodedTable[op::PUSHF] = DecodedImpl::_pushf;
+	m_decodedTable[op::PUSHI] = DecodedImpl::_pushi;
+	m_decodedTable[op::POP  ] = DecodedImpl::_pop;
+	m_decodedTable[op::POPF ] = DecodedImpl::_popf;
+	/* arithmetic */
+	m_decodedTable[op::ADD] = DecodedImpl::_add;
+	m_decodedTable[op::SUB] = DecodedImpl::_sub;
+	m_decodedTable[op::CMP] = DecodedImpl::_cmp;
+	m_decodedTable[op::MUL] = DecodedImpl::_mul;
+	m_decodedTable[op::DIV] = DecodedImpl::_div;
+	m_decodedTable[op::MOD] = DecodedImpl::_mod;
+	m_decodedTable[op::INC] = DecodedImpl::_inc;
+	m_decodedTable[op::DEC] = DecodedImpl::_dec;
+	m_decodedTable[op::AND] = DecodedImpl::_and;
+	m_decodedTable[op::OR ] = DecodedImpl::_or;
+	m_decodedTable[op::XOR] = DecodedImpl::_xor;
+	m_decodedTable[op::NOT] = DecodedImpl::_not;
+	m_decodedTable[op::SHL] = DecodedImpl::_shl;
+	m_decodedTable[op::SHR] = DecodedImpl::_shr;
+	m_decodedTable[op::ADDI] = DecodedImpl::_addi;
+	m_decodedTable[op::SUBI] = DecodedImpl::_subi;
+	m_decodedTable[op::CMPI] = DecodedImpl::_cmpi;
+	m_decodedTable[op::ANDI] = DecodedImpl::_andi;
+	/* jumping/calling */
+	m_decodedTable[op::CALLI] = DecodedImpl::_calli;
+	m_decodedTable[op::CALLR] = DecodedImpl::_callr;
+	m_decodedTable[op::RET  ] = DecodedImpl::_ret;
+	m_decodedTable[op::JMP  ] = DecodedImpl::_jmp;
+	m_decodedTable[op::JZ   ] = DecodedImpl::_jz;
+	m_decodedTable[op::JNZ  ] = DecodedImpl::_jnz;
+	m_decodedTable[op::JE   ] = DecodedImpl::_jz;
+	m_decodedTable[op::JNE  ] = DecodedImpl::_jnz;
+	m_decodedTable[op::JGT  ] = DecodedImpl::_jgt;
+	m_decodedTable[op::JLT  ] = DecodedImpl::_jlt;
+	m_decodedTable[op::JLE  ] = DecodedImpl::_jle;
+	m_decodedTable[op::JGE  ] = DecodedImpl::_jge;
+	m_decodedTable[op::CJE  ] = DecodedImpl::_cje;
+	m_decodedTable[op::CJNE ] = DecodedImpl::_cjne;
+	m_decodedTable[op::CJGT ] = DecodedImpl::_cjgt;
+	m_decodedTable[op::CJLT ] = DecodedImpl::_cjlt;
+	m_decodedTable[op::CJGE ] = DecodedImpl::_cjge;
+	m_decodedTable[op::CJLE ] = DecodedImpl::_cjle;
+	m_decodedTable[op::CJEI ] = DecodedImpl::_cjei;
+	m_decodedTable[op::CJNEI] = DecodedImpl::_cjnei;
+	m_decodedTable[op::CJGTI] = DecodedImpl::_cjgti;
+	m_decodedTable[op::CJLTI] = DecodedImpl::_cjlti;
+	m_decodedTable[op::CJGEI] = DecodedImpl::_cjgei;
+	m_decodedTable[op::CJLEI] = DecodedImpl::_cjlei;
+	/* superinstructions */
+	m_fusion.assign(FUSION_COUNT, true);
+}
+
+/* build m_decoded from the first size bytes of guest memory */
+void RegVM::Decode(size_t size)
+{
+	const byte* mem = m_context.mem;
+	m_decoded.code.clear();
+	m_decoded.index.assign(size, DecodedProgram::NO_ENTRY);
+	m_decoded.opTable = m_opTable;
+	m_context.decoded = &m_decoded;
+
+	// first pass: instruction boundaries
+	for (u64 addr = 0; addr < size; addr += GetInstructionSize(mem[addr]))
+	{
+		m_decoded.index[addr] = static_cast<u32>(m_decoded.code.size());
+		Decoded d;
+		d.addr = addr;
+		m_decoded.code.push_back(d);
+	}
+	// sentinel for falling off the end of the program
+	Decoded end;
+	end.handler = DecodedImpl::_end;
+	end.addr = m_decoded.code.empty() ? 0 : m_decoded.code.back().addr + GetInstructionSize(mem[m_decoded.code.back().addr]);
+	m_decoded.code.push_back(end);
+
+	// second pass: operands
+	auto resolveReg = [this](u64 regcode) -> i64*
+	{
+		// IP is not maintained by this engine, F may be stale
+		return regcode < reg::REG_END && regcode != reg::IP && regcode != reg::F ? &m_context.r[regcode] : nullptr;
+	};
+	for (size_t i = 0; i + 1 < m_decoded.code.size(); ++i)
+	{
+		Decoded& d = m_decoded.code[i];
+		const byte opcode = mem[d.addr];
+		const u64 arg0 = d.addr + 1 + 8 <= size ? AsType<u64>(mem[d.addr + 1]) : 0;
+		const u64 arg1 = d.addr + 1 + 16 <= size ? AsType<u64>(mem[d.addr + 1 + 8]) : 0;
+		const u64 arg2 = d.addr + 1 + 24 <= size ? AsType<u64>(mem[d.addr + 1 + 16]) : 0;
+		d.handler = m_decodedTable[opcode];
+		bool ok = d.addr + GetInstructionSize(opcode) <= size;
+		switch (opcode)
+		{
+		case op::MOV: case op::CMP:
+		case op::ADD: case op::SUB: case op::MUL: case op::DIV: case op::MOD:
+		case op::AND: case op::OR: case op::XOR:
+			d.r1 = resolveReg(arg0);
+			d.r2 = resolveReg(arg1);
+			ok = ok && d.r1 && d.r2;
+			break;
+		case op::MOVI: case op::MOVF: case op::SHL: case op::SHR:
+		case op::ADDI: case op::SUBI: case op::CMPI: case op::ANDI:
+			d.r1 = resolveReg(arg0);
+			d.imm = arg1;
+			ok = ok && d.r1;
+			break;
+		case op::MOVT:
+			d.imm = arg0;
+			d.r1 = resolveReg(arg1);
+			ok = ok && d.r1;
+			break;
+		case op::PUSH: case op::POP: case op::INC: case op::DEC: case op::NOT: case op::CALLR:
+			d.r1 = resolveReg(arg0);
+			ok = ok && d.r1;
+			break;
+		case op::PUSHI:
+			d.imm = arg0;
+			break;
+		case op::CALLI: case op::JMP:
+		case op::JZ: case op::JNZ: case op::JE: case op::JNE:
+		case op::JGT: case op::JLT: case op::JLE: case op::JGE:
+			d.imm = arg0;
+			d.target = m_decoded.Lookup(arg0);
+			break;
+		case op::CJE: case op::CJNE: case op::CJGT: case op::CJLT: case op::CJGE: case op::CJLE:
+			d.r1 = resolveReg(arg0);
+			d.r2 = resolveReg(arg1);
+			d.imm = arg2;
+			d.target = m_decoded.Lookup(arg2);
+			ok = ok && d.r1 && d.r2;
+			break;
+		case op::CJEI: case op::CJNEI: case op::CJGTI: case op::CJLTI: case op::CJGEI: case op::CJLEI:
+			d.r1 = resolveReg(arg0);
+			d.imm = arg1;
+			d.target = m_decoded.Lookup(arg2);
+			ok = ok && d.r1 && d.target;
+			break;
+		default:
+			break;
+		}
+		if (!ok)
+			d.handler = DecodedImpl::_generic;
+	}
+
+	// third pass: superinstructions. code[i + 1] still has its plain handler here
+	m_decoded.fusedSites = 0;
+	m_decoded.fusedPairSites.assign(FUSION_COUNT, 0);
+	m_decoded.fusedHits.assign(FUSION_COUNT, 0);
+	for (size_t i = 0; i + 2 < m_decoded.code.size(); ++i)
+	{
+		Decoded& d = m_decoded.code[i];
+		const Decoded& n = m_decoded.code[i + 1];
+		for (int f = 0; f < FUSION_COUNT; ++f)
+		{
+			if (m_fusion[f] && d.handler == s_fusion[f].a && n.handler == s_fusion[f].b)
+			{
+				d.handler = m_countFusion ? s_fusion[f].counted : s_fusion[f].fused;
+				m_decoded.fusedSites++;
+				m_decoded.fusedPairSites[f]++;
+				break;
+			}
+		}
+	}
+}
+
+void RegVM::RunDecoded()
+{
+	if (!m_context.decoded)
+		Decode(0);
+	m_context.running = true;
+	const Decoded* d = DecodedImpl::Continue(&m_context, m_context.r[reg::IP] + 1);
+	while (d)
+		d = d->handler(&m_context, d);
+}
@@ -0,0 +1,235 @@
+#include "RegVM.h"
+
+/* THREADED ENGINE
+	IP, SP and F (plus the lazy flag state, res/pending) are kept in host
+	locals instead of Context and each handler jumps straight to the next one. dispatch technique by compiler:
+		gcc/clang:			computed goto (labels as values)
+		clang-cl:			[[clang::musttail]] tail-call chain
+		anything else:		switch in a loop
+	instructions that name IP/SP/F as an operand, and INT, are handed to the
+	m_opTable handler with the locals written back (see SLOW()).
+	every variant is instantiated twice: unmetered, and metered, where NEXT()
+	also counts down the fuel left for RegVM::Run(budget) and stops with the
+	Context ready to resume once it runs out.
+*/
+
+#if defined(__GNUC__)
+#define REGVM_COMPUTED_GOTO
+#elif defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define REGVM_MUSTTAIL
+#endif
+#endif
+
+#define THREADED_OPS(X) \
+	X(HALT) X(NOP) X(INT) \
+	X(CLF) X(MOVI) X(MOVF) X(MOVT) X(MOV) X(PUSH) X(PUSHF) X(PUSHI) X(POP) X(POPF) \
+	X(ADD) X(SUB) X(MUL) X(DIV) X(MOD) X(AND) X(OR) X(XOR) X(INC) X(DEC) X(NOT) X(SHR) X(SHL) X(CMP) \
+	X(CALLI) X(CALLR) X(RET) X(JMP) X(JZ) X(JE) X(JNZ) X(JNE) X(JGE) X(JLE) X(JGT) X(JLT) \
+	X(ADDI) X(SUBI) X(CMPI) X(ANDI) \
+	X(CJE) X(CJNE) X(CJGT) X(CJLT) X(CJGE) X(CJLE) \
+	X(CJEI) X(CJNEI) X(CJGTI) X(CJLTI) X(CJGEI) X(CJLEI)
+
+#define SYNC() { r[reg::IP] = ip; r[reg::SP] = sp; r[reg::F] = f; c->flagResult = res; c->flagsPending = pending; }
+// out of fuel before the instruction at ip. IP is left one before it, as if it had just been reached
+#define OUT_OF_FUEL() { SYNC(); r[reg::IP] = ip - 1; return; }
+#define RELOAD() { sp = r[reg::SP]; f = r[reg::F]; res = c->flagResult; pending = c->flagsPending; }
+
+namespace
+{
+	using reg = RegVM::reg;
+	using op = RegVM::op;
+
+	inline i64 ArithmeticFlags(i64 f, i64 value)
+	{
+		f = SetBit(f, 0, value == 0); // zero flag
+		f = SetBit(f, 1, value < 0);  // sign flag
+		return f;
+	}
+}
+
+#if defined(REGVM_COMPUTED_GOTO)
+
+template<bool Metered>
+void RegVM::RunThreaded(u64 budget)
+{
+	Context* const c = &m_context;
+	const opHandler* const t = m_opTable;
+	i64* const r = c->r;
+	byte* const mem = c->mem;
+	u64 ip = r[reg::IP] + 1;
+	u64 fuel = budget + 1;
+	i64 sp = r[reg::SP];
+	i64 f = r[reg::F];
+	i64 res = c->flagResult;
+	bool pending = c->flagsPending;
+
+	/* invalid opcodes behave like NOP, same as m_opTable */
+	void* labels[256];
+	for (int i = 0; i < 256; i++)
+		labels[i] = &&L_NOP;
+#define X(name) labels[op::name] = &&L_##name;
+	THREADED_OPS(X)
+#undef X
+
+#define HANDLER(name) L_##name: {
+#define END_HANDLER }
+#define NEXT() { if (Metered && --fuel == 0) goto out; goto *labels[mem[ip]]; }
+#define SLOW() goto slow
+#define EXIT() return
+
+	c->running = true;
+	NEXT();
+
+#include "RegVMThreaded.inl"
+
+out:
+	OUT_OF_FUEL();
+
+slow:
+	SYNC();
+	t[mem[ip]](c);
+	RELOAD();
+	if (!c->running) EXIT();
+	ip = r[reg::IP] + 1;
+	NEXT();
+
+#undef HANDLER
+#undef END_HANDLER
+#undef NEXT
+#undef SLOW
+#undef EXIT
+}
+
+#elif defined(REGVM_MUSTTAIL)
+
+namespace
+{
+	using Context = RegVM::Context;
+	using opHandler = RegVM::opHandler;
+
+#define TAIL_PARAMS Context* c, const opHandler* t, byte* mem, u64 ip, i64 sp, i64 f, i64 res, bool pending, u64 fuel
+#define TAIL_ARGS c, t, mem, ip, sp, f, res, pending, fuel
+	typedef void(*tailHandler)(TAIL_PARAMS);
+
+#define X(name) template<bool Metered> void T_##name(TAIL_PARAMS);
+	THREADED_OPS(X)
+#undef X
+	template<bool Metered> void T_SLOW(TAIL_PARAMS);
+
+	/* invalid opcodes behave like NOP, same as m_opTable. built at compile
+	   time, so VMs running on several threads share it without a race */
+	template<bool Metered>
+	struct TailTable
+	{
+		tailHandler handlers[256];
+		constexpr TailTable() : handlers()
+		{
+			for (int i = 0; i < 256; i++)
+				handlers[i] = T_NOP<Metered>;
+#define X(name) handlers[op::name] = T_##name<Metered>;
+			THREADED_OPS(X)
+#undef X
+		}
+	};
+	template<bool Metered>
+	constexpr TailTable<Metered> TAIL_TABLE;
+
+	void T_OUT(TAIL_PARAMS)
+	{
+		i64* const r = c->r;
+		OUT_OF_FUEL();
+	}
+
+#define HANDLER(name) template<bool Metered> void T_##name(TAIL_PARAMS) { i64* const r = c->r;
+#define END_HANDLER }
+#define NEXT() { \
+	if (Metered && --fuel == 0) [[clang::musttail]] return T_OUT(TAIL_ARGS); \
+	[[clang::musttail]] return TAIL_TABLE<Metered>.handlers[mem[ip]](TAIL_ARGS); }
+#define SLOW() [[clang::musttail]] return T_SLOW<Metered>(TAIL_ARGS)
+#define EXIT() return
+
+#include "RegVMThreaded.inl"
+
+	template<bool Metered>
+	void T_SLOW(TAIL_PARAMS)
+	{
+		i64* const r = c->r;
+		SYNC();
+		t[mem[ip]](c);
+		RELOAD();
+		if (!c->running) EXIT();
+		ip = r[reg::IP] + 1;
+		NEXT();
+	}
+
+#undef HANDLER
+#undef END_HANDLER
+#undef NEXT
+#undef SLOW
+#undef EXIT
+}
+
+template<bool Metered>
+void RegVM::RunThreaded(u64 budget)
+{
+	m_context.running = true;
+	if (Metered && budget == 0) return;
+	const u64 ip = m_context.r[reg::IP] + 1;
+	TAIL_TABLE<Metered>.handlers[m_context.mem[ip]](&m_context, m_opTable, m_context.mem, ip,
+		m_context.r[reg::SP], m_context.r[reg::F], m_context.flagResult, m_context.flagsPending, budget);
+}
+
+#else
+
+template<bool Metered>
+void RegVM::RunThreaded(u64 budget)
+{
+	Context* const c = &m_context;
+	const opHandler* const t = m_opTable;
+	i64* const r = c->r;
+	byte* const mem = c->mem;
+	u64 ip = r[reg::IP] + 1;
+	u64 fuel = budget + 1;
+	i64 sp = r[reg::SP];
+	i64 f = r[reg::F];
+	i64 res = c->flagResult;
+	bool pending = c->flagsPending;
+
+#define HANDLER(name) case op::name: {
+#define END_HANDLER }
+#define NEXT() continue
+#define SLOW() goto slow
+#define EXIT() return
+
+	c->running = true;
+	for (;;)
+	{
+		if (Metered && --fuel == 0)
+			OUT_OF_FUEL();
+		switch (mem[ip])
+		{
+#include "RegVMThreaded.inl"
+		default:
+			ip += 1;
+			continue;
+		}
+	slow:
+		SYNC();
+		t[mem[ip]](c);
+		RELOAD();
+		if (!c->running) EXIT();
+		ip = r[reg::IP] + 1;
+	}
+
+#undef HANDLER
+#undef END_HANDLER
+#undef NEXT
+#undef SLOW
+#undef EXIT
+}
+
+#endif
+
+template void RegVM::RunThreaded<false>(u64);
+template void RegVM::RunThreaded<true>(u64);
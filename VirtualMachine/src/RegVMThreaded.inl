@@ -0,0 +1,302 @@
+/* handler bodies for the threaded RegVM engine.
+	included by RegVMThreaded.cpp, which defines the macros below
+	differently for each dispatch technique:
+		HANDLER(op) / END_HANDLER	open/close the handler for opcode op
+		NEXT()						dispatch the instruction at ip
+		SLOW()						run the current instruction through m_opTable
+		EXIT()						stop execution
+	state available to every handler:
+		c		context
+		r		register file (only the general purpose registers are live in here)
+		mem		guest memory
+		ip		address of the current opcode
+		sp, f	stack pointer and flags register
+		res		last flag-setting result
+		pending	zero/sign bits of f are stale, derive them from res
+*/
+
+#define ARG(n) AsType<u64>(mem[ip + 1 + 8 * (n)])
+// IP/SP/F live in locals, so any instruction naming them goes the slow way
+#define GPR(x) { if (!VMs::Reg::IsGPR(x)) SLOW(); }
+// before each guest memory access, so a guard page hit leaves IP, SP and
+// the flags exactly where the guest stopped
+#define FAULT_POINT() SYNC()
+
+#define FLAGS(v) { res = (v); pending = true; }
+#define ARITH_2(expr) { \
+	u64 r1 = ARG(0); u64 r2 = ARG(1); GPR(r1); GPR(r2); \
+	r[r1] = (expr); FLAGS(r[r1]); ip += 17; NEXT(); }
+#define ARITH_1(expr) { \
+	u64 r1 = ARG(0); GPR(r1); \
+	r[r1] = (expr); FLAGS(r[r1]); ip += 9; NEXT(); }
+#define SHIFT(expr) { \
+	u64 r1 = ARG(0); u64 val = ARG(1); GPR(r1); \
+	r[r1] = (expr); FLAGS(r[r1]); ip += 17; NEXT(); }
+#define ARITH_I(expr) { \
+	u64 r1 = ARG(0); i64 val = ARG(1); GPR(r1); \
+	r[r1] = (expr); FLAGS(r[r1]); ip += 17; NEXT(); }
+#define JUMP_IF(cond) { \
+	if (cond) ip = ARG(0); else ip += 9; NEXT(); }
+// compare and branch, v is the compare result
+#define CMP_BRANCH(cond) { \
+	u64 r1 = ARG(0); u64 r2 = ARG(1); GPR(r1); GPR(r2); \
+	i64 v = r[r1] - r[r2]; FLAGS(v); if (cond) ip = ARG(2); else ip += 25; NEXT(); }
+#define CMP_BRANCH_I(cond) { \
+	u64 r1 = ARG(0); GPR(r1); \
+	i64 v = r[r1] - (i64)ARG(1); FLAGS(v); if (cond) ip = ARG(2); else ip += 25; NEXT(); }
+
+#define ZF (pending ? res == 0 : GetBit(f, 0))
+#define SF (pending ? res < 0 : GetBit(f, 1))
+
+/* miscellaneous */
+HANDLER(HALT)
+{
+	c->running = false;
+	SYNC();
+	EXIT();
+}
+END_HANDLER
+
+HANDLER(NOP)
+{
+	ip += 1;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(INT)
+{
+	SLOW();
+}
+END_HANDLER
+
+/* registers */
+HANDLER(CLF)
+{
+	f = 0;
+	pending = false;
+	ip += 1;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(MOVI)
+{
+	u64 r1 = ARG(0);
+	GPR(r1);
+	memcpy(&r[r1], &mem[ip + 1 + 8], 8);
+	ip += 17;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(MOVF)
+{
+	u64 r1 = ARG(0);
+	u64 address = ARG(1);
+	GPR(r1);
+	FAULT_POINT();
+	memcpy(&r[r1], &mem[address], 8);
+	ip += 17;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(MOVT)
+{
+	u64 address = ARG(0);
+	u64 r1 = ARG(1);
+	GPR(r1);
+	FAULT_POINT();
+	memcpy(&mem[address], &r[r1], 8);
+	ip += 17;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(MOV)
+{
+	u64 r1 = ARG(0);
+	u64 r2 = ARG(1);
+	GPR(r1);
+	GPR(r2);
+	r[r1] = r[r2];
+	ip += 17;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(PUSH)
+{
+	u64 r1 = ARG(0);
+	GPR(r1);
+	sp -= 8;
+	FAULT_POINT();
+	memcpy(&mem[sp], &r[r1], 8);
+	ip += 9;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(PUSHF)
+{
+	if (pending)
+	{
+		f = ArithmeticFlags(f, res);
+		pending = false;
+	}
+	sp -= 8;
+	FAULT_POINT();
+	memcpy(&mem[sp], &f, 8);
+	ip += 1;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(PUSHI)
+{
+	sp -= 8;
+	FAULT_POINT();
+	memcpy(&mem[sp], &mem[ip + 1], 8);
+	ip += 9;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(POP)
+{
+	u64 r1 = ARG(0);
+	GPR(r1);
+	FAULT_POINT();
+	memcpy(&r[r1], &mem[sp], 8);
+	sp += 8;
+	ip += 9;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(POPF)
+{
+	FAULT_POINT();
+	memcpy(&f, &mem[sp], 8);
+	pending = false;
+	sp += 8;
+	ip += 1;
+	NEXT();
+}
+END_HANDLER
+
+/* arithmetic */
+HANDLER(ADD) ARITH_2(r[r1] + r[r2]) END_HANDLER
+HANDLER(SUB) ARITH_2(r[r1] - r[r2]) END_HANDLER
+HANDLER(MUL) ARITH_2(r[r1] * r[r2]) END_HANDLER
+HANDLER(DIV) ARITH_2(r[r1] / r[r2]) END_HANDLER
+HANDLER(MOD) ARITH_2(r[r1] % r[r2]) END_HANDLER
+HANDLER(AND) ARITH_2(r[r1] & r[r2]) END_HANDLER
+HANDLER(OR ) ARITH_2(r[r1] | r[r2]) END_HANDLER
+HANDLER(XOR) ARITH_2(r[r1] ^ r[r2]) END_HANDLER
+HANDLER(INC) ARITH_1(r[r1] + 1) END_HANDLER
+HANDLER(DEC) ARITH_1(r[r1] - 1) END_HANDLER
+HANDLER(NOT) ARITH_1(~r[r1]) END_HANDLER
+HANDLER(SHR) SHIFT(r[r1] >> val) END_HANDLER
+HANDLER(SHL) SHIFT(r[r1] << val) END_HANDLER
+HANDLER(ADDI) ARITH_I(r[r1] + val) END_HANDLER
+HANDLER(SUBI) ARITH_I(r[r1] - val) END_HANDLER
+HANDLER(ANDI) ARITH_I(r[r1] & val) END_HANDLER
+
+HANDLER(CMPI)
+{
+	u64 r1 = ARG(0);
+	GPR(r1);
+	FLAGS(r[r1] - (i64)ARG(1));
+	ip += 17;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(CMP)
+{
+	u64 r1 = ARG(0);
+	u64 r2 = ARG(1);
+	GPR(r1);
+	GPR(r2);
+	FLAGS(r[r1] - r[r2]);
+	ip += 17;
+	NEXT();
+}
+END_HANDLER
+
+/* jumping/calling
+	the return address pushed is the last byte of the call, matching
+	OpImpl::_calli, so both engines can share a guest stack */
+HANDLER(CALLI)
+{
+	u64 address = ARG(0);
+	u64 ret = ip + 8;
+	sp -= 8;
+	FAULT_POINT();
+	memcpy(&mem[sp], &ret, 8);
+	ip = address;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(CALLR)
+{
+	u64 r1 = ARG(0);
+	GPR(r1);
+	u64 ret = ip + 8;
+	sp -= 8;
+	FAULT_POINT();
+	memcpy(&mem[sp], &ret, 8);
+	ip = r[r1];
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(RET)
+{
+	FAULT_POINT();
+	memcpy(&ip, &mem[sp], 8);
+	sp += 8;
+	ip += 1;
+	NEXT();
+}
+END_HANDLER
+
+HANDLER(JMP) JUMP_IF(true) END_HANDLER
+HANDLER(JZ ) JUMP_IF(ZF) END_HANDLER
+HANDLER(JE ) JUMP_IF(ZF) END_HANDLER
+HANDLER(JNZ) JUMP_IF(!ZF) END_HANDLER
+HANDLER(JNE) JUMP_IF(!ZF) END_HANDLER
+HANDLER(JGE) JUMP_IF(ZF || !SF) END_HANDLER
+HANDLER(JLE) JUMP_IF(ZF || SF) END_HANDLER
+HANDLER(JGT) JUMP_IF(!ZF && !SF) END_HANDLER
+HANDLER(JLT) JUMP_IF(!ZF && SF) END_HANDLER
+
+HANDLER(CJE  ) CMP_BRANCH(v == 0) END_HANDLER
+HANDLER(CJNE ) CMP_BRANCH(v != 0) END_HANDLER
+HANDLER(CJGT ) CMP_BRANCH(v > 0) END_HANDLER
+HANDLER(CJLT ) CMP_BRANCH(v < 0) END_HANDLER
+HANDLER(CJGE ) CMP_BRANCH(v >= 0) END_HANDLER
+HANDLER(CJLE ) CMP_BRANCH(v <= 0) END_HANDLER
+HANDLER(CJEI ) CMP_BRANCH_I(v == 0) END_HANDLER
+HANDLER(CJNEI) CMP_BRANCH_I(v != 0) END_HANDLER
+HANDLER(CJGTI) CMP_BRANCH_I(v > 0) END_HANDLER
+HANDLER(CJLTI) CMP_BRANCH_I(v < 0) END_HANDLER
+HANDLER(CJGEI) CMP_BRANCH_I(v >= 0) END_HANDLER
+HANDLER(CJLEI) CMP_BRANCH_I(v <= 0) END_HANDLER
+
+#undef ZF
+#undef SF
+#undef CMP_BRANCH_I
+#undef CMP_BRANCH
+#undef JUMP_IF
+#undef ARITH_I
+#undef SHIFT
+#undef ARITH_1
+#undef ARITH_2
+#undef FLAGS
+#undef FAULT_POINT
+#undef GPR
+#undef ARG
@@ -0,0 +1,149 @@
+#include "RegVM.h"
+#include "VMImage.h"
+
+/* VERIFIER
+	one pass over a program as it is loaded, so the other engines can run
+	it without checking anything per instruction. a program passes if
+		every instruction is one the VM implements and ends inside the program
+		register operands are below REG_END
+		jump/call targets are instruction boundaries inside the program
+		address operands (movf/movt) leave room for 8 bytes of guest memory
+	it does not follow values: RET and CALLR targets, IP as an operand,
+	SP-relative accesses and div/mod by zero depend on what the program
+	computes, and a program that passes is trusted with them.
+
+	CHECKED ENGINE
+	table dispatch, but before each instruction CheckedImpl::Check looks at
+	everything that instruction is about to touch: the instruction bytes,
+	register and address operands, the stack slot a push or pop uses (which
+	must stay above the program, and above the guard page if there is one),
+	and the divisor of div/mod. anything out of bounds faults the guest
+	(Context::fault) instead of reaching the host.
+*/
+
+using reg = RegVM::reg;
+using op = RegVM::op;
+
+class CheckedImpl
+{
+public:
+	/* why the instruction at IP must not run, or nullptr */
+	static const char* Check(RegVM::Context* c, u64 memSize, u64 stackFloor, const size_t* sizeTable)
+	{
+		const u64 ip = c->r[reg::IP];
+		if (ip >= memSize)
+			return "ip outside guest memory";
+		const byte opcode = c->mem[ip];
+		const size_t size = sizeTable[opcode];
+		if (size > memSize - ip)
+			return "instruction runs past the end of guest memory";
+		const Bytecode::Operand* operands = Bytecode::GetOperands(opcode);
+		for (size_t i = 0; i < (size - 1) / 8; ++i)
+		{
+			const u64 value = AsType<u64>(c->mem[ip + 1 + 8 * i]);
+			if (operands[i] == Bytecode::REG && value >= reg::REG_END)
+				return "register operand out of range";
+			if (operands[i] == Bytecode::ADDR && (memSize < 8 || value > memSize - 8))
+				return "address outside guest memory";
+		}
+		// the stack must not grow below stackFloor. slots may use the overhang
+		// past the top, as heap memory always has
+		const u64 sp = c->r[reg::SP];
+		switch (opcode)
+		{
+		case op::PUSH: case op::PUSHF: case op::PUSHI: case op::CALLI: case op::CALLR:
+			if (sp < stackFloor + 8 || sp > memSize + VMImage::OVERHANG)
+				return "stack overflow";
+			break;
+		case op::POP: case op::POPF: case op::RET:
+			if (sp > memSize + VMImage::OVERHANG - 8)
+				return "stack underflow";
+			break;
+		case op::DIV: case op::MOD:
+		{
+			const i64 lhs = c->r[RegOperand(c, 0)];
+			const i64 rhs = c->r[RegOperand(c, 1)];
+			if (rhs == 0)
+				return "division by zero";
+			if (rhs == -1 && lhs == INT64_MIN)
+				return "division overflow";
+			break;
+		}
+		default:
+			break;
+		}
+		return nullptr;
+	}
+};
+
+bool RegVM::Verify(size_t size)
+{
+	const byte* mem = m_context.mem;
+	auto reject = [this](u64 address, const char* error)
+	{
+		m_verifyAddress = address;
+		m_verifyError = error;
+		return false;
+	};
+	// first pass: instruction boundaries
+	std::vector<bool> boundary(size, false);
+	for (u64 addr = 0; addr < size; addr += m_opSizeTable[mem[addr]])
+	{
+		const byte opcode = mem[addr];
+		// unimplemented opcodes are left as _nop by Configure
+		if (m_opTable[opcode] == OpImpl::_nop && opcode != op::NOP)
+			return reject(addr, "unknown opcode");
+		if (m_opSizeTable[opcode] > size - addr)
+			return reject(addr, "instruction runs past the end of the program");
+		boundary[addr] = true;
+	}
+	// second pass: operands
+	for (u64 addr = 0; addr < size; addr += m_opSizeTable[mem[addr]])
+	{
+		const byte opcode = mem[addr];
+		const Bytecode::Operand* operands = Bytecode::GetOperands(opcode);
+		for (int i = 0; i < Bytecode::MAX_OPERANDS; ++i)
+		{
+			const u64 value = operands[i] == Bytecode::NONE ? 0 : AsType<u64>(mem[addr + 1 + 8 * i]);
+			switch (operands[i])
+			{
+			case Bytecode::REG:
+				if (value >= reg::REG_END)
+					return reject(addr, "register operand out of range");
+				break;
+			case Bytecode::ADDR:
+				if (m_memSize < 8 || value > m_memSize - 8)
+					return reject(addr, "address outside guest memory");
+				break;
+			case Bytecode::TARGET:
+				if (value >= size || !boundary[value])
+					return reject(addr, "jump target is not an instruction");
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	m_verifyError = nullptr;
+	return true;
+}
+
+void RegVM::RunChecked(u64 budget)
+{
+	// the program, or the guard page below the stack
+	const u64 stackFloor = m_guardLength ? m_guard + m_guardLength : m_codeSize;
+	m_context.running = true;
+	while (m_context.running && budget--)
+	{
+		m_context.r[reg::IP]++;
+		if (const char* fault = CheckedImpl::Check(&m_context, m_memSize, stackFloor, m_opSizeTable))
+		{
+			// IP stays on the instruction that was refused
+			m_context.fault = fault;
+			m_context.running = false;
+			printf("guest fault: %s (ip %llu, sp %llu)\n", fault, (u64)m_context.r[reg::IP], (u64)m_context.r[reg::SP]);
+			return;
+		}
+		m_opTable[m_context.mem[m_context.r[reg::IP]]](&m_context);
+	}
+}
@@ -0,0 +1,29 @@
+#include "Scheduler.h"
+
+Scheduler::Scheduler(u64 quantum) : m_quantum(quantum)
+{
+}
+
+void Scheduler::Add(RegVM* vm)
+{
+	m_ready.push_back(vm);
+}
+
+bool Scheduler::Step()
+{
+	if (m_ready.empty())
+		return false;
+	RegVM* vm = m_ready.front();
+	m_ready.pop_front();
+	m_stats.slices++;
+	if (vm->Run(m_quantum))
+		m_ready.push_back(vm);
+	else
+		m_stats.finished++;
+	return !m_ready.empty();
+}
+
+void Scheduler::Run()
+{
+	while (Step());
+}
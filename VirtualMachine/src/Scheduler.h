@@ -0,0 +1,36 @@
+#pragma once
+
+#include <deque>
+
+#include "RegVM.h"
+
+/* SCHEDULER
+	runs many RegVMs round-robin on the calling thread. each guest gets a
+	slice of at most quantum instructions (RegVM::Run(budget)) and goes to
+	the back of the queue if it has not halted, so a guest that never halts
+	only ever delays the others by its slices.
+	the scheduler does not own the VMs.
+*/
+class Scheduler
+{
+public:
+	struct Stats
+	{
+		size_t slices = 0;		// Run(budget) calls
+		size_t finished = 0;	// guests that halted
+	};
+private:
+	std::deque<RegVM*> m_ready;
+	u64 m_quantum;
+	Stats m_stats;
+public:
+	Scheduler(u64 quantum = 10000);
+	/* vm must already have its program loaded */
+	void Add(RegVM* vm);
+	/* run one slice of the guest at the front. false once no guest is left */
+	bool Step();
+	/* run until every guest has halted */
+	void Run();
+	size_t Pending() const { return m_ready.size(); }
+	const Stats& GetStats() const { return m_stats; }
+};
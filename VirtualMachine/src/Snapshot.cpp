@@ -0,0 +1,125 @@
+#include "Snapshot.h"
+#include "VMImage.h"
+
+#include <cstdio>
+#include <fstream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	struct Header
+	{
+		byte magic[4];
+		u32 version;
+		u32 kind;
+		u32 stateSize;
+		u64 memSize;
+		u64 memOffset;
+	};
+	const byte MAGIC[4] = { 'V', 'M', 'S', 'N' };
+
+	u64 MemoryOffset(size_t stateSize)
+	{
+		const u64 end = sizeof(Header) + stateSize;
+		return (end + Snapshot::ALIGNMENT - 1) / Snapshot::ALIGNMENT * Snapshot::ALIGNMENT;
+	}
+}
+
+bool Snapshot::Save(const char* path, Kind kind, const void* state, size_t stateSize, const byte* mem, size_t memSize)
+{
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		printf("error opening snapshot file [%s]\n", path);
+		return false;
+	}
+	Header header;
+	memcpy(header.magic, MAGIC, 4);
+	header.version = VERSION;
+	header.kind = kind;
+	header.stateSize = static_cast<u32>(stateSize);
+	header.memSize = memSize;
+	header.memOffset = MemoryOffset(stateSize);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(state), stateSize);
+	// pages of zeroes are skipped, leaving holes in the file
+	const size_t PAGE = 4096;
+	static const byte zero[PAGE] = {};
+	for (size_t at = 0; at < memSize; at += PAGE)
+	{
+		const size_t n = memSize - at < PAGE ? memSize - at : PAGE;
+		if (memcmp(mem + at, zero, n) == 0)
+			continue;
+		file.seekp(header.memOffset + at);
+		file.write(reinterpret_cast<const char*>(mem + at), n);
+	}
+	// zeroes up to VMImage::MappedSize, so the view can cover it
+	const char end = 0;
+	file.seekp(header.memOffset + VMImage::MappedSize(memSize) - 1);
+	file.write(&end, 1);
+	return file.good();
+}
+
+byte* Snapshot::Restore(const char* path, Kind kind, void* state, size_t stateSize, size_t* memSize)
+{
+	Header header;
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open())
+		{
+			printf("error opening snapshot file [%s]\n", path);
+			return nullptr;
+		}
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!file || memcmp(header.magic, MAGIC, 4) != 0 || header.version != VERSION || header.kind != kind
+			|| header.stateSize != stateSize || header.memOffset != MemoryOffset(stateSize))
+		{
+			printf("error: [%s] is not a compatible snapshot\n", path);
+			return nullptr;
+		}
+		file.read(reinterpret_cast<char*>(state), stateSize);
+		file.seekg(0, std::ios::end);
+		if (!file || static_cast<u64>(file.tellg()) < header.memOffset + header.memSize + VMImage::OVERHANG)
+		{
+			printf("error: snapshot [%s] is truncated\n", path);
+			return nullptr;
+		}
+	}
+	void* view = nullptr;
+#ifdef _WIN32
+	HANDLE fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE) return nullptr;
+	HANDLE section = CreateFileMappingA(fileHandle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	if (section)
+	{
+		view = MapViewOfFile(section, FILE_MAP_COPY,
+			static_cast<DWORD>(header.memOffset >> 32), static_cast<DWORD>(header.memOffset & 0xffffffff), VMImage::MappedSize(header.memSize));
+		// the view keeps the section and the file open
+		CloseHandle(section);
+	}
+	CloseHandle(fileHandle);
+#else
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+	// pages past the end of a file saved on a host with smaller pages are
+	// only ever the guard page, which is never touched
+	view = mmap(nullptr, VMImage::MappedSize(header.memSize), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, header.memOffset);
+	close(fd);
+	if (view == MAP_FAILED) view = nullptr;
+#endif
+	if (!view)
+	{
+		printf("error mapping snapshot [%s]\n", path);
+		return nullptr;
+	}
+	*memSize = header.memSize;
+	return reinterpret_cast<byte*>(view);
+}
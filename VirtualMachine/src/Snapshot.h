@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Definitions.h"
+
+/* SNAPSHOT FILES
+	the state of a paused VM, so it can be resumed later or on another host
+	(same byte order and state layout).
+		header:		'V' 'M' 'S' 'N', version, kind, state size, memory size,
+					memory offset
+		state:		the VM's registers etc, state size bytes, right after the
+					header
+		memory:		all of guest memory at memory offset, which is aligned to
+					ALIGNMENT so it can be mapped directly. pages of zeroes are
+					left as holes. zeroes follow up to VMImage::MappedSize
+	Restore maps the memory copy-on-write instead of reading it, so pages
+	are only read in when the guest touches them and the file is never
+	written. views are released with VMImage::Unmap.
+*/
+struct Snapshot
+{
+public:
+	enum Kind : u32
+	{
+		REGVM = 1,
+		STACKVM = 2
+	};
+	static const u32 VERSION = 2;
+	// windows maps views at allocation granularity
+	static const u64 ALIGNMENT = 64 * 1024;
+public:
+	static bool Save(const char* path, Kind kind, const void* state, size_t stateSize, const byte* mem, size_t memSize);
+	/* fills state (exactly stateSize bytes) and returns a private view of
+	   the memory, or nullptr if the file is missing or does not match */
+	static byte* Restore(const char* path, Kind kind, void* state, size_t stateSize, size_t* memSize);
+};
@@ -1,27 +1,25 @@
 #include "StackVM.h"
+#include "Snapshot.h"
+#include "VMImage.h"
+#include "GuestMemory.h"
 
-void StackVM::fetch()
+namespace
 {
-	m_context.programCtr++;
-}
-
-void StackVM::decode()
-{
-	u32 instruction = m_context.memory[m_context.programCtr];
-	m_context.next = Instruction::Get(instruction);
-}
-
-void StackVM::execute()
-{
-	m_handlers[m_context.next.opcode](&m_context);
+	/* what a StackVM snapshot stores besides memory */
+	struct SnapshotState
+	{
+		i32 stackPtr;
+		i32 programCtr;
+		i32 running;
+	};
 }
 
 StackVM::StackVM()
 {
-	u32 sz = 1000000;
-	m_context.memory = new (std::nothrow) u32[sz];
-	if (m_context.memory)
-		memset(m_context.memory, 0, sz);
+	u32 sz = MEMORY_WORDS;
+	// reserved, so it is zero and only backed where it is used. the overhang
+	// is the empty stack's top slot
+	m_context.memory = reinterpret_cast<u32*>(GuestMemory::Reserve(sz * sizeof(u32) + VMImage::OVERHANG));
 	m_context.stackPtr = sz;
 	if (!m_context.memory)
 	{
@@ -33,29 +31,130 @@ StackVM::StackVM()
 
 StackVM::~StackVM()
 {
-	delete[] m_context.memory;
+	releaseMemory();
+}
+
+void StackVM::releaseMemory()
+{
+	if (m_mapped)
+		VMImage::Unmap(reinterpret_cast<byte*>(m_context.memory), MEMORY_WORDS * sizeof(u32));
+	else
+		GuestMemory::Release(reinterpret_cast<byte*>(m_context.memory), MEMORY_WORDS * sizeof(u32) + VMImage::OVERHANG);
+	m_context.memory = nullptr;
 }
 
 void StackVM::Run()
+{
+	if (m_trace)
+	{
+		runTraced();
+		return;
+	}
+	if (!m_context.running)
+		return;
+	u32* const mem = m_context.memory;
+	i32 pc = m_context.programCtr;
+	i32 sp = m_context.stackPtr;
+	u32 tos = mem[sp];
+	for (;;)
+	{
+		// same split as Instruction::Get, without the call
+		const u32 instruction = mem[++pc];
+		const u16 data = instruction & 0xffff;
+		switch (instruction >> 16)
+		{
+		case op::HALT:
+			mem[sp] = tos;
+			m_context.programCtr = pc;
+			m_context.stackPtr = sp;
+			m_context.running = FALSE;
+			return;
+		case op::PUSH:
+			mem[sp--] = tos;
+			tos = data;
+			break;
+		case op::ADD:
+			tos = (i16)mem[++sp] + (i16)tos;
+			break;
+		case op::SUB:
+			tos = (i16)mem[++sp] - (i16)tos;
+			break;
+		case op::MUL:
+			tos = (i16)mem[++sp] * (i16)tos;
+			break;
+		case op::DIV:
+			tos = (i16)mem[++sp] / (i16)tos;
+			break;
+		case op::COLUMN:
+			mem[sp--] = tos;
+			tos = data < m_context.rowSize ? m_context.row[data] : 0;
+			break;
+		case op::ALERT:
+			// as the traced handler does
+			puts("ALERT!!");
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void StackVM::runTraced()
 {
 	while (m_context.running)
 	{
 		std::cout << "tos: " << (i32)m_context.memory[m_context.stackPtr] << std::endl;
-		fetch();
-		decode();
-		execute();
+		m_context.next = Instruction::Get(m_context.memory[++m_context.programCtr]);
+		if (m_context.next.opcode < op::OPCODE_END)
+			m_handlers[m_context.next.opcode](&m_context);
 	}
 }
 
+void StackVM::PrintState()
+{
+	printf("tos: %d\n", (i32)m_context.memory[m_context.stackPtr]);
+}
+
 void StackVM::LoadProgram(const void* program, size_t size)
 {
 	memcpy(m_context.memory, program, size);
 }
 
+bool StackVM::SaveSnapshot(const char* path)
+{
+	if (!m_context.memory)
+		return false;
+	SnapshotState state = { m_context.stackPtr, m_context.programCtr, m_context.running };
+	return Snapshot::Save(path, Snapshot::STACKVM, &state, sizeof(state),
+		reinterpret_cast<const byte*>(m_context.memory), MEMORY_WORDS * sizeof(u32));
+}
+
+bool StackVM::LoadSnapshot(const char* path)
+{
+	SnapshotState state;
+	size_t memSize;
+	byte* mem = Snapshot::Restore(path, Snapshot::STACKVM, &state, sizeof(state), &memSize);
+	if (!mem)
+		return false;
+	if (memSize != MEMORY_WORDS * sizeof(u32))
+	{
+		VMImage::Unmap(mem, memSize);
+		printf("error: snapshot [%s] has the wrong memory size\n", path);
+		return false;
+	}
+	releaseMemory();
+	m_context.memory = reinterpret_cast<u32*>(mem);
+	m_mapped = true;
+	m_context.stackPtr = state.stackPtr;
+	m_context.programCtr = state.programCtr;
+	m_context.running = state.running;
+	return true;
+}
+
 void StackVM::configure()
 {
 	// instruction handlers
-	m_handlers[op::NOP] = [](Context* c)
+	m_handlers[op::NOP] = [](Context*)
 	{
 		puts("NOP");
 	};
@@ -64,7 +163,7 @@ void StackVM::configure()
 		puts("HALT");
 		c->running = FALSE;
 	};
-	m_handlers[op::ALERT] = [](Context* c)
+	m_handlers[op::ALERT] = [](Context*)
 	{
 		puts("ALERT!!");
 	};
@@ -97,4 +196,9 @@ void StackVM::configure()
 		*(i32*)&c->memory[c->stackPtr + 1] = (i16)c->memory[c->stackPtr + 1] / (i16)c->memory[c->stackPtr];
 		++c->stackPtr;
 	};
-}
\ No newline at end of file
+	m_handlers[op::COLUMN] = [](Context* c)
+	{
+		puts("COLUMN");
+		c->memory[--c->stackPtr] = c->next.data < c->rowSize ? c->row[c->next.data] : 0;
+	};
+}
@@ -3,12 +3,21 @@
 #include <iostream>
 #include <cstdio>
 #include <vector>
-#include <functional>
 
 #include "VM.h"
 #include "Definitions.h"
 #include "Instruction.h"
 
+/* ENGINES
+	Run:		one loop that fetches, decodes and executes through a switch,
+				with pc, sp and the top of stack kept in host locals. the top
+				slot only goes back to memory when a push buries it or the
+				program halts, so a binary op reads one slot and writes none
+	traced:		SetTrace(true). prints the top of stack and every instruction
+				as it runs, through m_handlers
+	opcodes past OPCODE_END do nothing, like NOP.
+	ColumnEvaluator (ColumnEval.h) runs the same programs over many rows.
+*/
 class StackVM final : public VM
 {
 private:
@@ -16,23 +25,37 @@ private:
 	{
 		Instruction next;
 		u32* memory = nullptr;
-		i16 stackPtr = 0;
-		i16 programCtr= -1;
+		i32 stackPtr = 0;
+		i32 programCtr= -1;
 		i32 running = TRUE;
+		const i32* row = nullptr;	// input columns for COLUMN, see SetRow
+		u32 rowSize = 0;
 	};
-	using InstructionHandler = std::function<void(Context*)>;
+	using InstructionHandler = void(*)(Context*);
 	using op = VMs::Stack::Opcode;
+	static const u32 MEMORY_WORDS = 1000000;
 private:
 	InstructionHandler m_handlers[op::OPCODE_END];
 	Context m_context;
+	bool m_mapped = false;	// memory is a snapshot view, not GuestMemory
+	bool m_trace = false;
 private:
 	void configure();
-	void fetch();
-	void decode();
-	void execute();
+	void runTraced();
+	void releaseMemory();
 public:
 	StackVM();
 	~StackVM();
 	void Run() override;
+	void SetTrace(bool trace) { m_trace = trace; }
+	/* values COLUMN n pushes: row[n], or 0 past the end. row has to outlive Run */
+	void SetRow(const i32* row, size_t size) { m_context.row = row; m_context.rowSize = static_cast<u32>(size); }
+	/* top of stack, where a program leaves its result */
+	i32 GetTop() const { return (i32)m_context.memory[m_context.stackPtr]; }
+	void PrintState();
 	void LoadProgram(const void* program, size_t size) override;
+	using VM::LoadProgram;
+	/* same snapshot files as RegVM, see Snapshot.h */
+	bool SaveSnapshot(const char* path);
+	bool LoadSnapshot(const char* path);
 };
\ No newline at end of file
@@ -1,8 +1,14 @@
 #pragma once
 
+#include "MappedFile.h"
+
 class VM
 {
 public:
+	virtual ~VM() = default;
 	virtual void Run() = 0;
 	virtual void LoadProgram(const void* mem, size_t size) = 0;
+	/* load straight from a mapped program file. VMs that can map the code
+	   into guest memory override this, the rest copy it */
+	virtual void LoadProgram(const MappedFile& file) { LoadProgram(file.Data(), file.Size()); }
 };
\ No newline at end of file
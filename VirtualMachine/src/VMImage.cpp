@@ -0,0 +1,126 @@
+#include "VMImage.h"
+
+#include <cstdio>
+#include <vector>
+
+#include "Bytecode.h"
+#include "GuestMemory.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+VMImage::VMImage(const void* program, size_t size, size_t memSize) : m_memSize(memSize)
+{
+	std::vector<byte> expanded;
+	if (Bytecode::IsV2(program, size))
+	{
+		if (!Bytecode::Expand(reinterpret_cast<const byte*>(program), size, &expanded))
+		{
+			printf("error: malformed v2 program\n");
+			return;
+		}
+		program = expanded.data();
+		size = expanded.size();
+	}
+	if (size > memSize)
+	{
+		printf("error: program does not fit in guest memory\n");
+		return;
+	}
+	m_codeSize = size;
+
+#ifdef _WIN32
+	const u64 total = MappedSize(memSize);
+	HANDLE section = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+		static_cast<DWORD>(total >> 32), static_cast<DWORD>(total & 0xffffffff), nullptr);
+	if (!section) return;
+	void* view = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, size);
+	if (!view)
+	{
+		CloseHandle(section);
+		return;
+	}
+	memcpy(view, program, size);
+	UnmapViewOfFile(view);
+	m_section = section;
+#else
+	int fd = memfd_create("regvm-image", MFD_CLOEXEC);
+	if (fd < 0) return;
+	// the rest of guest memory stays a hole and reads as zero
+	if (ftruncate(fd, MappedSize(memSize)) != 0 || pwrite(fd, program, size, 0) != static_cast<ssize_t>(size))
+	{
+		close(fd);
+		return;
+	}
+	m_fd = fd;
+#endif
+}
+
+VMImage::~VMImage()
+{
+#ifdef _WIN32
+	if (m_section) CloseHandle(m_section);
+#else
+	if (m_fd >= 0) close(m_fd);
+#endif
+}
+
+bool VMImage::Valid() const
+{
+#ifdef _WIN32
+	return m_section != nullptr;
+#else
+	return m_fd >= 0;
+#endif
+}
+
+size_t VMImage::MappedSize(size_t memSize)
+{
+	const size_t page = GuestMemory::PageSize();
+	return (memSize + OVERHANG + page - 1) / page * page + page;
+}
+
+byte* VMImage::Map() const
+{
+	if (!Valid()) return nullptr;
+#ifdef _WIN32
+	return reinterpret_cast<byte*>(MapViewOfFile(m_section, FILE_MAP_COPY, 0, 0, MappedSize(m_memSize)));
+#else
+	void* p = mmap(nullptr, MappedSize(m_memSize), PROT_READ | PROT_WRITE, MAP_PRIVATE, m_fd, 0);
+	return p == MAP_FAILED ? nullptr : reinterpret_cast<byte*>(p);
+#endif
+}
+
+void VMImage::Unmap(byte* view, size_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(view);
+#else
+	munmap(view, MappedSize(size));
+#endif
+}
+
+byte* VMImage::MapProgram(const MappedFile& file, size_t memSize)
+{
+#ifdef _WIN32
+	// MappedFile::MapAt cannot place a view inside an allocation
+	return nullptr;
+#else
+	if (!file.Valid() || file.Size() == 0 || file.Size() > memSize)
+		return nullptr;
+	void* p = mmap(nullptr, MappedSize(memSize), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+	if (!file.MapAt(p))
+	{
+		munmap(p, MappedSize(memSize));
+		return nullptr;
+	}
+	return reinterpret_cast<byte*>(p);
+#endif
+}
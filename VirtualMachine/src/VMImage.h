@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Definitions.h"
+#include "MappedFile.h"
+
+/* VM IMAGE
+	a loaded RegVM program and its initial guest memory, kept in a shared
+	memory object (memfd on linux, a pagefile-backed section on windows).
+	RegVM(const VMImage&) maps it copy-on-write as its guest memory, so every
+	instance shares the image's pages until it writes to them, and creating
+	one costs a mapping instead of an allocation plus a copy.
+	the image can be destroyed while instances are still using it.
+*/
+class VMImage
+{
+private:
+	size_t m_memSize = 0;		// guest memory size
+	size_t m_codeSize = 0;		// v1 program size, from address 0
+#ifdef _WIN32
+	void* m_section = nullptr;	// HANDLE
+#else
+	int m_fd = -1;
+#endif
+public:
+	/* bytes past the end of guest memory that stay mapped (and are
+	   allocated for heap memory too). SP starts at the last byte, so an
+	   8 byte access there runs over */
+	static const size_t OVERHANG = 8;
+	/* address space every guest memory mapping of memSize bytes covers:
+	   OVERHANG, rounded up to host pages, and one page above that for the
+	   guard past the top of the stack (RegVM::PlaceGuard) */
+	static size_t MappedSize(size_t memSize);
+	/* program in either encoding, as for RegVM::LoadProgram */
+	VMImage(const void* program, size_t size, size_t memSize = 1024 * 1024);
+	~VMImage();
+	VMImage(const VMImage&) = delete;
+	VMImage& operator=(const VMImage&) = delete;
+	/* false if the program was malformed or the memory object could not be made */
+	bool Valid() const;
+	size_t GetMemorySize() const { return m_memSize; }
+	size_t GetCodeSize() const { return m_codeSize; }
+	/* private copy-on-write view of the whole guest memory, or nullptr */
+	byte* Map() const;
+	static void Unmap(byte* view, size_t size);
+	/* fresh guest memory of memSize bytes with a v1 program file mapped
+	   copy-on-write at address 0, instead of an image. the pages holding
+	   code are shared with the page cache until the guest writes to them;
+	   the rest of the last one is ordinary heap.
+	   nullptr if that cannot be done here (always on windows) */
+	static byte* MapProgram(const MappedFile& file, size_t memSize);
+};
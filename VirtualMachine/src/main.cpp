@@ -2,14 +2,56 @@
 #include <fstream>
 #include "StackVM.h"
 #include "RegVM.h"
+#include "Scheduler.h"
+#include "Batch.h"
+#include "VMImage.h"
+#include "MappedFile.h"
 #include "Instruction.h"
+#include "ColumnEval.h"
+#include "RegAOT.h"
+#include "ProgramCache.h"
+#include <chrono>
+
+/* load a register vm program through the cache: the v1 code is mapped from
+   the cache entry, which a miss fills in first. false if the cache cannot
+   be used, and the program is left to load as usual */
+static bool LoadCached(RegVM* vm, bool verify, const MappedFile& program, const ProgramCache& cache)
+{
+	const std::string key = cache.Key(program.Data(), program.Size(), ProgramCache::Kind::RegVM);
+	ProgramCache::Info info;
+	MappedFile* code = cache.Find(key, program.Size(), &info);
+	if (!code)
+	{
+		std::vector<byte> expanded(program.Data(), program.Data() + program.Size());
+		// a malformed program is reported by LoadProgram
+		if (Bytecode::IsV2(program.Data(), program.Size()) && !Bytecode::Expand(program.Data(), program.Size(), &expanded))
+			return false;
+		info.sourceSize = program.Size();
+		info.codeSize = expanded.size();
+		if (!cache.Store(key, expanded.data(), info))
+			return false;
+		code = cache.Find(key, program.Size(), &info);
+		if (!code)
+			return false;
+	}
+	if (info.verifiedMemory == vm->GetMemorySize())
+		vm->AssumeVerified();
+	vm->LoadProgram(*code);
+	delete code;
+	if (verify && vm->IsVerified() && info.verifiedMemory != vm->GetMemorySize())
+	{
+		info.verifiedMemory = vm->GetMemorySize();
+		cache.Update(key, info);
+	}
+	return true;
+}
 
 int main(int argc, char** argv)
 {
 	// check args
-	if (argc != 3)
+	if (argc != 3 && argc != 4)
 	{
-		std::cout << "usage: " << argv[0] << " <program file> <mode>\n\tmodes:\n\t\tr: register vm\n\t\ts: stack vm" << std::endl;
+		std::cout << "usage: " << argv[0] << " <program file> <mode> [fusion profile | count | MiB | trace]\n\tmodes:\n\t\tr: register vm, optional guest memory size in MiB (default 1)\n\t\tt: register vm (table dispatch)\n\t\td: register vm (pre-decoded, optional fusion profile, or \"count\" to count superinstruction runs)\n\t\tj: register vm (x86-64 jit)\n\t\tv: register vm, verified on load: runs unchecked if it passes, on the checked engine if not\n\t\tm: register vm, count copies (default 1000) round-robin on one thread\n\t\tb: register vm batch, program file is a manifest (see Batch.h), count worker threads (default: all cores)\n\t\tp: register vm, run count instructions (default 1000000) then write a snapshot to <program file>.snap\n\t\tc: register vm, checkpoint every count instructions (default 1000000) to <program file>.ckpt\n\t\tw: register vm, program file is a snapshot or checkpoint log to resume\n\t\ts: stack vm, \"trace\" prints every instruction\n\t\te: stack vm program evaluated over count rows (default 1000000) of made up columns, see ColumnEval.h\n\t\tx: stack vm program translated to the register vm (see Bytecode.h), run threaded\n\t\tg: register vm program written out as C to <program file>.c (see RegAOT.h)\n\t\tn: register vm running native code from the shared object built from that C, given as the last argument\n\tenvironment:\n\t\tVM_CACHE: directory to keep expanded, translated and verified programs in for the next run (see ProgramCache.h)" << std::endl;
 		return -1;
 	}
 	if (strlen(argv[2]) != 1)
@@ -19,40 +61,295 @@ int main(int argc, char** argv)
 	}
 	// create vm 
 	VM* vm = nullptr;
-	if (*argv[2] == 's')
+	RegVM* regvm = nullptr;
+	StackVM* stackvm = nullptr;
+	size_t guestCount = 0;
+	u64 pauseBudget = 0;
+	u64 checkpointInterval = 0;
+	u64 rowCount = 0;
+	bool translate = false;
+	if (*argv[2] == 'b')
+	{
+		BatchRunner batch;
+		if (!batch.LoadManifest(argv[1]))
+			return -1;
+		batch.Run(argc == 4 ? std::strtoul(argv[3], nullptr, 10) : 0);
+		batch.PrintReport();
+		return 0;
+	}
+	else if (*argv[2] == 'w')
+	{
+		// checkpoint logs start with "VMCK", snapshots with "VMSN"
+		char magic[4] = {};
+		std::ifstream(argv[1], std::ios::binary).read(magic, 4);
+		RegVM resumed;
+		if (!(memcmp(magic, "VMCK", 4) == 0 ? resumed.LoadCheckpoint(argv[1]) : resumed.LoadSnapshot(argv[1])))
+			return -1;
+		resumed.Run();
+		return 0;
+	}
+	else if (*argv[2] == 'g')
+	{
+		MappedFile file(argv[1]);
+		if (!file.Valid())
+		{
+			std::cout << "error opening program file [" << argv[1] << "]" << std::endl;
+			return -1;
+		}
+		// the engines run v1, so that is what gets compiled
+		std::vector<byte> expanded(file.Data(), file.Data() + file.Size());
+		if (Bytecode::IsV2(file.Data(), file.Size()) && !Bytecode::Expand(file.Data(), file.Size(), &expanded))
+		{
+			std::cout << "error: malformed v2 program" << std::endl;
+			return -1;
+		}
+		std::string source;
+		if (!RegAOT::Emit(expanded.data(), expanded.size(), &source))
+		{
+			std::cout << "error: nothing to compile" << std::endl;
+			return -1;
+		}
+		std::string path = std::string(argv[1]) + ".c";
+		std::ofstream out(path, std::ios::binary);
+		out.write(source.data(), source.size());
+		if (!out)
+		{
+			std::cout << "error: unable to write [" << path << "]" << std::endl;
+			return -1;
+		}
+		std::cout << "wrote [" << path << "]" << std::endl;
+		return 0;
+	}
+	else if (*argv[2] == 'n')
+	{
+		if (argc != 4)
+		{
+			std::cout << "error: mode n needs the shared object" << std::endl;
+			return -1;
+		}
+		vm = regvm = new RegVM(RegVM::Engine::Native);
+		if (!regvm->LoadNative(argv[3]))
+			return -1;
+	}
+	else if (*argv[2] == 'p')
+	{
+		pauseBudget = argc == 4 ? std::strtoull(argv[3], nullptr, 10) : 1000000;
+		vm = regvm = new RegVM();
+	}
+	else if (*argv[2] == 'c')
+	{
+		checkpointInterval = argc == 4 ? std::strtoull(argv[3], nullptr, 10) : 1000000;
+		vm = regvm = new RegVM();
+	}
+	else if (*argv[2] == 'm')
+	{
+		guestCount = argc == 4 ? std::strtoul(argv[3], nullptr, 10) : 1000;
+	}
+	else if (*argv[2] == 'e')
+	{
+		rowCount = argc == 4 ? std::strtoull(argv[3], nullptr, 10) : 1000000;
+	}
+	else if (*argv[2] == 'x')
+	{
+		translate = true;
+	}
+	else if (*argv[2] == 's')
 	{
-		vm = new StackVM();
+		vm = stackvm = new StackVM();
+		stackvm->SetTrace(argc == 4 && strcmp(argv[3], "trace") == 0);
 	}
 	else if (*argv[2] == 'r')
 	{
-		vm = new RegVM();
+		size_t memSize = argc == 4 ? std::strtoull(argv[3], nullptr, 10) * 1024 * 1024 : RegVM::DEFAULT_MEMORY;
+		vm = regvm = new RegVM(RegVM::Engine::Threaded, memSize);
+	}
+	else if (*argv[2] == 't')
+	{
+		vm = regvm = new RegVM(RegVM::Engine::Table);
+	}
+	else if (*argv[2] == 'd')
+	{
+		vm = regvm = new RegVM(RegVM::Engine::Decoded);
+		if (argc == 4 && strcmp(argv[3], "count") == 0)
+			regvm->SetFusionCounting(true);
+		else if (argc == 4 && !regvm->LoadFusionProfile(argv[3]))
+			return -1;
+	}
+	else if (*argv[2] == 'j')
+	{
+		vm = regvm = new RegVM(RegVM::Engine::JIT);
+	}
+	else if (*argv[2] == 'v')
+	{
+		vm = regvm = new RegVM();
+		regvm->SetVerify(true);
 	}
 	else
 	{
 		std::cout << "error: invalid mode" << std::endl;
 		return -1;
 	}
-	// open file
-	std::ifstream infile(argv[1], std::ios::binary);
-	if (!infile.is_open())
+	// map the program file, the VM takes it from there
+	MappedFile program(argv[1]);
+	if (!program.Valid())
 	{
 		std::cout << "error opening program file [" << argv[1] << "]" << std::endl;
 		return -1;
 	}
-	// find file size
-	infile.seekg(0, std::ios::end);
-	int rawSize = static_cast<int>(infile.tellg());
-	// reset to beginning
-	infile.seekg(0, std::ios::beg);
-	// allocate memory and read program from file
-	void* program = new byte[rawSize];
-	infile.read((char*)program, rawSize);
-	infile.close();
+	if (guestCount)
+	{
+		// every guest is a copy-on-write view of one image
+		VMImage image(program.Data(), program.Size());
+		if (!image.Valid())
+			return -1;
+		std::vector<RegVM*> guests;
+		// one scheduler slice per guest in turn
+		Scheduler scheduler;
+		for (size_t i = 0; i < guestCount; ++i)
+		{
+			guests.push_back(new RegVM(image));
+			scheduler.Add(guests.back());
+		}
+		scheduler.Run();
+		const Scheduler::Stats& s = scheduler.GetStats();
+		printf("SCHEDULER:\n------------\nguests:\t\t%zu\nslices:\t\t%zu\n", s.finished, s.slices);
+		for (RegVM* guest : guests)
+			delete guest;
+		return 0;
+	}
+	if (rowCount)
+	{
+		ColumnEvaluator eval;
+		if (!eval.Compile(program.Data(), program.Size()))
+		{
+			printf("error: %s\n", eval.GetError());
+			return -1;
+		}
+		// made up inputs, every column a different sequence. never 0, so
+		// $n as a divisor does not trip up the StackVM runs below
+		std::vector<std::vector<i32>> columns(eval.GetColumnCount(), std::vector<i32>(rowCount));
+		std::vector<const i32*> inputs;
+		u32 seed = 12345;
+		for (auto& column : columns)
+		{
+			for (i32& value : column)
+			{
+				seed = seed * 1103515245 + 12345;
+				value = static_cast<i32>((seed >> 16) % 1000 + 1) * ((seed >> 8) & 1 ? -1 : 1);
+			}
+			inputs.push_back(column.data());
+		}
+		std::vector<i32> results[2];
+		const ColumnEvaluator::Kernels kernels[2] = { ColumnEvaluator::Kernels::Scalar, ColumnEvaluator::Kernels::AVX2 };
+		printf("COLUMNS:\n------------\nrows:\t\t%llu\ncolumns:\t%zu\n", rowCount, columns.size());
+		for (int k = 0; k < 2; ++k)
+		{
+			eval.SetKernels(kernels[k]);
+			results[k].resize(rowCount);
+			auto start = std::chrono::steady_clock::now();
+			eval.Evaluate(inputs.data(), inputs.size(), rowCount, results[k].data());
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			printf("%s:\t\t%.1f million rows/s\n", eval.GetKernels() == ColumnEvaluator::Kernels::AVX2 ? "avx2" : "scalar",
+				seconds > 0 ? rowCount / seconds / 1e6 : 0.0);
+		}
+		if (results[0] != results[1])
+			printf("error: scalar and avx2 results differ\n");
+		// the first rows again, one StackVM run each
+		std::vector<i32> row(columns.size());
+		for (u64 i = 0; i < rowCount && i < 100; ++i)
+		{
+			for (size_t c = 0; c < columns.size(); ++c)
+				row[c] = columns[c][i];
+			StackVM reference;
+			reference.LoadProgram(program);
+			reference.SetRow(row.data(), row.size());
+			reference.Run();
+			if (reference.GetTop() != results[0][i])
+			{
+				printf("error: row %llu is %d, StackVM says %d\n", i, results[0][i], reference.GetTop());
+				return -1;
+			}
+		}
+		printf("row 0:\t\t%d\n", rowCount ? results[0][0] : 0);
+		return 0;
+	}
 	// load and run program
-	vm->LoadProgram(program, rawSize);
-	delete[] program;
+	// programs an earlier run already expanded, translated or verified
+	const std::string cacheDir = ProgramCache::GetDirectory();
+	ProgramCache* cache = cacheDir.empty() ? nullptr : new ProgramCache(cacheDir.c_str());
+	if (translate)
+	{
+		std::vector<byte> translated;
+		ProgramCache::Info info;
+		std::string key;
+		MappedFile* cached = nullptr;
+		if (cache)
+		{
+			key = cache->Key(program.Data(), program.Size(), ProgramCache::Kind::Translated);
+			cached = cache->Find(key, program.Size(), &info);
+		}
+		if (!cached)
+		{
+			if (!Bytecode::TranslateStack(program.Data(), program.Size(), &translated, &info.rowOffset))
+			{
+				std::cout << "error: program cannot be translated for the register vm" << std::endl;
+				return -1;
+			}
+			info.sourceSize = program.Size();
+			info.codeSize = translated.size();
+			if (cache && cache->Store(key, translated.data(), info))
+				cached = cache->Find(key, program.Size(), &info);
+		}
+		// translated code is bigger than the stack program, leave 1 MiB past it
+		RegVM translatedVM(RegVM::Engine::Threaded, ((info.codeSize >> 20) + 1) * 1024 * 1024 + RegVM::DEFAULT_MEMORY);
+		if (cached)
+			translatedVM.LoadProgram(*cached);
+		else
+			translatedVM.LoadProgram(translated.data(), translated.size());
+		delete cached;
+		translatedVM.Run();
+		translatedVM.PrintState();
+		delete cache;
+		return 0;
+	}
+	// the cache only pays off where there is work to skip: expanding v2 or verifying
+	const bool verify = *argv[2] == 'v';
+	bool loaded = false;
+	if (cache && !stackvm && (verify || Bytecode::IsV2(program.Data(), program.Size())))
+		loaded = LoadCached(static_cast<RegVM*>(vm), verify, program, *cache);
+	if (!loaded)
+		vm->LoadProgram(program);
+	delete cache;
+	if (pauseBudget)
+	{
+		std::string path = std::string(argv[1]) + ".snap";
+		if (!regvm->Run(pauseBudget))
+			std::cout << "halted within " << pauseBudget << " instructions, no snapshot written" << std::endl;
+		else if (regvm->SaveSnapshot(path.c_str()))
+			std::cout << "paused after " << pauseBudget << " instructions, snapshot written to [" << path << "]" << std::endl;
+		delete vm;
+		return 0;
+	}
+	if (checkpointInterval)
+	{
+		std::string path = std::string(argv[1]) + ".ckpt";
+		if (!regvm->StartCheckpoints(path.c_str()))
+			return -1;
+		while (regvm->Run(checkpointInterval))
+			regvm->Checkpoint();
+		regvm->PrintStats();
+		delete vm;
+		return 0;
+	}
 
 	vm->Run();
+	// the registers a guest stopped with
+	if (regvm && regvm->GetFault())
+		regvm->PrintState();
+	if (regvm)
+		regvm->PrintStats();
+	if (stackvm)
+		stackvm->PrintState();
 
 	delete vm;
 	return 0;